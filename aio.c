@@ -0,0 +1,561 @@
+#include "aio.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sched.h>
+
+#if defined(__linux__) && !defined(COMP_DOC_NO_IO_URING)
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#define COMP_DOC_HAVE_IO_URING
+#endif
+
+static void
+request_complete(comp_doc_aio_t *aio, comp_doc_aio_request_t *request)
+{
+    request->next = aio->done;
+    aio->done = request;
+}
+
+/*
+ * Fails the runs that are still waiting for room in the ring. Their
+ * requests complete once their other runs have.
+ */
+static void
+backlog_cancel(comp_doc_aio_t *aio)
+{
+    comp_doc_aio_op_t *op;
+
+    while(aio->backlog != NULL)
+    {
+        op = aio->backlog;
+        aio->backlog = op->next;
+        op->request->err = COMP_DOC_READ_ERR;
+
+        if(--op->request->pending == 0)
+            request_complete(aio, op->request);
+    }
+
+    aio->backlog_tail = NULL;
+}
+
+#ifdef COMP_DOC_HAVE_IO_URING
+
+static int
+io_uring_setup(unsigned int entries, struct io_uring_params *params)
+{
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int
+io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+/*
+ * Sets up the ring and maps its queues. On failure the context is left
+ * without a ring, and the synchronous path is used.
+ */
+static int
+ring_init(comp_doc_aio_t *aio, unsigned int entries)
+{
+    struct io_uring_params params;
+    uint8_t *sq, *cq;
+    int fd;
+
+    memset(&params, 0, sizeof(params));
+
+    if((fd = io_uring_setup(entries, &params)) < 0)
+        return COMP_DOC_READ_ERR;
+
+    aio->ring_fd = fd;
+    aio->entries = params.sq_entries;
+
+    aio->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    aio->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    // both queues share one mapping on kernels that allow it
+    if(params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if(aio->cq_ring_size > aio->sq_ring_size)
+            aio->sq_ring_size = aio->cq_ring_size;
+        aio->cq_ring_size = 0;
+    }
+
+    aio->sq_ring = mmap(NULL, aio->sq_ring_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+
+    if(aio->sq_ring == MAP_FAILED)
+    {
+        aio->sq_ring = NULL;
+        return COMP_DOC_READ_ERR;
+    }
+
+    if(aio->cq_ring_size == 0)
+    {
+        aio->cq_ring = aio->sq_ring;
+    }
+    else
+    {
+        aio->cq_ring = mmap(NULL, aio->cq_ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+
+        if(aio->cq_ring == MAP_FAILED)
+        {
+            aio->cq_ring = NULL;
+            return COMP_DOC_READ_ERR;
+        }
+    }
+
+    aio->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    aio->sqes = mmap(NULL, aio->sqes_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+
+    if(aio->sqes == MAP_FAILED)
+    {
+        aio->sqes = NULL;
+        return COMP_DOC_READ_ERR;
+    }
+
+    sq = aio->sq_ring;
+    cq = aio->cq_ring;
+
+    aio->sq_head = (unsigned int *)(sq + params.sq_off.head);
+    aio->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+    aio->sq_mask = (unsigned int *)(sq + params.sq_off.ring_mask);
+    aio->sq_array = (unsigned int *)(sq + params.sq_off.array);
+    aio->cq_head = (unsigned int *)(cq + params.cq_off.head);
+    aio->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+    aio->cq_mask = (unsigned int *)(cq + params.cq_off.ring_mask);
+    aio->cqes = cq + params.cq_off.cqes;
+
+    return COMP_DOC_SUCCESS;
+}
+
+static void
+ring_destroy(comp_doc_aio_t *aio)
+{
+    if(aio->sqes != NULL)
+        munmap(aio->sqes, aio->sqes_size);
+    if(aio->cq_ring != NULL && aio->cq_ring != aio->sq_ring)
+        munmap(aio->cq_ring, aio->cq_ring_size);
+    if(aio->sq_ring != NULL)
+        munmap(aio->sq_ring, aio->sq_ring_size);
+    if(aio->ring_fd != -1)
+        close(aio->ring_fd);
+
+    aio->sqes = aio->cq_ring = aio->sq_ring = NULL;
+    aio->ring_fd = -1;
+}
+
+/*
+ * Returns how many entries have been published in the ring and not
+ * consumed by the kernel yet.
+ */
+static unsigned int
+ring_pending(comp_doc_aio_t *aio)
+{
+    return *aio->sq_tail - __atomic_load_n(aio->sq_head, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Takes back the entries that the kernel refused, failing their requests.
+ */
+static void
+ring_cancel(comp_doc_aio_t *aio)
+{
+    struct io_uring_sqe *sqe;
+    comp_doc_aio_op_t *op;
+    unsigned int head, i;
+
+    head = __atomic_load_n(aio->sq_head, __ATOMIC_ACQUIRE);
+
+    for(i = head; i != *aio->sq_tail; i++)
+    {
+        sqe = (struct io_uring_sqe *)aio->sqes + aio->sq_array[i & *aio->sq_mask];
+        op = (comp_doc_aio_op_t *)(uintptr_t)sqe->user_data;
+        op->request->err = COMP_DOC_READ_ERR;
+        aio->inflight--;
+
+        if(--op->request->pending == 0)
+            request_complete(aio, op->request);
+    }
+
+    __atomic_store_n(aio->sq_tail, head, __ATOMIC_RELEASE);
+}
+
+/*
+ * Moves runs from the backlog into the ring, as long as there is room,
+ * and hands the kernel every entry it has not consumed yet, including
+ * those left over by an earlier call. When the kernel is short of
+ * resources or of room for completions, the entries stay in the ring
+ * until some reads have completed and been reaped. With no read in flight
+ * to wait for, the call is retried a few times instead. The entries, and
+ * the runs left in the backlog, are failed on any other error.
+ */
+static int
+ring_submit(comp_doc_aio_t *aio)
+{
+    struct io_uring_sqe *sqe;
+    comp_doc_aio_op_t *op;
+    unsigned int tail, index, queued, pending, retries;
+    int ret;
+
+    tail = *aio->sq_tail;
+    queued = 0;
+
+    while(aio->backlog != NULL && aio->inflight < aio->entries)
+    {
+        op = aio->backlog;
+        aio->backlog = op->next;
+        if(aio->backlog == NULL)
+            aio->backlog_tail = NULL;
+
+        index = tail & *aio->sq_mask;
+        sqe = (struct io_uring_sqe *)aio->sqes + index;
+
+        // IORING_OP_READV is the oldest read operation, supported since 5.1
+        memset(sqe, 0, sizeof(struct io_uring_sqe));
+        sqe->opcode = IORING_OP_READV;
+        sqe->fd = op->request->file->fd;
+        sqe->off = op->offset;
+        sqe->addr = (uint64_t)(uintptr_t)&op->iov;
+        sqe->len = 1;
+        sqe->user_data = (uint64_t)(uintptr_t)op;
+
+        aio->sq_array[index] = index;
+        tail++;
+        queued++;
+        aio->inflight++;
+    }
+
+    if(queued > 0)
+        __atomic_store_n(aio->sq_tail, tail, __ATOMIC_RELEASE);
+
+    retries = 0;
+
+    while((pending = ring_pending(aio)) > 0)
+    {
+        ret = io_uring_enter(aio->ring_fd, pending, 0, 0);
+
+        if(ret > 0 || (ret < 0 && errno == EINTR))
+            continue;
+
+        if(ret < 0 && (errno == EAGAIN || errno == EBUSY))
+        {
+            // the reads in flight, or completions not reaped yet, free some room
+            if(aio->inflight > pending)
+                return COMP_DOC_SUCCESS;
+
+            if(retries++ < COMP_DOC_AIO_RETRIES)
+            {
+                sched_yield();
+                continue;
+            }
+        }
+
+        ring_cancel(aio);
+        backlog_cancel(aio);
+        return COMP_DOC_READ_ERR;
+    }
+
+    return COMP_DOC_SUCCESS;
+}
+
+#endif /* COMP_DOC_HAVE_IO_URING */
+
+/*
+ * Creates an asynchronous reader that keeps up to `depth' reads in flight.
+ * The context is allocated with the hooks of `file', which must stay open
+ * until comp_doc_aio_destroy; it may still read from other files.
+ */
+int
+comp_doc_aio_init(comp_doc_file_t *file, unsigned int depth, comp_doc_aio_t **ret_aio)
+{
+    comp_doc_aio_t *aio;
+
+    *ret_aio = NULL;
+
+    aio = doc_calloc(file, 1, sizeof(comp_doc_aio_t));
+
+    if(aio == NULL)
+        return COMP_DOC_NO_MEM;
+
+    aio->file = file;
+    aio->ring_fd = -1;
+
+#ifdef COMP_DOC_HAVE_IO_URING
+    if(ring_init(aio, depth ? depth : 64) != COMP_DOC_SUCCESS)
+        ring_destroy(aio);
+#endif
+
+    *ret_aio = aio;
+
+    return COMP_DOC_SUCCESS;
+}
+
+/*
+ * Submits the read of the stream that corresponds to the given directory
+ * entry. Every run of contiguous sectors of the stream becomes one read in
+ * the ring, and `cb' is called from comp_doc_aio_poll once all of them have
+ * completed. The stream goes to `buffer', which must hold the whole stream,
+ * or to a buffer allocated for it when `buffer' is NULL, to be released with
+ * comp_doc_free. When the ring fails, the reads it held fail, and their
+ * callbacks still run with COMP_DOC_READ_ERR.
+ */
+int
+comp_doc_aio_read_stream(comp_doc_aio_t *aio, comp_doc_file_t *file, comp_doc_directory_t *dir,
+    unsigned char *buffer, comp_doc_aio_cb cb, void *user)
+{
+    comp_doc_aio_request_t *request;
+    comp_doc_run_t *runs;
+    size_t nruns, capacity, i;
+    ssize_t bytes_read;
+    int err;
+
+    if(!IS_DIR_STREAM(dir))
+        return COMP_DOC_NO_STREAM;
+
+    if((err = load_tables(file, COMP_DOC_LOADED_ALL)) != COMP_DOC_SUCCESS)
+        return err;
+
+    request = doc_calloc(file, 1, sizeof(comp_doc_aio_request_t));
+
+    if(request == NULL)
+        return COMP_DOC_NO_MEM;
+
+    request->file = file;
+    request->dir = dir;
+    request->cb = cb;
+    request->user = user;
+    request->buffer = buffer;
+
+    if(request->buffer == NULL)
+    {
+        request->buffer = doc_malloc(file, dir->size ? dir->size : 1);
+
+        if(request->buffer == NULL)
+        {
+            doc_free(file, request);
+            return COMP_DOC_NO_MEM;
+        }
+    }
+
+    aio->requests++;
+
+    // mapped files and short streams held in memory gain nothing from the ring
+    if(aio->ring_fd == -1 || file->map != NULL || IS_SHORT_CACHED(file, dir))
+    {
+        bytes_read = comp_doc_read_stream_into(file, dir, request->buffer, dir->size);
+        request->err = bytes_read < 0 ? bytes_read : COMP_DOC_SUCCESS;
+        request_complete(aio, request);
+        return COMP_DOC_SUCCESS;
+    }
+
+    runs = NULL;
+    nruns = capacity = 0;
+
+    if((err = collect_stream_runs(file, dir, request->buffer, &runs, &nruns, &capacity)) != COMP_DOC_SUCCESS
+        || nruns == 0)
+    {
+        doc_free(file, runs);
+        request->err = err;
+        request_complete(aio, request);
+        return COMP_DOC_SUCCESS;
+    }
+
+    request->ops = doc_malloc(file, nruns * sizeof(comp_doc_aio_op_t));
+
+    if(request->ops == NULL)
+    {
+        doc_free(file, runs);
+        request->err = COMP_DOC_NO_MEM;
+        request_complete(aio, request);
+        return COMP_DOC_SUCCESS;
+    }
+
+    for(i = 0; i < nruns; i++)
+    {
+        request->ops[i].iov.iov_base = runs[i].buffer;
+        request->ops[i].iov.iov_len = runs[i].length;
+        request->ops[i].offset = runs[i].offset;
+        request->ops[i].request = request;
+        request->ops[i].next = NULL;
+
+        if(aio->backlog_tail != NULL)
+            aio->backlog_tail->next = &request->ops[i];
+        else
+            aio->backlog = &request->ops[i];
+        aio->backlog_tail = &request->ops[i];
+    }
+
+    request->pending = nruns;
+    doc_free(file, runs);
+
+#ifdef COMP_DOC_HAVE_IO_URING
+    return ring_submit(aio);
+#else
+    return COMP_DOC_SUCCESS;
+#endif
+}
+
+/*
+ * Runs the callbacks of the completed requests and releases them.
+ * Returns how many there were.
+ */
+static int
+deliver(comp_doc_aio_t *aio)
+{
+    comp_doc_aio_request_t *request;
+    comp_doc_file_t *file;
+    int n;
+
+    n = 0;
+
+    while(aio->done != NULL)
+    {
+        request = aio->done;
+        aio->done = request->next;
+        aio->requests--;
+        file = request->file;
+
+        if(request->cb != NULL)
+            request->cb(request->user, request->dir, request->buffer, request->err);
+
+        doc_free(file, request->ops);
+        doc_free(file, request);
+        n++;
+    }
+
+    return n;
+}
+
+#ifdef COMP_DOC_HAVE_IO_URING
+
+/*
+ * Handles the completions found in the ring. Reads that came back short
+ * are queued again for the rest of their run.
+ */
+static void
+ring_reap(comp_doc_aio_t *aio)
+{
+    struct io_uring_cqe *cqe;
+    comp_doc_aio_op_t *op;
+    comp_doc_aio_request_t *request;
+    unsigned int head, tail;
+
+    head = *aio->cq_head;
+    tail = __atomic_load_n(aio->cq_tail, __ATOMIC_ACQUIRE);
+
+    for(; head != tail; head++)
+    {
+        cqe = (struct io_uring_cqe *)aio->cqes + (head & *aio->cq_mask);
+        op = (comp_doc_aio_op_t *)(uintptr_t)cqe->user_data;
+        request = op->request;
+        aio->inflight--;
+
+        if(cqe->res == -EINTR || cqe->res == -EAGAIN)
+        {
+            // try the same read again
+        }
+        else if(cqe->res <= 0)
+        {
+            // hitting the end of the file is an error as well
+            request->err = COMP_DOC_READ_ERR;
+            op->iov.iov_len = 0;
+        }
+        else
+        {
+            op->iov.iov_base = (uint8_t *)op->iov.iov_base + cqe->res;
+            op->iov.iov_len -= cqe->res;
+            op->offset += cqe->res;
+        }
+
+        if(op->iov.iov_len > 0)
+        {
+            op->next = NULL;
+            if(aio->backlog_tail != NULL)
+                aio->backlog_tail->next = op;
+            else
+                aio->backlog = op;
+            aio->backlog_tail = op;
+        }
+        else if(--request->pending == 0)
+        {
+            request_complete(aio, request);
+        }
+    }
+
+    __atomic_store_n(aio->cq_head, head, __ATOMIC_RELEASE);
+}
+
+#endif /* COMP_DOC_HAVE_IO_URING */
+
+/*
+ * Runs the callbacks of the requests that have completed. If fewer than
+ * `min_complete' have, waits for more, unless nothing is in flight.
+ * Returns the number of requests completed or a negative error code.
+ */
+int
+comp_doc_aio_poll(comp_doc_aio_t *aio, unsigned int min_complete)
+{
+    int n, ret;
+
+    n = deliver(aio);
+
+#ifdef COMP_DOC_HAVE_IO_URING
+    while(aio->ring_fd != -1)
+    {
+        ring_reap(aio);
+
+        if((ret = ring_submit(aio)) != COMP_DOC_SUCCESS)
+            return ret;
+
+        n += deliver(aio);
+
+        if((unsigned int)n >= min_complete || aio->inflight == 0)
+            break;
+
+        ret = io_uring_enter(aio->ring_fd, 0, 1, IORING_ENTER_GETEVENTS);
+
+        if(ret < 0 && errno != EINTR)
+            return COMP_DOC_READ_ERR;
+    }
+#else
+    (void)ret;
+#endif
+
+    return n;
+}
+
+/*
+ * Releases the reader. Requests still in flight are waited for, and their
+ * callbacks run. Runs that could not be handed to the ring any more fail
+ * with COMP_DOC_READ_ERR.
+ */
+void
+comp_doc_aio_destroy(comp_doc_aio_t *aio)
+{
+    if(aio == NULL)
+        return;
+
+    while(aio->requests > 0)
+    {
+        if(comp_doc_aio_poll(aio, aio->requests) <= 0 && aio->inflight == 0)
+            break;
+    }
+
+    // the ring has failed, or was left with nothing to wait for
+    backlog_cancel(aio);
+    deliver(aio);
+
+#ifdef COMP_DOC_HAVE_IO_URING
+    ring_destroy(aio);
+#endif
+
+    doc_free(aio->file, aio);
+}
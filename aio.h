@@ -0,0 +1,85 @@
+#ifndef _COMP_DOC_AIO_H_
+#define _COMP_DOC_AIO_H_
+#include <sys/uio.h>
+#include "compdoc.h"
+#include "io.h"
+
+/*
+ * Called once a stream submitted with comp_doc_aio_read_stream has been
+ * read, or has failed with `err'.
+ */
+typedef void (*comp_doc_aio_cb)(void *user, comp_doc_directory_t *dir, unsigned char *buffer, int err);
+
+/* times the ring is entered again when the kernel is short of resources */
+#define COMP_DOC_AIO_RETRIES 16
+
+struct comp_doc_aio_request;
+
+/*
+ * A read of a run of contiguous sectors, one ring entry.
+ */
+typedef struct comp_doc_aio_op {
+    struct iovec iov;
+    off_t offset;
+    struct comp_doc_aio_request *request;
+    struct comp_doc_aio_op *next;
+} comp_doc_aio_op_t;
+
+typedef struct comp_doc_aio_request {
+    comp_doc_file_t *file;
+    comp_doc_directory_t *dir;
+    unsigned char *buffer;
+    comp_doc_aio_cb cb;
+    void *user;
+    /* runs that have not completed yet */
+    size_t pending;
+    int err;
+    comp_doc_aio_op_t *ops;
+    struct comp_doc_aio_request *next;
+} comp_doc_aio_request_t;
+
+/*
+ * Asynchronous reader. Without io_uring (old kernels, seccomp filters or
+ * COMP_DOC_NO_IO_URING at build time) the streams are read synchronously
+ * when submitted, and their callbacks still run from comp_doc_aio_poll.
+ * A context is meant to be driven by a single thread, but it may read
+ * from any number of open files.
+ */
+typedef struct {
+    /* the file whose allocator the context comes from */
+    comp_doc_file_t *file;
+    int ring_fd;
+    unsigned int entries;
+    /* ring entries handed to the kernel and not completed yet */
+    unsigned int inflight;
+    /* submitted requests that have not completed yet */
+    unsigned int requests;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    void *sqes;
+    size_t sqes_size;
+
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    void *cqes;
+
+    /* runs waiting for room in the ring */
+    comp_doc_aio_op_t *backlog;
+    comp_doc_aio_op_t *backlog_tail;
+    /* requests whose callback has to run */
+    comp_doc_aio_request_t *done;
+} comp_doc_aio_t;
+
+int comp_doc_aio_init(comp_doc_file_t *, unsigned int, comp_doc_aio_t **);
+int comp_doc_aio_read_stream(comp_doc_aio_t *, comp_doc_file_t *, comp_doc_directory_t *, unsigned char *, comp_doc_aio_cb, void *);
+int comp_doc_aio_poll(comp_doc_aio_t *, unsigned int);
+void comp_doc_aio_destroy(comp_doc_aio_t *);
+#endif /* _COMP_DOC_AIO_H_ */
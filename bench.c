@@ -0,0 +1,812 @@
+/*
+ * Benchmarks: generates a compound document with the requested layout and
+ * times the main operations of the library on it.
+ *
+ *   bench [-S 9|12] [-n streams] [-b big%] [-B big size] [-s small max]
+ *         [-f none|interleave|shuffle] [-x extra SAT sectors] [-r repeat]
+ *         [-m] [-o file]
+ *
+ * Fragmentation spreads the sectors of every chain (streams, mini stream
+ * container, SSAT and directory) across the file: `interleave' alternates
+ * the chains sector by sector, `shuffle' places every sector at random.
+ * Extra SAT sectors grow the MSAT past the header, into its own sectors.
+ *
+ * Each phase reports ns/op, read syscalls/op (from /proc/self/io) and the
+ * peak RSS so far. The file is written just before, so it is read from the
+ * page cache.
+ */
+#include "compdoc.h"
+#include "cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#define BENCH_FRAG_NONE 0
+#define BENCH_FRAG_INTERLEAVE 1
+#define BENCH_FRAG_SHUFFLE 2
+
+#define BENCH_CUTOFF 4096
+#define BENCH_SHORT_SECTOR 64
+
+typedef struct {
+    unsigned int ssz;
+    uint32_t nstreams;
+    unsigned int big_percent;
+    uint32_t big_size;
+    uint32_t small_max;
+    int frag;
+    uint32_t extra_sat;
+    uint64_t seed;
+} bench_params_t;
+
+/*
+ * A chain of sectors in the generated file, and what goes in it.
+ */
+typedef struct {
+    /* data of the chain, or NULL for stream `stream' */
+    unsigned char *data;
+    uint32_t stream;
+    uint32_t size;
+    uint32_t nsectors;
+    uint32_t *secids;
+} bench_chain_t;
+
+static uint64_t rng_state;
+/* read syscalls made by read_syscalls itself */
+static long long syscalls_overhead;
+
+static uint64_t
+rng_next(void)
+{
+    uint64_t z = (rng_state += 0x9E3779B97F4A7C15ULL);
+
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+
+    return z ^ (z >> 31);
+}
+
+static void *
+xcalloc(size_t n, size_t size)
+{
+    void *p = calloc(n ? n : 1, size);
+
+    if(p == NULL)
+    {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    return p;
+}
+
+/*
+ * Contents of the streams, a function of the stream and the offset, so
+ * that reads can be checked without keeping a copy.
+ */
+static void
+stream_fill(uint32_t stream, uint64_t offset, unsigned char *buffer, size_t length)
+{
+    uint64_t z;
+    size_t i;
+
+    for(i = 0; i < length; i++, offset++)
+    {
+        z = ((uint64_t)stream << 40 ^ (offset >> 3)) * 0x9E3779B97F4A7C15ULL;
+        z ^= z >> 29;
+        buffer[i] = z >> ((offset & 7) * 8);
+    }
+}
+
+static void
+shuffle(uint32_t *v, uint32_t n)
+{
+    uint32_t i, j, t;
+
+    for(i = n; i > 1; i--)
+    {
+        j = rng_next() % i;
+        t = v[i - 1];
+        v[i - 1] = v[j];
+        v[j] = t;
+    }
+}
+
+/*
+ * Hands out the sectors 0..total-1 to the chains, in the order given by
+ * the fragmentation level.
+ */
+static void
+place_chains(bench_chain_t *chains, uint32_t nchains, uint32_t total, int frag)
+{
+    uint32_t *owner, *index, *fill;
+    uint32_t c, k, n, round;
+
+    owner = xcalloc(total, sizeof(uint32_t));
+    index = xcalloc(total, sizeof(uint32_t));
+    fill = xcalloc(nchains, sizeof(uint32_t));
+    n = 0;
+
+    if(frag == BENCH_FRAG_INTERLEAVE)
+    {
+        for(round = 0; n < total; round++)
+        {
+            for(c = 0; c < nchains; c++)
+            {
+                if(round < chains[c].nsectors)
+                {
+                    owner[n] = c;
+                    index[n++] = round;
+                }
+            }
+        }
+    }
+    else
+    {
+        for(c = 0; c < nchains; c++)
+        {
+            for(k = 0; k < chains[c].nsectors; k++)
+            {
+                owner[n] = c;
+                index[n++] = k;
+            }
+        }
+    }
+
+    // a sector keeps its rank within its chain, so chains stay in order
+    if(frag == BENCH_FRAG_SHUFFLE)
+    {
+        shuffle(owner, total);
+
+        for(n = 0; n < total; n++)
+            index[n] = fill[owner[n]]++;
+    }
+
+    for(n = 0; n < total; n++)
+        chains[owner[n]].secids[index[n]] = n;
+
+    free(owner);
+    free(index);
+    free(fill);
+}
+
+static void
+link_chain(uint32_t *table, uint32_t *secids, uint32_t n)
+{
+    uint32_t k;
+
+    for(k = 0; k < n; k++)
+        table[secids[k]] = k + 1 < n ? secids[k + 1] : SECID_END_OF_CHAIN;
+}
+
+static const char *bench_names_base;
+
+static int
+compare_names(const void *a, const void *b)
+{
+    const char *x = bench_names_base + *(const uint32_t *)a * 32;
+    const char *y = bench_names_base + *(const uint32_t *)b * 32;
+    size_t lx = strlen(x), ly = strlen(y);
+
+    if(lx != ly)
+        return lx < ly ? -1 : 1;
+
+    return strcmp(x, y);
+}
+
+/*
+ * Links the sorted entries into a balanced tree, all black, which is a
+ * valid red-black tree. Returns the root.
+ */
+static uint32_t
+build_tree(comp_doc_directory_t *dirs, uint32_t *sorted, uint32_t n)
+{
+    uint32_t m;
+
+    if(n == 0)
+        return COMP_DOC_DIRECTORY_NO_NODE;
+
+    m = n / 2;
+    dirs[sorted[m]].left_child_dirid = build_tree(dirs, sorted, m);
+    dirs[sorted[m]].right_child_dirid = build_tree(dirs, sorted + m + 1, n - m - 1);
+
+    return sorted[m];
+}
+
+/*
+ * Writes a compound document with the given layout to `path'. The sizes of
+ * the streams are returned in `sizes'.
+ */
+static int
+generate(const bench_params_t *p, const char *path, uint32_t **ret_sizes)
+{
+    uint32_t S = 1u << p->ssz, per = S / 4;
+    uint32_t *sizes, *ssat, *sat, *sorted, *short_secids, *short_first;
+    uint32_t s, k, c, nshort, nchains, ndata, nsat, nmsat, need, nm, nslots, nshort_slots, ndir_sectors, mini_chain;
+    bench_chain_t *chains;
+    comp_doc_directory_t *dirs;
+    comp_doc_header_t *hdr;
+    unsigned char *image, *mini, *sector;
+    uint32_t *msat_slots;
+    char *names;
+    size_t image_size;
+    FILE *fp;
+
+    sizes = xcalloc(p->nstreams, sizeof(uint32_t));
+    short_first = xcalloc(p->nstreams, sizeof(uint32_t));
+    nshort = 0;
+
+    for(s = 0; s < p->nstreams; s++)
+    {
+        if(rng_next() % 100 < p->big_percent)
+            sizes[s] = p->big_size;
+        else
+            sizes[s] = 1 + rng_next() % p->small_max;
+
+        if(sizes[s] < BENCH_CUTOFF)
+            nshort += (sizes[s] + BENCH_SHORT_SECTOR - 1) / BENCH_SHORT_SECTOR;
+    }
+
+    // short streams are chains of the SSAT, placed the same way
+    chains = xcalloc(p->nstreams + 3, sizeof(bench_chain_t));
+    short_secids = xcalloc(nshort, sizeof(uint32_t));
+    nchains = 0;
+
+    for(s = 0, k = 0; s < p->nstreams; s++)
+    {
+        if(sizes[s] >= BENCH_CUTOFF)
+            continue;
+
+        chains[nchains].stream = s;
+        chains[nchains].nsectors = (sizes[s] + BENCH_SHORT_SECTOR - 1) / BENCH_SHORT_SECTOR;
+        chains[nchains].secids = short_secids + k;
+        k += chains[nchains++].nsectors;
+    }
+
+    place_chains(chains, nchains, nshort, p->frag);
+
+    // whole SSAT sectors, the slots past the short sectors being free as in the SAT
+    nshort_slots = (nshort * 4 + S - 1) / S * per;
+    ssat = xcalloc(nshort_slots, sizeof(uint32_t));
+    memset(ssat, 0xFF, (size_t)nshort_slots * sizeof(uint32_t));
+    mini = xcalloc(nshort, BENCH_SHORT_SECTOR);
+
+    for(c = 0; c < nchains; c++)
+    {
+        link_chain(ssat, chains[c].secids, chains[c].nsectors);
+        short_first[chains[c].stream] = chains[c].secids[0];
+
+        for(k = 0; k < chains[c].nsectors; k++)
+        {
+            stream_fill(chains[c].stream, (uint64_t)k * BENCH_SHORT_SECTOR, mini + (size_t)chains[c].secids[k] * BENCH_SHORT_SECTOR,
+                sizes[chains[c].stream] - k * BENCH_SHORT_SECTOR < BENCH_SHORT_SECTOR ? sizes[chains[c].stream] - k * BENCH_SHORT_SECTOR : BENCH_SHORT_SECTOR);
+        }
+    }
+
+    // the directory: the root entry and the streams, flat
+    dirs = xcalloc(p->nstreams + 1, sizeof(comp_doc_directory_t));
+    names = xcalloc(p->nstreams + 1, 32);
+    sorted = xcalloc(p->nstreams, sizeof(uint32_t));
+
+    strcpy(names, "Root Entry");
+
+    for(s = 0; s < p->nstreams; s++)
+    {
+        snprintf(names + (s + 1) * 32, 32, "s%u", s);
+        sorted[s] = s + 1;
+    }
+
+    for(s = 0; s <= p->nstreams; s++)
+    {
+        for(k = 0; names[s * 32 + k] != '\0'; k++)
+            dirs[s].name[2 * k] = names[s * 32 + k];
+
+        dirs[s].name_length = 2 * (k + 1);
+        dirs[s].entry_type = s == 0 ? COMP_DOC_DIRECTORY_TYPE_ROOT_STORAGE : COMP_DOC_DIRECTORY_TYPE_USER_STREAM;
+        dirs[s].colour = COMP_DOC_DIRECTORY_BLACK;
+        dirs[s].left_child_dirid = dirs[s].right_child_dirid = dirs[s].root_dirid = COMP_DOC_DIRECTORY_NO_NODE;
+        dirs[s].size = s == 0 ? nshort * BENCH_SHORT_SECTOR : sizes[s - 1];
+        dirs[s].first_sector = SECID_END_OF_CHAIN;
+
+        if(s > 0 && sizes[s - 1] < BENCH_CUTOFF)
+            dirs[s].first_sector = short_first[s - 1];
+    }
+
+    bench_names_base = names;
+    qsort(sorted, p->nstreams, sizeof(uint32_t), compare_names);
+    dirs[0].root_dirid = build_tree(dirs, sorted, p->nstreams);
+
+    // big streams, then the mini stream container, the SSAT and the directory
+    memset(chains, 0, (p->nstreams + 3) * sizeof(bench_chain_t));
+    nchains = 0;
+    ndata = 0;
+
+    for(s = 0; s < p->nstreams; s++)
+    {
+        if(sizes[s] >= BENCH_CUTOFF)
+        {
+            chains[nchains].stream = s;
+            chains[nchains].size = sizes[s];
+            chains[nchains++].nsectors = (sizes[s] + S - 1) / S;
+        }
+    }
+
+    mini_chain = nchains;
+    chains[nchains].data = mini;
+    chains[nchains].size = nshort * BENCH_SHORT_SECTOR;
+    chains[nchains++].nsectors = (nshort * BENCH_SHORT_SECTOR + S - 1) / S;
+
+    chains[nchains].data = (unsigned char *)ssat;
+    chains[nchains].size = nshort_slots * 4;
+    chains[nchains++].nsectors = nshort_slots / per;
+
+    ndir_sectors = ((p->nstreams + 1) * COMP_DOC_DIRECTORY_SZ + S - 1) / S;
+    chains[nchains].data = (unsigned char *)dirs;
+    chains[nchains].size = (p->nstreams + 1) * COMP_DOC_DIRECTORY_SZ;
+    chains[nchains++].nsectors = ndir_sectors;
+
+    for(c = 0; c < nchains; c++)
+    {
+        chains[c].secids = xcalloc(chains[c].nsectors, sizeof(uint32_t));
+        ndata += chains[c].nsectors;
+    }
+
+    place_chains(chains, nchains, ndata, p->frag);
+
+    // the SAT covers itself and the MSAT, which follow the data
+    nsat = nmsat = 0;
+
+    for(;;)
+    {
+        need = (ndata + nsat + nmsat + per - 1) / per + p->extra_sat;
+        nm = need <= COMP_DOC_HEADER_MSAT_SLOTS ? 0 : (need - COMP_DOC_HEADER_MSAT_SLOTS + per - 2) / (per - 1);
+
+        if(need == nsat && nm == nmsat)
+            break;
+
+        nsat = need;
+        nmsat = nm;
+    }
+
+    nslots = nsat * per;
+    sat = xcalloc(nslots, sizeof(uint32_t));
+    memset(sat, 0xFF, (size_t)nslots * sizeof(uint32_t));
+
+    for(c = 0; c < nchains; c++)
+    {
+        if(chains[c].nsectors > 0)
+            link_chain(sat, chains[c].secids, chains[c].nsectors);
+    }
+
+    for(k = 0; k < nsat; k++)
+        sat[ndata + k] = SECID_SAT;
+    for(k = 0; k < nmsat; k++)
+        sat[ndata + nsat + k] = SECID_MSAT;
+
+    if(chains[mini_chain].nsectors > 0)
+        dirs[0].first_sector = chains[mini_chain].secids[0];
+
+    for(c = 0; c < mini_chain; c++)
+        dirs[chains[c].stream + 1].first_sector = chains[c].secids[0];
+
+    // lay the sectors out in memory and write them at once
+    image_size = ((size_t)ndata + nsat + nmsat + 1) * S;
+    image = xcalloc(1, image_size);
+
+    for(c = 0; c < nchains; c++)
+    {
+        for(k = 0; k < chains[c].nsectors; k++)
+        {
+            sector = image + ((size_t)chains[c].secids[k] + 1) * S;
+            need = chains[c].size - k * S < S ? chains[c].size - k * S : S;
+
+            if(chains[c].data != NULL)
+                memcpy(sector, chains[c].data + (size_t)k * S, need);
+            else
+                stream_fill(chains[c].stream, (uint64_t)k * S, sector, need);
+        }
+    }
+
+    for(k = 0; k < nsat; k++)
+        memcpy(image + ((size_t)ndata + k + 1) * S, sat + (size_t)k * per, S);
+
+    hdr = (comp_doc_header_t *)image;
+    memcpy(hdr->magic, "\xD0\xCF\x11\xE0\xA1\xB1\x1A\xE1", 8);
+    hdr->revision = 0x3E;
+    hdr->version = p->ssz == 12 ? 4 : 3;
+    hdr->byte_order = 0xFFFE;
+    hdr->ssz = p->ssz;
+    hdr->sssz = 6;
+    if(p->ssz == 12)
+        hdr->ndir_sectors = ndir_sectors;
+    hdr->nsat_sectors = nsat;
+    hdr->first_dir_sector = chains[nchains - 1].secids[0];
+    hdr->stream_min_size = BENCH_CUTOFF;
+    hdr->first_ssat_sector = nshort ? chains[mini_chain + 1].secids[0] : SECID_END_OF_CHAIN;
+    hdr->nssat_sectors = chains[mini_chain + 1].nsectors;
+    hdr->msat_first_sector = nmsat ? ndata + nsat : SECID_END_OF_CHAIN;
+    hdr->nmsat_sectors = nmsat;
+
+    msat_slots = (uint32_t *)(image + sizeof(comp_doc_header_t));
+
+    for(k = 0; k < COMP_DOC_HEADER_MSAT_SLOTS; k++)
+        msat_slots[k] = k < nsat ? ndata + k : SECID_FREE;
+
+    // the rest of the SAT sectors are listed in the MSAT sectors, chained by their last slot
+    for(c = 0; c < nmsat; c++)
+    {
+        msat_slots = (uint32_t *)(image + ((size_t)ndata + nsat + c + 1) * S);
+        memset(msat_slots, 0xFF, S);
+        msat_slots[per - 1] = c + 1 < nmsat ? ndata + nsat + c + 1 : SECID_END_OF_CHAIN;
+    }
+
+    for(k = COMP_DOC_HEADER_MSAT_SLOTS; k < nsat; k++)
+    {
+        c = (k - COMP_DOC_HEADER_MSAT_SLOTS) / (per - 1);
+        msat_slots = (uint32_t *)(image + ((size_t)ndata + nsat + c + 1) * S);
+        msat_slots[(k - COMP_DOC_HEADER_MSAT_SLOTS) % (per - 1)] = ndata + k;
+    }
+
+    fp = fopen(path, "wb");
+
+    if(fp == NULL || fwrite(image, 1, image_size, fp) != image_size)
+    {
+        fprintf(stderr, "failed to write %s\n", path);
+        exit(1);
+    }
+
+    fclose(fp);
+
+    printf("generated %s: %zu bytes, %u streams (%u short sectors), %u data sectors, %u SAT sectors, %u MSAT sectors\n",
+        path, image_size, p->nstreams, nshort, ndata, nsat, nmsat);
+
+    for(c = 0; c < nchains; c++)
+        free(chains[c].secids);
+
+    free(chains);
+    free(short_secids);
+    free(short_first);
+    free(mini);
+    free(ssat);
+    free(sat);
+    free(dirs);
+    free(names);
+    free(sorted);
+    free(image);
+
+    *ret_sizes = sizes;
+
+    return 0;
+}
+
+/*
+ * Read syscalls made by the process so far, -1 if unknown.
+ */
+static long long
+read_syscalls(void)
+{
+    char line[128];
+    long long n = -1;
+    FILE *fp;
+
+    if((fp = fopen("/proc/self/io", "r")) == NULL)
+        return -1;
+
+    while(fgets(line, sizeof(line), fp) != NULL)
+    {
+        if(sscanf(line, "syscr: %lld", &n) == 1)
+            break;
+    }
+
+    fclose(fp);
+
+    return n;
+}
+
+typedef struct {
+    const char *name;
+    struct timespec start;
+    long long syscalls;
+} bench_phase_t;
+
+static void
+phase_start(bench_phase_t *phase, const char *name)
+{
+    phase->name = name;
+    phase->syscalls = read_syscalls();
+    clock_gettime(CLOCK_MONOTONIC, &phase->start);
+}
+
+static void
+phase_end(bench_phase_t *phase, uint64_t ops, uint64_t bytes)
+{
+    struct timespec end;
+    struct rusage usage;
+    long long syscalls;
+    double ns;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    syscalls = read_syscalls();
+    getrusage(RUSAGE_SELF, &usage);
+
+    ns = (end.tv_sec - phase->start.tv_sec) * 1e9 + (end.tv_nsec - phase->start.tv_nsec);
+
+    if(ops == 0)
+        ops = 1;
+
+    printf("%-14s %10llu ops %12.1f ns/op", phase->name, (unsigned long long)ops, ns / ops);
+
+    if(bytes > 0)
+        printf(" %9.1f MB/s", bytes / ns * 1e3);
+    else
+        printf(" %14s", "");
+
+    if(syscalls >= 0 && phase->syscalls >= 0)
+        printf(" %9.2f syscalls/op", (double)(syscalls - phase->syscalls - syscalls_overhead) / ops);
+    else
+        printf(" %9s syscalls/op", "n/a");
+
+    printf(" %8ld KiB peak RSS\n", usage.ru_maxrss);
+}
+
+static void
+bench_open(char *path, const char *name, int flags, unsigned int repeat)
+{
+    comp_doc_options_t options;
+    comp_doc_file_t *file;
+    bench_phase_t phase;
+    unsigned int r;
+    int err;
+
+    memset(&options, 0, sizeof(options));
+    options.flags = flags;
+
+    phase_start(&phase, name);
+
+    for(r = 0; r < repeat; r++)
+    {
+        if((err = comp_doc_open_ex(path, COMP_DOC_PERM_READ, &options, &file)) != COMP_DOC_SUCCESS)
+        {
+            fprintf(stderr, "failed to open %s (%d)\n", path, err);
+            exit(1);
+        }
+
+        comp_doc_close(file);
+    }
+
+    phase_end(&phase, repeat, 0);
+}
+
+static void
+bench_enumerate(comp_doc_file_t *file, unsigned int repeat)
+{
+    comp_doc_dir_iter_t it;
+    bench_phase_t phase;
+    uint64_t entries;
+    unsigned int r;
+
+    phase_start(&phase, "enumerate");
+
+    for(r = 0, entries = 0; r < repeat; r++)
+    {
+        comp_doc_iter_init(file, comp_doc_get_root_storage(file), COMP_DOC_ITER_RECURSIVE, &it);
+
+        while(comp_doc_iter_next(&it) != NULL)
+            entries++;
+    }
+
+    phase_end(&phase, entries, 0);
+}
+
+/*
+ * Reads every stream on either side of the cutoff, checking the contents
+ * on the first pass.
+ */
+static int
+bench_read(comp_doc_file_t *file, const uint32_t *sizes, uint32_t nstreams, int big, unsigned int repeat)
+{
+    comp_doc_directory_t *dir;
+    unsigned char *buffer, *expected;
+    bench_phase_t phase;
+    uint64_t ops, bytes;
+    uint32_t s, max;
+    unsigned int r;
+    int bad;
+
+    for(s = 0, max = 1; s < nstreams; s++)
+        max = sizes[s] > max ? sizes[s] : max;
+
+    buffer = xcalloc(1, max);
+    expected = xcalloc(1, max);
+    bad = 0;
+
+    phase_start(&phase, big ? "read big" : "read short");
+
+    for(r = 0, ops = 0, bytes = 0; r < repeat; r++)
+    {
+        for(s = 0; s < nstreams; s++)
+        {
+            if((sizes[s] >= BENCH_CUTOFF) != big)
+                continue;
+
+            dir = comp_doc_get_directory(file, s + 1);
+
+            if(comp_doc_read_stream_into(file, dir, buffer, max) != sizes[s])
+                bad++;
+            else if(r == 0)
+            {
+                stream_fill(s, 0, expected, sizes[s]);
+                bad += memcmp(buffer, expected, sizes[s]) != 0;
+            }
+
+            ops++;
+            bytes += sizes[s];
+        }
+    }
+
+    phase_end(&phase, ops, bytes);
+
+    free(buffer);
+    free(expected);
+
+    if(bad)
+        fprintf(stderr, "%d %s streams read wrong\n", bad, big ? "big" : "short");
+
+    return bad;
+}
+
+/*
+ * Prints the counters of the sector cache, if any, and the statistics of
+ * the handle, when the library collects them.
+ */
+static void
+print_stats(comp_doc_file_t *file)
+{
+    static const char *phases[COMP_DOC_PHASES] = {
+        "header", "msat", "sat", "dirs", "ssat", "ministream", "read"
+    };
+    comp_doc_cache_stats_t cache;
+    comp_doc_stats_t stats;
+    int i;
+
+    if(comp_doc_get_cache_stats(file, &cache) == COMP_DOC_SUCCESS)
+    {
+        printf("cache: %llu hits, %llu misses, %llu evictions, %zu of %zu bytes\n",
+            (unsigned long long)cache.hits, (unsigned long long)cache.misses,
+            (unsigned long long)cache.evictions, cache.size, cache.capacity);
+    }
+
+    if(comp_doc_get_stats(file, &stats) != COMP_DOC_SUCCESS)
+        return;
+
+    printf("stats: %llu syscalls, %llu bytes read, %llu sectors, %llu short lookups, %llu allocations\n",
+        (unsigned long long)stats.syscalls, (unsigned long long)stats.bytes_read, (unsigned long long)stats.sectors,
+        (unsigned long long)stats.short_lookups, (unsigned long long)stats.allocations);
+
+    for(i = 0; i < COMP_DOC_PHASES; i++)
+    {
+        printf("  %-12s %10llu runs %14llu ns\n", phases[i],
+            (unsigned long long)stats.phase_count[i], (unsigned long long)stats.phase_ns[i]);
+    }
+}
+
+static void
+usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-S 9|12] [-n streams] [-b big%%] [-B big size] [-s small max]\n"
+        "       [-f none|interleave|shuffle] [-x extra SAT sectors] [-r repeat] [-m] [-c] [-k cache bytes] [-o file]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    bench_params_t params;
+    comp_doc_options_t options;
+    comp_doc_file_t *file;
+    char *path;
+    char tmp[] = "/tmp/compdoc-bench-XXXXXX";
+    uint32_t *sizes;
+    unsigned int repeat;
+    int opt, fd, map, cache, bad;
+
+    memset(&params, 0, sizeof(params));
+    memset(&options, 0, sizeof(options));
+    params.ssz = 9;
+    params.nstreams = 1000;
+    params.big_percent = 10;
+    params.big_size = 256 * 1024;
+    params.small_max = BENCH_CUTOFF - 1;
+    params.frag = BENCH_FRAG_NONE;
+    params.seed = 1;
+    repeat = 10;
+    map = 0;
+    cache = 0;
+    path = NULL;
+
+    while((opt = getopt(argc, argv, "S:n:b:B:s:f:x:r:mck:o:h")) != -1)
+    {
+        switch(opt)
+        {
+            case 'S': params.ssz = atoi(optarg); break;
+            case 'n': params.nstreams = strtoul(optarg, NULL, 0); break;
+            case 'b': params.big_percent = atoi(optarg); break;
+            case 'B': params.big_size = strtoul(optarg, NULL, 0); break;
+            case 's': params.small_max = strtoul(optarg, NULL, 0); break;
+            case 'x': params.extra_sat = strtoul(optarg, NULL, 0); break;
+            case 'r': repeat = atoi(optarg); break;
+            case 'm': map = 1; break;
+            case 'c': cache = 1; break;
+            case 'k': options.cache_size = strtoul(optarg, NULL, 0); break;
+            case 'o': path = optarg; break;
+            case 'f':
+                if(strcmp(optarg, "none") == 0)
+                    params.frag = BENCH_FRAG_NONE;
+                else if(strcmp(optarg, "interleave") == 0)
+                    params.frag = BENCH_FRAG_INTERLEAVE;
+                else if(strcmp(optarg, "shuffle") == 0)
+                    params.frag = BENCH_FRAG_SHUFFLE;
+                else
+                {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return -1;
+        }
+    }
+
+    if((params.ssz != 9 && params.ssz != 12) || params.big_size < BENCH_CUTOFF
+        || params.small_max == 0 || params.small_max >= BENCH_CUTOFF || repeat == 0)
+    {
+        usage(argv[0]);
+        return -1;
+    }
+
+    if(path == NULL)
+    {
+        if((fd = mkstemp(tmp)) == -1)
+        {
+            fprintf(stderr, "failed to create a temporary file\n");
+            return -1;
+        }
+
+        close(fd);
+        path = tmp;
+    }
+
+    syscalls_overhead = read_syscalls();
+    syscalls_overhead = read_syscalls() - syscalls_overhead;
+
+    rng_state = params.seed;
+    generate(&params, path, &sizes);
+
+    bench_open(path, "open", 0, repeat);
+    bench_open(path, "open mmap", COMP_DOC_OPEN_MMAP, repeat);
+    bench_open(path, "open lazy", COMP_DOC_OPEN_LAZY, repeat);
+
+    options.flags = (map ? COMP_DOC_OPEN_MMAP : 0) | (cache ? COMP_DOC_OPEN_CACHE_MINISTREAM : 0);
+
+    if(comp_doc_open_ex(path, COMP_DOC_PERM_READ, &options, &file) != COMP_DOC_SUCCESS)
+    {
+        fprintf(stderr, "failed to open %s\n", path);
+        return -1;
+    }
+
+    bench_enumerate(file, repeat);
+    bad = bench_read(file, sizes, params.nstreams, 1, repeat);
+    bad += bench_read(file, sizes, params.nstreams, 0, repeat);
+    print_stats(file);
+
+    comp_doc_close(file);
+    free(sizes);
+
+    if(path == tmp)
+        unlink(tmp);
+
+    return bad ? 1 : 0;
+}
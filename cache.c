@@ -0,0 +1,402 @@
+#include "cache.h"
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    /* offset of the sector in the file, -1 while the slot is unused */
+    off_t offset;
+    int32_t hash_next;
+    int32_t lru_prev;
+    int32_t lru_next;
+} cache_entry_t;
+
+/*
+ * Sectors read from the file, kept up to a budget of bytes and evicted least
+ * recently used first. Slots are allocated once, when the cache is created,
+ * and are found through a hash table keyed on the offset of the sector. The
+ * lock is never held while reading the file.
+ */
+struct comp_doc_sector_cache {
+    pthread_mutex_t lock;
+    uint32_t sector_size;
+    /* offset of the first sector, the others follow every sector_size bytes */
+    off_t origin;
+    uint32_t capacity;
+    uint32_t used;
+    uint32_t mask;
+    int32_t *buckets;
+    cache_entry_t *entries;
+    unsigned char *data;
+    /* most and least recently used slots */
+    int32_t lru_head;
+    int32_t lru_tail;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+};
+
+#define CACHE_NONE (-1)
+
+/* the largest sector, that of version 4 files, see check_header_sanity */
+#define CACHE_SECTOR_MAX 4096
+
+/*
+ * Creates the sector cache of a file, holding up to `budget' bytes. A budget
+ * smaller than a sector leaves the file without a cache, and so do sectors
+ * larger than CACHE_SECTOR_MAX.
+ */
+int
+cache_create(comp_doc_file_t *file, size_t budget)
+{
+    comp_doc_sector_cache_t *cache;
+    uint32_t sector_size, nbuckets, i;
+    size_t capacity;
+
+    sector_size = CALC_SECTOR_SIZE(file->hdr->ssz);
+    capacity = budget / sector_size;
+
+    if(capacity == 0 || sector_size > CACHE_SECTOR_MAX)
+        return COMP_DOC_SUCCESS;
+
+    // keeps the slot indices and the bucket count within range
+    if(capacity > (1U << 28))
+        capacity = 1U << 28;
+
+    for(nbuckets = 1; nbuckets < 2 * capacity; nbuckets <<= 1)
+        ;
+
+    cache = doc_calloc(file, 1, sizeof(comp_doc_sector_cache_t));
+
+    if(cache == NULL)
+        return COMP_DOC_NO_MEM;
+
+    cache->buckets = doc_malloc(file, nbuckets * sizeof(int32_t));
+    cache->entries = doc_malloc(file, capacity * sizeof(cache_entry_t));
+    cache->data = doc_malloc(file, capacity * sector_size);
+
+    if(cache->buckets == NULL || cache->entries == NULL || cache->data == NULL)
+    {
+        doc_free(file, cache->buckets);
+        doc_free(file, cache->entries);
+        doc_free(file, cache->data);
+        doc_free(file, cache);
+        return COMP_DOC_NO_MEM;
+    }
+
+    for(i = 0; i < nbuckets; i++)
+        cache->buckets[i] = CACHE_NONE;
+
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->sector_size = sector_size;
+    cache->origin = sector_position(file->hdr, 0);
+    cache->capacity = capacity;
+    cache->mask = nbuckets - 1;
+    cache->lru_head = cache->lru_tail = CACHE_NONE;
+    file->cache = cache;
+
+    return COMP_DOC_SUCCESS;
+}
+
+void
+cache_destroy(comp_doc_file_t *file)
+{
+    comp_doc_sector_cache_t *cache = file->cache;
+
+    if(cache == NULL)
+        return;
+
+    pthread_mutex_destroy(&cache->lock);
+    doc_free(file, cache->buckets);
+    doc_free(file, cache->entries);
+    doc_free(file, cache->data);
+    doc_free(file, cache);
+    file->cache = NULL;
+}
+
+/*
+ * Drops every sector, after the file has been written to. The counters are
+ * kept.
+ */
+void
+cache_clear(comp_doc_file_t *file)
+{
+    comp_doc_sector_cache_t *cache = file->cache;
+    uint32_t i;
+
+    if(cache == NULL)
+        return;
+
+    pthread_mutex_lock(&cache->lock);
+
+    for(i = 0; i <= cache->mask; i++)
+        cache->buckets[i] = CACHE_NONE;
+
+    cache->used = 0;
+    cache->lru_head = cache->lru_tail = CACHE_NONE;
+
+    pthread_mutex_unlock(&cache->lock);
+}
+
+static uint32_t
+cache_bucket(comp_doc_sector_cache_t *cache, off_t offset)
+{
+    // consecutive sectors land in consecutive buckets
+    return (uint32_t)((offset - cache->origin) / cache->sector_size) & cache->mask;
+}
+
+static int32_t
+cache_lookup(comp_doc_sector_cache_t *cache, off_t offset)
+{
+    int32_t i;
+
+    for(i = cache->buckets[cache_bucket(cache, offset)]; i != CACHE_NONE; i = cache->entries[i].hash_next)
+    {
+        if(cache->entries[i].offset == offset)
+            return i;
+    }
+
+    return CACHE_NONE;
+}
+
+static void
+lru_unlink(comp_doc_sector_cache_t *cache, int32_t i)
+{
+    cache_entry_t *entry = &cache->entries[i];
+
+    if(entry->lru_prev != CACHE_NONE)
+        cache->entries[entry->lru_prev].lru_next = entry->lru_next;
+    else
+        cache->lru_head = entry->lru_next;
+
+    if(entry->lru_next != CACHE_NONE)
+        cache->entries[entry->lru_next].lru_prev = entry->lru_prev;
+    else
+        cache->lru_tail = entry->lru_prev;
+}
+
+static void
+lru_push(comp_doc_sector_cache_t *cache, int32_t i)
+{
+    cache_entry_t *entry = &cache->entries[i];
+
+    entry->lru_prev = CACHE_NONE;
+    entry->lru_next = cache->lru_head;
+
+    if(cache->lru_head != CACHE_NONE)
+        cache->entries[cache->lru_head].lru_prev = i;
+    else
+        cache->lru_tail = i;
+
+    cache->lru_head = i;
+}
+
+static void
+hash_unlink(comp_doc_sector_cache_t *cache, int32_t i)
+{
+    int32_t *link;
+
+    for(link = &cache->buckets[cache_bucket(cache, cache->entries[i].offset)]; *link != CACHE_NONE;
+        link = &cache->entries[*link].hash_next)
+    {
+        if(*link == i)
+        {
+            *link = cache->entries[i].hash_next;
+            return;
+        }
+    }
+}
+
+/*
+ * Stores a copy of the sector found at `offset', reusing the least recently
+ * used slot once they are all taken. Called with the lock held.
+ */
+static void
+cache_insert(comp_doc_sector_cache_t *cache, off_t offset, const unsigned char *sector)
+{
+    uint32_t bucket;
+    int32_t i;
+
+    // another reader may have brought it in meanwhile
+    if((i = cache_lookup(cache, offset)) != CACHE_NONE)
+    {
+        lru_unlink(cache, i);
+        lru_push(cache, i);
+        return;
+    }
+
+    if(cache->used < cache->capacity)
+    {
+        i = cache->used++;
+    }
+    else
+    {
+        i = cache->lru_tail;
+        lru_unlink(cache, i);
+        hash_unlink(cache, i);
+        cache->evictions++;
+    }
+
+    bucket = cache_bucket(cache, offset);
+    cache->entries[i].offset = offset;
+    cache->entries[i].hash_next = cache->buckets[bucket];
+    cache->buckets[bucket] = i;
+    lru_push(cache, i);
+
+    memcpy(cache->data + (size_t)i * cache->sector_size, sector, cache->sector_size);
+}
+
+/*
+ * Copies `size' bytes found at `offset' into buffer, as read_position does,
+ * but through the sector cache. Missing sectors are read whole, up to
+ * COMP_DOC_CACHE_RUN of them at once, and kept. They are read straight into
+ * `buffer', but for a first and a last sector that it only holds part of,
+ * which are staged on the stack, so that reading allocates nothing. Bytes
+ * that cannot be read as whole sectors, at the end of a file cut short,
+ * are read as they are.
+ */
+ssize_t
+cache_read(comp_doc_file_t *file, off_t offset, void *buffer, size_t size)
+{
+    comp_doc_sector_cache_t *cache = file->cache;
+    unsigned char head[CACHE_SECTOR_MAX], tail[CACHE_SECTOR_MAX];
+    const unsigned char *source;
+    struct iovec iov[3];
+    uint32_t sector_size, skip, n, k;
+    size_t done, count;
+    off_t position, sector, end, lo, hi;
+    ssize_t bytes_read;
+    int32_t i;
+    int iovcnt, has_tail;
+
+    sector_size = cache->sector_size;
+    end = offset + size;
+
+    for(done = 0; done < size; done += count)
+    {
+        position = offset + done;
+
+        // the header is not a sector
+        if(position < cache->origin)
+        {
+            bytes_read = read_position(file, position, (uint8_t *)buffer + done, size - done);
+            goto _error;
+        }
+
+        skip = (position - cache->origin) % sector_size;
+        sector = position - skip;
+        count = sector_size - skip < size - done ? sector_size - skip : size - done;
+
+        pthread_mutex_lock(&cache->lock);
+
+        if((i = cache_lookup(cache, sector)) != CACHE_NONE)
+        {
+            memcpy((uint8_t *)buffer + done, cache->data + (size_t)i * sector_size + skip, count);
+            lru_unlink(cache, i);
+            lru_push(cache, i);
+            cache->hits++;
+            pthread_mutex_unlock(&cache->lock);
+            continue;
+        }
+
+        // the missing sectors that follow are read along, up to the first one cached
+        n = 1;
+
+        while(n < COMP_DOC_CACHE_RUN && skip + (size - done) > (size_t)n * sector_size
+            && cache_lookup(cache, sector + (off_t)n * sector_size) == CACHE_NONE)
+            n++;
+
+        cache->misses += n;
+        pthread_mutex_unlock(&cache->lock);
+
+        // [lo, hi) are the sectors that the caller's buffer holds whole
+        lo = skip > 0 ? sector + sector_size : sector;
+        hi = sector + (off_t)n * sector_size;
+        has_tail = hi > end && hi - sector_size >= lo;
+
+        if(hi > end)
+            hi -= sector_size;
+
+        iovcnt = 0;
+
+        if(skip > 0)
+        {
+            iov[iovcnt].iov_base = head;
+            iov[iovcnt++].iov_len = sector_size;
+        }
+
+        if(hi > lo)
+        {
+            iov[iovcnt].iov_base = (uint8_t *)buffer + (lo - offset);
+            iov[iovcnt++].iov_len = hi - lo;
+        }
+
+        if(has_tail)
+        {
+            iov[iovcnt].iov_base = tail;
+            iov[iovcnt++].iov_len = sector_size;
+        }
+
+        if(readv_position(file, sector, iov, iovcnt) < 0)
+        {
+            bytes_read = read_position(file, position, (uint8_t *)buffer + done, size - done);
+            goto _error;
+        }
+
+        pthread_mutex_lock(&cache->lock);
+
+        for(k = 0; k < n; k++)
+        {
+            if(k == 0 && skip > 0)
+                source = head;
+            else if(has_tail && k == n - 1)
+                source = tail;
+            else
+                source = (uint8_t *)buffer + (sector + (off_t)k * sector_size - offset);
+
+            cache_insert(cache, sector + (off_t)k * sector_size, source);
+        }
+
+        pthread_mutex_unlock(&cache->lock);
+
+        if(skip > 0)
+            memcpy((uint8_t *)buffer + done, head + skip, count);
+
+        if(has_tail)
+            memcpy((uint8_t *)buffer + (hi - offset), tail, end - hi);
+
+        count = (size_t)n * sector_size - skip < size - done ? (size_t)n * sector_size - skip : size - done;
+    }
+
+    bytes_read = size;
+
+_error:
+    if(bytes_read < 0)
+        return bytes_read;
+
+    return size;
+}
+
+/*
+ * Fills `stats' with the counters of the sector cache, or returns
+ * COMP_DOC_NO_CACHE if the file was opened without one.
+ */
+int
+comp_doc_get_cache_stats(comp_doc_file_t *file, comp_doc_cache_stats_t *stats)
+{
+    comp_doc_sector_cache_t *cache = file->cache;
+
+    if(cache == NULL)
+        return COMP_DOC_NO_CACHE;
+
+    pthread_mutex_lock(&cache->lock);
+
+    stats->hits = cache->hits;
+    stats->misses = cache->misses;
+    stats->evictions = cache->evictions;
+    stats->size = (size_t)cache->used * cache->sector_size;
+    stats->capacity = (size_t)cache->capacity * cache->sector_size;
+
+    pthread_mutex_unlock(&cache->lock);
+
+    return COMP_DOC_SUCCESS;
+}
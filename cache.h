@@ -0,0 +1,27 @@
+#ifndef _COMP_DOC_CACHE_H_
+#define _COMP_DOC_CACHE_H_
+#include "compdoc.h"
+#include "parse.h"
+
+/* most sectors read from the file at once to fill the cache */
+#define COMP_DOC_CACHE_RUN 32
+
+/*
+ * Counters of the sector cache of a file, see comp_doc_get_cache_stats.
+ * Hits and misses are counted in sectors.
+ */
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    /* bytes of sectors held, and the most the cache may hold */
+    size_t size;
+    size_t capacity;
+} comp_doc_cache_stats_t;
+
+int cache_create(comp_doc_file_t *, size_t);
+void cache_destroy(comp_doc_file_t *);
+void cache_clear(comp_doc_file_t *);
+ssize_t cache_read(comp_doc_file_t *, off_t, void *, size_t);
+int comp_doc_get_cache_stats(comp_doc_file_t *, comp_doc_cache_stats_t *);
+#endif /* _COMP_DOC_CACHE_H_ */
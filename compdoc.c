@@ -1,78 +1,256 @@
 #include "compdoc.h"
 #include "parse.h"
+#include "cache.h"
+#include "verify.h"
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
+#include <pthread.h>
 
 //#include <stdio.h>
 //#include <ctype.h>
 
+/*
+ * Prepares `it' to walk the entries below `storage'. Without
+ * COMP_DOC_ITER_RECURSIVE only the children of the storage are visited,
+ * otherwise the whole subtree is visited in pre-order, every storage
+ * before its contents. The iterator lives on the caller's stack and the
+ * walk allocates nothing.
+ */
+int
+comp_doc_iter_init(comp_doc_file_t *file, comp_doc_directory_t *storage, int flags, comp_doc_dir_iter_t *it)
+{
+    int err;
+
+    memset(it, 0, sizeof(comp_doc_dir_iter_t));
+
+    if(!IS_DIR_STORAGE(storage) && !IS_DIR_ROOT_ENTRY(storage))
+        return COMP_DOC_NO_DIRS;
+
+    if((err = load_tables(file, COMP_DOC_LOADED_DIRS)) != COMP_DOC_SUCCESS)
+        return err;
+
+    it->file = file;
+    it->flags = flags;
+    it->dirid = COMP_DOC_DIRECTORY_NO_NODE;
+    it->parent = COMP_DOC_DIRECTORY_NO_NODE;
+
+    if(storage->root_dirid < file->ndirs)
+    {
+        // the root entry read on its own is not part of file->dirs
+        if(storage >= file->dirs && storage < file->dirs + file->ndirs)
+            it->stack[0].parent = storage - file->dirs;
+        else
+            it->stack[0].parent = 0;
+
+        it->stack[0].dirid = storage->root_dirid;
+        it->stack[0].depth = 0;
+        it->nstack = 1;
+    }
+
+    return COMP_DOC_SUCCESS;
+}
+
+static int
+iter_push(comp_doc_dir_iter_t *it, uint32_t dirid, uint32_t parent, unsigned int depth)
+{
+    if(dirid >= it->file->ndirs)
+        return COMP_DOC_SUCCESS;
+
+    if(it->nstack == COMP_DOC_ITER_STACK_SIZE)
+        return COMP_DOC_DIR_TOO_DEEP;
+
+    it->stack[it->nstack].dirid = dirid;
+    it->stack[it->nstack].parent = parent;
+    it->stack[it->nstack].depth = depth;
+    it->nstack++;
+
+    return COMP_DOC_SUCCESS;
+}
+
+/*
+ * Returns the next entry of the walk, or NULL once it is over. The ID of the
+ * entry, of its parent storage and its depth below the starting storage are
+ * left in `it'. If the walk stopped because the directory is corrupted,
+ * `it->err' holds the reason.
+ */
+comp_doc_directory_t *
+comp_doc_iter_next(comp_doc_dir_iter_t *it)
+{
+    comp_doc_directory_t *dir;
+    uint32_t dirid;
+    int err;
+
+    if(it->nstack == 0 || it->err != COMP_DOC_SUCCESS)
+        return NULL;
+
+    // a valid directory lists every entry once, more means a loop
+    if(it->visited >= it->file->ndirs)
+    {
+        it->err = COMP_DOC_NO_DIRS;
+        return NULL;
+    }
+
+    it->nstack--;
+    dirid = it->stack[it->nstack].dirid;
+    dir = &it->file->dirs[dirid];
+
+    it->dirid = dirid;
+    it->parent = it->stack[it->nstack].parent;
+    it->depth = it->stack[it->nstack].depth;
+    it->visited++;
+
+    // pushed in reverse, so that the contents of a storage come right after it
+    if((err = iter_push(it, dir->right_child_dirid, it->parent, it->depth)) != COMP_DOC_SUCCESS
+        || (err = iter_push(it, dir->left_child_dirid, it->parent, it->depth)) != COMP_DOC_SUCCESS)
+    {
+        it->err = err;
+        return NULL;
+    }
+
+    if((it->flags & COMP_DOC_ITER_RECURSIVE) && IS_DIR_STORAGE(dir)
+        && (err = iter_push(it, dir->root_dirid, dirid, it->depth + 1)) != COMP_DOC_SUCCESS)
+    {
+        it->err = err;
+        return NULL;
+    }
+
+    return dir;
+}
+
+/*
+ * Returns a NULL terminated list of the children of the storage `dir', which
+ * must be released with comp_doc_free. Prefer comp_doc_iter_init and
+ * comp_doc_iter_next, which do not allocate.
+ */
 comp_doc_directory_t **
 comp_doc_list_dir(comp_doc_file_t *file, comp_doc_directory_t *dir)
 {
-    comp_doc_directory_t **list, **cur_read, **cur_write;
-    comp_doc_directory_t *d;
+    comp_doc_directory_t **list, *d;
+    comp_doc_dir_iter_t it;
     uint32_t written;
 
-    if(!IS_DIR_STORAGE(dir) && !IS_DIR_ROOT_ENTRY(dir))
+    if(comp_doc_iter_init(file, dir, 0, &it) != COMP_DOC_SUCCESS)
         return NULL;
 
-    list = calloc((file->ndirs + 1), sizeof(comp_doc_directory_t *));
+    list = doc_calloc(file, (file->ndirs + 1), sizeof(comp_doc_directory_t *));
 
     if(list == NULL)
         return NULL;
-    
-    //XXX: sanity check: dir->root_dirid
-    *list = &file->dirs[dir->root_dirid];
 
-    cur_write = list + 1;
-    cur_read = list;
-    
-    // XXX: check that cur_write is not writing out of bounds as well
-    while(*cur_read != NULL)
+    written = 0;
+
+    while((d = comp_doc_iter_next(&it)) != NULL)
+        list[written++] = d;
+
+    if(it.err != COMP_DOC_SUCCESS)
     {
-        d = *cur_read;
+        doc_free(file, list);
+        return NULL;
+    }
 
-        if(d->left_child_dirid != COMP_DOC_DIRECTORY_NO_NODE)
-        {
-            // XXX: Should check if the dirid is bigger than file->ndirs
-            *cur_write = &file->dirs[d->left_child_dirid];
-            cur_write++;
-        }
+    return doc_realloc(file, list, (written + 1) * sizeof(comp_doc_directory_t *));
+}
+
+/*
+ * Brings the tables of the file up to `level' (one of COMP_DOC_LOADED_*),
+ * parsing whatever is still missing. Files opened with COMP_DOC_OPEN_LAZY
+ * get their tables this way, the first time an API call needs them.
+ */
+int
+load_tables(comp_doc_file_t *file, int level)
+{
+    int err;
+
+    if(__atomic_load_n(&file->loaded, __ATOMIC_ACQUIRE) >= level)
+        return COMP_DOC_SUCCESS;
+
+    err = COMP_DOC_SUCCESS;
+
+    pthread_mutex_lock(&file->lock);
+
+    while(err == COMP_DOC_SUCCESS && file->loaded < level)
+    {
+        STATS_CLOCK(start);
 
-        if(d->right_child_dirid != COMP_DOC_DIRECTORY_NO_NODE)
+        switch(file->loaded)
         {
-            // XXX: also here
-            *cur_write = &file->dirs[d->right_child_dirid];
-            cur_write++;
+            case COMP_DOC_LOADED_HEADER:
+                err = parse_msat(file, &file->msat);
+                break;
+            case COMP_DOC_LOADED_MSAT:
+                err = parse_sat(file, &file->sat);
+                break;
+            case COMP_DOC_LOADED_SAT:
+                err = parse_directories(file, &file->dirs, &file->ndirs);
+                break;
+            case COMP_DOC_LOADED_DIRS:
+                if((err = parse_ssat(file, &file->ssat)) == COMP_DOC_NO_SSAT)
+                    err = COMP_DOC_SUCCESS;
+                break;
+            case COMP_DOC_LOADED_SSAT:
+                err = parse_ministream(file, &file->ministream, &file->nministream);
+
+                if(err == COMP_DOC_SUCCESS && (file->flags & COMP_DOC_OPEN_CACHE_MINISTREAM) && file->map == NULL)
+                    err = read_ministream(file, &file->mini_container, &file->mini_container_size);
+                break;
         }
 
-        cur_read++;
+        // the phases follow the loading levels
+        STATS_PHASE(file, file->loaded + 1, start);
+
+        if(err == COMP_DOC_SUCCESS)
+            __atomic_store_n(&file->loaded, file->loaded + 1, __ATOMIC_RELEASE);
     }
 
-    written = cur_write - list;
-    //if(written > file->ndirs)
-    //  corruption
+    pthread_mutex_unlock(&file->lock);
 
-    return realloc(list, (written + 1) * sizeof(comp_doc_directory_t));
+    return err;
 }
 
+/*
+ * Returns the root entry. If the directories have not been loaded yet,
+ * only the first directory entry is read, which spares parsing the
+ * allocation tables when a lazily opened file is classified.
+ */
 comp_doc_directory_t *
 comp_doc_get_root_storage(comp_doc_file_t *file)
 {
-    if(file->ndirs > 0)
-        return file->dirs;
-    else
-        return NULL;
+    comp_doc_directory_t *root = NULL;
+
+    if(__atomic_load_n(&file->loaded, __ATOMIC_ACQUIRE) >= COMP_DOC_LOADED_DIRS)
+        return file->ndirs > 0 ? file->dirs : NULL;
+
+    pthread_mutex_lock(&file->lock);
+
+    if(IS_DIR_ROOT_ENTRY((&file->root_entry)) 
+        || read_position(file, sector_position(file->hdr, file->hdr->first_dir_sector), 
+            &file->root_entry, sizeof(comp_doc_directory_t)) > 0)
+    {
+        if(file->hdr->version < 4)
+            clean_sizes(&file->root_entry, 1, 1);
+
+        if(IS_DIR_ROOT_ENTRY((&file->root_entry)))
+            root = &file->root_entry;
+    }
+
+    pthread_mutex_unlock(&file->lock);
+
+    return root;
 }
 
 comp_doc_directory_t *
 comp_doc_get_directory(comp_doc_file_t *file, uint32_t dirid)
 {
     comp_doc_directory_t *dir = NULL;
+
+    if(load_tables(file, COMP_DOC_LOADED_DIRS) != COMP_DOC_SUCCESS)
+        return NULL;
+
     if(dirid < file->ndirs)
     {
         dir = file->dirs + dirid;
@@ -80,29 +258,592 @@ comp_doc_get_directory(comp_doc_file_t *file, uint32_t dirid)
     return dir;
 }
 
+/*
+ * Returns the number of directory entries, parsing the directories first
+ * if needed. Zero is returned if they cannot be parsed.
+ */
+unsigned int
+comp_doc_count_directories(comp_doc_file_t *file)
+{
+    if(load_tables(file, COMP_DOC_LOADED_DIRS) != COMP_DOC_SUCCESS)
+        return 0;
+
+    return file->ndirs;
+}
+
+/*
+ * Folds a UTF-16 code unit the way names are compared: letters of the
+ * Latin-1 range are upper-cased, everything else is left as it is.
+ */
+static uint16_t
+fold_char(uint16_t c)
+{
+    if(c >= 'a' && c <= 'z')
+        return c - ('a' - 'A');
+
+    if(c >= 0xE0 && c <= 0xFE && c != 0xF7)
+        return c - 0x20;
+
+    return c;
+}
+
+/*
+ * Returns the number of UTF-16 code units of the name of a directory entry,
+ * without the terminating null, or -1 if the stored length is invalid.
+ */
+static int
+entry_name_length(comp_doc_directory_t *dir)
+{
+    if(dir->name_length < 2 || dir->name_length > COMP_DOC_DIRECTORY_NAME_SIZE || (dir->name_length & 1))
+        return -1;
+
+    return dir->name_length / 2 - 1;
+}
+
+static uint16_t
+entry_name_char(comp_doc_directory_t *dir, int i)
+{
+    return dir->name[2 * i] | (dir->name[2 * i + 1] << 8);
+}
+
+/*
+ * Converts `length' bytes of UTF-8 into the UTF-16 code units of a name.
+ * Returns the number of code units or -1 if the name is invalid or does
+ * not fit in a directory entry.
+ */
+int
+name_from_utf8(const char *str, size_t length, uint16_t *name)
+{
+    const unsigned char *p = (const unsigned char *)str;
+    const unsigned char *end = p + length;
+    uint32_t cp;
+    int n, extra;
+
+    n = 0;
+
+    while(p < end)
+    {
+        if(*p < 0x80)
+        {
+            cp = *p++;
+            extra = 0;
+        }
+        else if((*p & 0xE0) == 0xC0)
+        {
+            cp = *p++ & 0x1F;
+            extra = 1;
+        }
+        else if((*p & 0xF0) == 0xE0)
+        {
+            cp = *p++ & 0x0F;
+            extra = 2;
+        }
+        else if((*p & 0xF8) == 0xF0)
+        {
+            cp = *p++ & 0x07;
+            extra = 3;
+        }
+        else
+        {
+            return -1;
+        }
+
+        for(; extra > 0; extra--)
+        {
+            if(p == end || (*p & 0xC0) != 0x80)
+                return -1;
+            cp = (cp << 6) | (*p++ & 0x3F);
+        }
+
+        if(cp >= 0x10000)
+        {
+            if(n + 2 > COMP_DOC_DIRECTORY_NAME_SIZE / 2 - 1)
+                return -1;
+            cp -= 0x10000;
+            name[n++] = 0xD800 | (cp >> 10);
+            name[n++] = 0xDC00 | (cp & 0x3FF);
+        }
+        else
+        {
+            if(n + 1 > COMP_DOC_DIRECTORY_NAME_SIZE / 2 - 1)
+                return -1;
+            name[n++] = cp;
+        }
+    }
+
+    return n;
+}
+
+/*
+ * FNV-1a over the parent and the folded name, so that lookups ignore case.
+ */
+static uint32_t
+name_hash(uint32_t parent, const uint16_t *name, int length)
+{
+    uint32_t h = 2166136261u;
+    uint16_t c;
+    int i;
+
+    for(i = 0; i < 4; i++)
+    {
+        h ^= (parent >> (8 * i)) & 0xFF;
+        h *= 16777619u;
+    }
+
+    for(i = 0; i < length; i++)
+    {
+        c = fold_char(name[i]);
+        h ^= c & 0xFF;
+        h *= 16777619u;
+        h ^= c >> 8;
+        h *= 16777619u;
+    }
+
+    return h;
+}
+
+static int
+entry_name_equals(comp_doc_directory_t *dir, const uint16_t *name, int length)
+{
+    int i;
+
+    if(entry_name_length(dir) != length)
+        return 0;
+
+    for(i = 0; i < length; i++)
+    {
+        if(fold_char(entry_name_char(dir, i)) != fold_char(name[i]))
+            return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * Builds the name index of the directories. Every entry reachable from the
+ * root is stored in an open addressing table, keyed on its parent storage
+ * and its case-folded name.
+ */
+static int
+build_name_index(comp_doc_file_t *file, comp_doc_name_index_t **ret_index)
+{
+    comp_doc_name_index_t *index;
+    comp_doc_directory_t *dir;
+    uint32_t *stack, nstack, id, child, size, h;
+    uint16_t name[COMP_DOC_DIRECTORY_NAME_SIZE / 2];
+    int i, length, err;
+
+    *ret_index = NULL;
+    err = COMP_DOC_SUCCESS;
+    stack = NULL;
+
+    index = doc_calloc(file, 1, sizeof(comp_doc_name_index_t));
+
+    if(index == NULL)
+        return COMP_DOC_NO_MEM;
+
+    // keep the table at most half full
+    for(size = 16; size < 2 * file->ndirs; size <<= 1)
+        ;
+
+    index->mask = size - 1;
+    index->slots = doc_malloc(file, size * sizeof(uint32_t));
+    index->parents = doc_malloc(file, file->ndirs * sizeof(uint32_t));
+    stack = doc_malloc(file, file->ndirs * sizeof(uint32_t));
+
+    if(index->slots == NULL || index->parents == NULL || stack == NULL)
+    {
+        err = COMP_DOC_NO_MEM;
+        goto _error;
+    }
+
+    memset(index->slots, 0xFF, size * sizeof(uint32_t));
+    memset(index->parents, 0xFF, file->ndirs * sizeof(uint32_t));
+
+    nstack = 0;
+
+    // the root is its own parent, which also marks it as visited
+    if(file->ndirs > 0 && IS_DIR_ROOT_ENTRY(file->dirs))
+    {
+        index->parents[0] = 0;
+        child = file->dirs[0].root_dirid;
+
+        if(child < file->ndirs && index->parents[child] == COMP_DOC_DIRECTORY_NO_NODE)
+        {
+            index->parents[child] = 0;
+            stack[nstack++] = child;
+        }
+    }
+
+    // every entry is pushed once at most, as its parent is set when pushed
+    while(nstack > 0)
+    {
+        id = stack[--nstack];
+        dir = &file->dirs[id];
+
+        if((length = entry_name_length(dir)) >= 0)
+        {
+            for(i = 0; i < length; i++)
+                name[i] = entry_name_char(dir, i);
+
+            h = name_hash(index->parents[id], name, length);
+
+            while(index->slots[h & index->mask] != COMP_DOC_DIRECTORY_NO_NODE)
+                h++;
+
+            index->slots[h & index->mask] = id;
+        }
+
+        child = dir->left_child_dirid;
+        if(child < file->ndirs && index->parents[child] == COMP_DOC_DIRECTORY_NO_NODE)
+        {
+            index->parents[child] = index->parents[id];
+            stack[nstack++] = child;
+        }
+
+        child = dir->right_child_dirid;
+        if(child < file->ndirs && index->parents[child] == COMP_DOC_DIRECTORY_NO_NODE)
+        {
+            index->parents[child] = index->parents[id];
+            stack[nstack++] = child;
+        }
+
+        child = dir->root_dirid;
+        if(IS_DIR_STORAGE(dir) && child < file->ndirs && index->parents[child] == COMP_DOC_DIRECTORY_NO_NODE)
+        {
+            index->parents[child] = id;
+            stack[nstack++] = child;
+        }
+    }
+
+    *ret_index = index;
+
+_error:
+    doc_free(file, stack);
+
+    if(err != COMP_DOC_SUCCESS)
+        free_name_index(file, index);
+
+    return err;
+}
+
+void
+free_name_index(comp_doc_file_t *file, comp_doc_name_index_t *index)
+{
+    if(index)
+    {
+        doc_free(file, index->slots);
+        doc_free(file, index->parents);
+        doc_free(file, index);
+    }
+}
+
+/*
+ * Returns the directory entry found at `path', whose components are UTF-8
+ * names separated by '/', starting from the root storage. Names are
+ * compared regardless of case. The first lookup builds a hash index of the
+ * directories, after that every component costs O(1).
+ * Returns NULL if there is no such entry.
+ */
+comp_doc_directory_t *
+comp_doc_find(comp_doc_file_t *file, const char *path)
+{
+    comp_doc_name_index_t *index;
+    uint16_t name[COMP_DOC_DIRECTORY_NAME_SIZE / 2];
+    const char *end;
+    uint32_t parent, id, h;
+    int length, err;
+
+    if(load_tables(file, COMP_DOC_LOADED_DIRS) != COMP_DOC_SUCCESS || file->ndirs == 0)
+        return NULL;
+
+    if((index = __atomic_load_n(&file->name_index, __ATOMIC_ACQUIRE)) == NULL)
+    {
+        pthread_mutex_lock(&file->lock);
+
+        err = COMP_DOC_SUCCESS;
+        if(file->name_index == NULL && (err = build_name_index(file, &index)) == COMP_DOC_SUCCESS)
+            __atomic_store_n(&file->name_index, index, __ATOMIC_RELEASE);
+
+        index = file->name_index;
+
+        pthread_mutex_unlock(&file->lock);
+
+        if(err != COMP_DOC_SUCCESS)
+            return NULL;
+    }
+
+    parent = 0;
+
+    while(*path != '\0')
+    {
+        if(*path == '/')
+        {
+            path++;
+            continue;
+        }
+
+        if((end = strchr(path, '/')) == NULL)
+            end = path + strlen(path);
+
+        if((length = name_from_utf8(path, end - path, name)) < 0)
+            return NULL;
+
+        h = name_hash(parent, name, length);
+
+        for(;; h++)
+        {
+            id = index->slots[h & index->mask];
+
+            if(id == COMP_DOC_DIRECTORY_NO_NODE)
+                return NULL;
+
+            if(index->parents[id] == parent && id != parent && entry_name_equals(&file->dirs[id], name, length))
+                break;
+        }
+
+        parent = id;
+        path = end;
+    }
+
+    return &file->dirs[parent];
+}
+
+/*
+ * Compares a name with the name of a directory entry, following the order
+ * of the red-black trees of the directory: shorter names come first, names
+ * of the same length are compared code unit by code unit in upper case.
+ */
+static int
+compare_entry_name(const uint16_t *name, int length, comp_doc_directory_t *dir)
+{
+    int i, dir_length;
+    uint16_t a, b;
+
+    dir_length = entry_name_length(dir);
+
+    if(length != dir_length)
+        return length < dir_length ? -1 : 1;
+
+    for(i = 0; i < length; i++)
+    {
+        a = fold_char(name[i]);
+        b = fold_char(entry_name_char(dir, i));
+
+        if(a != b)
+            return a < b ? -1 : 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Compares two directory entries in the order of the red-black trees.
+ */
+int
+compare_entries(comp_doc_directory_t *a, comp_doc_directory_t *b)
+{
+    uint16_t units[COMP_DOC_DIRECTORY_NAME_SIZE / 2];
+    int i, length;
+
+    if((length = entry_name_length(a)) < 0)
+        length = 0;
+
+    for(i = 0; i < length; i++)
+        units[i] = entry_name_char(a, i);
+
+    return compare_entry_name(units, length, b);
+}
+
+/*
+ * Returns the child of `storage' called `name' (UTF-8), or NULL if there is
+ * none. The children of a storage form a search tree, so the lookup is a
+ * binary search that visits O(log n) entries and allocates nothing.
+ */
+comp_doc_directory_t *
+comp_doc_get_child(comp_doc_file_t *file, comp_doc_directory_t *storage, const char *name)
+{
+    uint16_t units[COMP_DOC_DIRECTORY_NAME_SIZE / 2];
+    uint32_t id, steps;
+    int length, cmp;
+    comp_doc_directory_t *dir;
+
+    if(!IS_DIR_STORAGE(storage) && !IS_DIR_ROOT_ENTRY(storage))
+        return NULL;
+
+    if(load_tables(file, COMP_DOC_LOADED_DIRS) != COMP_DOC_SUCCESS)
+        return NULL;
+
+    if((length = name_from_utf8(name, strlen(name), units)) < 0)
+        return NULL;
+
+    id = storage->root_dirid;
+
+    // a corrupted tree may loop, no valid path is longer than the directory
+    for(steps = 0; id < file->ndirs && steps < file->ndirs; steps++)
+    {
+        dir = &file->dirs[id];
+
+        if((cmp = compare_entry_name(units, length, dir)) == 0)
+            return dir;
+
+        id = cmp < 0 ? dir->left_child_dirid : dir->right_child_dirid;
+    }
+
+    return NULL;
+}
+
+/*
+ * Releases memory returned by the library for the file, such as the buffers
+ * of comp_doc_read_stream and the lists of comp_doc_list_dir.
+ */
+void
+comp_doc_free(comp_doc_file_t *file, void *ptr)
+{
+    doc_free(file, ptr);
+}
+
+/*
+ * Copies the statistics collected on the file so far into `stats'. Returns
+ * COMP_DOC_NO_STATS when the library was built without COMP_DOC_STATS.
+ */
+int
+comp_doc_get_stats(comp_doc_file_t *file, comp_doc_stats_t *stats)
+{
+#ifdef COMP_DOC_STATS
+    const uint64_t *src = (const uint64_t *)&file->stats;
+    uint64_t *dst = (uint64_t *)stats;
+    size_t i;
+
+    // every field is a counter, each one is read atomically
+    for(i = 0; i < sizeof(comp_doc_stats_t) / sizeof(uint64_t); i++)
+        dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+
+    return COMP_DOC_SUCCESS;
+#else
+    (void)file;
+    memset(stats, 0, sizeof(comp_doc_stats_t));
+
+    return COMP_DOC_NO_STATS;
+#endif
+}
+
+void
+comp_doc_reset_stats(comp_doc_file_t *file)
+{
+#ifdef COMP_DOC_STATS
+    uint64_t *counters = (uint64_t *)&file->stats;
+    size_t i;
+
+    for(i = 0; i < sizeof(comp_doc_stats_t) / sizeof(uint64_t); i++)
+        __atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
+#else
+    (void)file;
+#endif
+}
+
 void 
 comp_doc_close(comp_doc_file_t *file)
 {
-    free_header(file->hdr);
-    free_msat(file->msat);
-    free_sat(file->sat);
-    free_ssat(file->ssat);
-    free_directory(file->dirs);
-    close(file->fd);
-    free(file->path);
-    free(file);
+    comp_doc_allocator_t allocator = file->allocator;
+
+    free_header(file, file->hdr);
+    free_msat(file, file->msat);
+    free_sat(file, file->sat);
+    free_ssat(file, file->ssat);
+    free_directory(file, file->dirs);
+    doc_free(file, file->ministream);
+    doc_free(file, file->mini_container);
+    free_name_index(file, file->name_index);
+    cache_destroy(file);
+    if(file->map != NULL)
+        munmap(file->map, file->map_size);
+    if(file->fd != -1)
+        close(file->fd);
+    pthread_mutex_destroy(&file->lock);
+    doc_free(file, file->path);
+    allocator.free(allocator.ctx, file);
+}
+
+/*
+ * Maps the whole file in memory. The header, the allocation tables and the
+ * directories are then parsed straight out of the mapping.
+ */
+static int
+map_file(comp_doc_file_t *file)
+{
+    struct stat st;
+    void *map;
+
+    STATS_ADD(file, syscalls, 2);
+
+    if(fstat(file->fd, &st) == -1)
+        return COMP_DOC_READ_ERR;
+
+    if(st.st_size < COMP_DOC_HEADER_SIZE)
+        return COMP_DOC_INSANE_HEADER;
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, file->fd, 0);
+
+    if(map == MAP_FAILED)
+        return COMP_DOC_READ_ERR;
+
+    // the tables are walked sector by sector, in chain order
+    madvise(map, st.st_size, MADV_WILLNEED);
+
+    file->map = map;
+    file->map_size = st.st_size;
+
+    return COMP_DOC_SUCCESS;
 }
 
+static void *
+default_malloc(void *ctx, size_t size)
+{
+    (void)ctx;
+    return malloc(size);
+}
+
+static void *
+default_realloc(void *ctx, void *ptr, size_t size)
+{
+    (void)ctx;
+    return realloc(ptr, size);
+}
+
+static void
+default_free(void *ctx, void *ptr)
+{
+    (void)ctx;
+    free(ptr);
+}
+
+static const comp_doc_allocator_t default_allocator = {
+    default_malloc, default_realloc, default_free, NULL
+};
+
+/*
+ * Opens the compound document found at `path'. The options select how the
+ * file is accessed and where its memory comes from, NULL gives the same
+ * behaviour as comp_doc_open.
+ */
 int
-comp_doc_open(char *path, int perm, comp_doc_file_t **ret_file)
+comp_doc_open_ex(char *path, int perm, const comp_doc_options_t *opts, comp_doc_file_t **ret_file)
 {
     int fd, open_flags, retval, err;
     comp_doc_file_t *file;
-    
+    const comp_doc_allocator_t *allocator;
+    STATS_CLOCK(start);
+
     *ret_file = NULL;
     err = COMP_DOC_SUCCESS;
 
-    file = calloc(1, sizeof(comp_doc_file_t));
+    if(opts != NULL && opts->allocator != NULL)
+        allocator = opts->allocator;
+    else
+        allocator = &default_allocator;
+
+    file = allocator->malloc(allocator->ctx, sizeof(comp_doc_file_t));
 
     if(file == NULL)
     {
@@ -110,13 +851,19 @@ comp_doc_open(char *path, int perm, comp_doc_file_t **ret_file)
         goto _error;
     }
 
+    memset(file, 0, sizeof(comp_doc_file_t));
+    file->allocator = *allocator;
+    file->fd = -1;
+    file->flags = opts != NULL ? opts->flags : 0;
+    pthread_mutex_init(&file->lock, NULL);
+
     if(!strlen(path))
     {
         err = COMP_DOC_NO_SUCH_FILE;
         goto _error;
     }
 
-    file->path = malloc(strlen(path)+1);
+    file->path = doc_malloc(file, strlen(path)+1);
 
     if(file->path == NULL)
     {
@@ -125,23 +872,21 @@ comp_doc_open(char *path, int perm, comp_doc_file_t **ret_file)
     }
 
     strcpy(file->path, path);
+    file->perm = perm;
 
-    if(file->perm != COMP_DOC_PERM_READ && file->perm != COMP_DOC_PERM_WRITE)
+    // the tables are read back even to write, so writing implies reading
+    if(file->perm == COMP_DOC_PERM_READ)
+        open_flags = O_RDONLY;
+    else if(file->perm == COMP_DOC_PERM_WRITE || file->perm == COMP_DOC_PERM_READ_WRITE)
+        open_flags = O_RDWR;
+    else
     {
         err = COMP_DOC_PERM_UNK;
         goto _error;
     }
-    else
-    {
-        if(file->perm == COMP_DOC_PERM_READ)
-            open_flags = O_RDONLY;
-        else if(file->perm == COMP_DOC_PERM_WRITE)
-            open_flags = O_WRONLY;
-        else if(file->perm == COMP_DOC_PERM_READ_WRITE)
-            open_flags = O_RDWR;
-    }
     
     fd = open(file->path, open_flags);
+    STATS_ADD(file, syscalls, 1);
 
     if(fd == -1)
     {
@@ -150,49 +895,70 @@ comp_doc_open(char *path, int perm, comp_doc_file_t **ret_file)
     }
     file->fd = fd;
 
-    if((retval = parse_header(fd, &file->hdr)) != COMP_DOC_SUCCESS)
+    if((file->flags & COMP_DOC_OPEN_MMAP) && (retval = map_file(file)) != COMP_DOC_SUCCESS)
     {
         err = retval;
         goto _error;
     }
 
-    if((retval = parse_msat(file->fd, file->hdr, &file->msat)) != COMP_DOC_SUCCESS)
+    retval = parse_header(file, &file->hdr);
+    STATS_PHASE(file, COMP_DOC_PHASE_HEADER, start);
+
+    if(retval != COMP_DOC_SUCCESS)
     {
-            err = retval;
-            goto _error;
+        err = retval;
+        goto _error;
     }
 
-    if((retval = parse_sat(file->fd, file->hdr, file->msat, &file->sat)) != COMP_DOC_SUCCESS)
+    if(opts != NULL && opts->cache_size > 0 && file->map == NULL
+        && (retval = cache_create(file, opts->cache_size)) != COMP_DOC_SUCCESS)
     {
         err = retval;
         goto _error;
     }
 
-    if((retval = parse_ssat(file->fd, file->hdr, file->sat, &file->ssat)) < COMP_DOC_SUCCESS)
+    // a lazy open stops at the header, the rest is parsed on demand
+    if(!(file->flags & COMP_DOC_OPEN_LAZY)
+        && (retval = load_tables(file, COMP_DOC_LOADED_ALL)) != COMP_DOC_SUCCESS)
     {
         err = retval;
         goto _error;
     }
 
-    if((retval = parse_directories(file->fd, file->hdr, file->sat, &file->dirs, &file->ndirs)) != COMP_DOC_SUCCESS)
+    if((file->flags & COMP_DOC_OPEN_VERIFY) && (retval = comp_doc_verify(file, NULL)) != COMP_DOC_SUCCESS)
     {
         err = retval;
         goto _error;
     }
 
-
     *ret_file = file;
 
 _error:
-    if(err != COMP_DOC_SUCCESS)
-    {
-        free_header(file->hdr);
-        free_msat(file->msat);
-        free_sat(file->sat);
-        free_ssat(file->ssat);
-        free_directory(file->dirs);
-    }
+    if(err != COMP_DOC_SUCCESS && file != NULL)
+        comp_doc_close(file);
 
     return err;
 }
 
+int
+comp_doc_open(char *path, int perm, comp_doc_file_t **ret_file)
+{
+    return comp_doc_open_ex(path, perm, NULL, ret_file);
+}
+
+/*
+ * Same as comp_doc_open, but the whole file is mapped in memory. The header,
+ * the MSAT and the directories are used in place instead of being copied,
+ * and streams may be accessed without copies using comp_doc_map_stream.
+ */
+int
+comp_doc_open_mmap(char *path, int perm, comp_doc_file_t **ret_file)
+{
+    comp_doc_options_t opts;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.flags = COMP_DOC_OPEN_MMAP;
+
+    return comp_doc_open_ex(path, perm, &opts, ret_file);
+}
+
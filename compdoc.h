@@ -3,19 +3,13 @@
 #define _DEBUG_
 #include <stdint.h>
 #include <stdlib.h>
+#include <pthread.h>
 // Currenty, it supports only the little endian format.
 #define COMP_DOC_SUPPORT_ONLY_LITTLE_ENDIAN
 
-// I didn't find any reference for ssz max size. This limitation is set by me,
-// for security purposes. You may change it, but be cautious for possible integer overflows.
-// (ssz stands for sector size, refer in header's struct for more info)
-#define COMP_DOC_SSZ_MAX 0x10
-
-
 #define COMP_DOC_MAGIC "\xd0\xcf\x11\xe0\xa1\xb1\x1a\xe1"
 #define COMP_DOC_BIG_ENDIAN 0xFEFF
 #define COMP_DOC_LITTLE_ENDIAN 0xFFFE
-#define COMP_DOC_SSZ_MIN 7
 #define COMP_DOC_STREAM_MIN_SIZE 0x1000
 
 #define CALC_SECTOR_SIZE(sz) (2 << (sz - 1))
@@ -66,27 +60,23 @@ typedef struct {
     uint64_t last_modification_time;
 
     uint32_t first_sector;
-    uint32_t size;
-
-    uint32_t unused;  
+    /* version 3 files only use the low 32 bits, the others are cleared on parsing */
+    uint64_t size;
 } __attribute__((packed)) comp_doc_directory_t;
 
 typedef uint32_t comp_doc_secid_value_t;
 
-struct comp_doc_sector_id {
-    size_t offset;
-    comp_doc_secid_value_t value;
-    // if value is positive then next
-    // points to the next sector in the chain
-    struct comp_doc_sector_id *next;
-};
-
-typedef struct comp_doc_sector_id comp_doc_sector_id_t;
-
-
+/*
+ * The allocation tables are kept exactly as they are stored in the file:
+ * secids[n] is the SecID of the sector that follows sector n in its chain,
+ * or one of the special SECID_* values. Every value below SECID_MSAT is
+ * checked to be smaller than `slots' when the table is parsed.
+ */
 typedef struct {
     unsigned int slots;
-    comp_doc_sector_id_t *secids;
+    comp_doc_secid_value_t *secids;
+    /* entries that are SECID_FREE, kept up to date by the writer */
+    unsigned int nfree;
 } comp_doc_sat_t;
 
 #define comp_doc_ssat_t comp_doc_sat_t
@@ -113,7 +103,10 @@ typedef struct {
     /* Short sector size in power-of-two */
     uint16_t sssz;
 
-    uint8_t not_used[10];
+    uint8_t not_used[6];
+
+    /* Sectors of the directory, only counted by version 4 files (0 otherwise) */
+    uint32_t ndir_sectors;
 
     uint32_t nsat_sectors;
     uint32_t first_dir_sector;
@@ -136,22 +129,162 @@ typedef struct {
 
 } __attribute__((packed)) comp_doc_header_t;
 
+/*
+ * Every allocation made for a file goes through these hooks, so that an
+ * arena or a pool can own the memory of a document. `ctx' is passed back
+ * to each of them.
+ */
+typedef struct {
+    void *(*malloc)(void *ctx, size_t size);
+    void *(*realloc)(void *ctx, void *ptr, size_t size);
+    void (*free)(void *ctx, void *ptr);
+    void *ctx;
+} comp_doc_allocator_t;
+
+/* Map the whole file in memory, see comp_doc_open_mmap */
+#define COMP_DOC_OPEN_MMAP          0x1
+/* 
+ * Parse and validate only the header on open. The allocation tables
+ * and the directories are parsed the first time a call needs them.
+ */
+#define COMP_DOC_OPEN_LAZY          0x2
+/*
+ * Read the whole short-stream container in memory with the tables, so that
+ * short streams are copied from there instead of being read 64 bytes at a
+ * time. Ignored for mapped files, which are read from memory anyway.
+ */
+#define COMP_DOC_OPEN_CACHE_MINISTREAM 0x4
+/*
+ * Check every chain of the file with comp_doc_verify once the tables are
+ * parsed, and fail with COMP_DOC_CORRUPT when one is wrong. Implies parsing
+ * all the tables on open, even with COMP_DOC_OPEN_LAZY.
+ */
+#define COMP_DOC_OPEN_VERIFY        0x8
+
+typedef struct {
+    int flags;
+    /* NULL selects malloc, realloc and free */
+    const comp_doc_allocator_t *allocator;
+    /*
+     * Bytes of sectors kept in memory by the sector cache, which serves the
+     * reads of the chains of streams. 0 for no cache, which mapped files
+     * never have.
+     */
+    size_t cache_size;
+} comp_doc_options_t;
+
+typedef struct comp_doc_sector_cache comp_doc_sector_cache_t;
+
+/*
+ * Hash index of the directory entries, keyed on the parent storage and the
+ * case-folded name. `slots' holds directory IDs, or COMP_DOC_DIRECTORY_NO_NODE
+ * for empty slots, and `parents' the parent storage of each entry.
+ */
+typedef struct {
+    uint32_t *slots;
+    uint32_t mask;
+    uint32_t *parents;
+} comp_doc_name_index_t;
+
+#define COMP_DOC_LOADED_HEADER      0
+#define COMP_DOC_LOADED_MSAT        1
+#define COMP_DOC_LOADED_SAT         2
+#define COMP_DOC_LOADED_DIRS        3
+#define COMP_DOC_LOADED_SSAT        4
+#define COMP_DOC_LOADED_ALL         5
+
+/*
+ * Phases timed by the statistics of a file. The ones up to the mini stream
+ * are the steps of loading the tables, in order; reads cover every stream
+ * read, whatever the API used.
+ */
+#define COMP_DOC_PHASE_HEADER       0
+#define COMP_DOC_PHASE_MSAT         1
+#define COMP_DOC_PHASE_SAT          2
+#define COMP_DOC_PHASE_DIRS         3
+#define COMP_DOC_PHASE_SSAT         4
+#define COMP_DOC_PHASE_MINISTREAM   5
+#define COMP_DOC_PHASE_READ         6
+#define COMP_DOC_PHASES             7
+
+/*
+ * Statistics of a file, collected only when the library is built with
+ * COMP_DOC_STATS, see comp_doc_get_stats.
+ */
+typedef struct {
+    /* system calls issued on the file: open, fstat, mmap and reads */
+    uint64_t syscalls;
+    uint64_t bytes_read;
+    /* sectors looked up while following the chains of streams */
+    uint64_t sectors;
+    /* short sectors located in the short-stream container */
+    uint64_t short_lookups;
+    uint64_t allocations;
+    /* wall time spent in each phase, and how many times it ran */
+    uint64_t phase_ns[COMP_DOC_PHASES];
+    uint64_t phase_count[COMP_DOC_PHASES];
+} comp_doc_stats_t;
+
 #define COMP_DOC_PERM_READ          0
 #define COMP_DOC_PERM_WRITE         1
 #define COMP_DOC_PERM_READ_WRITE    2
 
+/*
+ * Once comp_doc_open has returned, the handle is only read from and every
+ * access to the file uses positional reads (pread) or the mapping. Thus,
+ * the same handle may be shared by threads that read streams concurrently.
+ * Tables that are parsed on demand are loaded under `lock'.
+ * Closing the handle must wait for all the readers to finish.
+ *
+ * With COMP_DOC_OPEN_LAZY the table fields stay NULL until they are needed,
+ * so callers should go through the API instead of reading them directly.
+ */
 typedef struct {
     char *path;
     int perm;
     int fd;
+    /* Whole file mapping, NULL unless opened with comp_doc_open_mmap */
+    void *map;
+    size_t map_size;
     comp_doc_header_t *hdr;
     comp_doc_msat_t *msat;
     comp_doc_sat_t *sat;
     comp_doc_ssat_t *ssat;
     comp_doc_directory_t *dirs;
     unsigned int ndirs;
+    /* SecIDs of the short-stream container, in chain order */
+    uint32_t *ministream;
+    unsigned int nministream;
+    /* The container itself, with COMP_DOC_OPEN_CACHE_MINISTREAM */
+    unsigned char *mini_container;
+    size_t mini_container_size;
+    /* COMP_DOC_OPEN_* flags given on open */
+    int flags;
+    comp_doc_allocator_t allocator;
+    /* How far the tables have been parsed, one of COMP_DOC_LOADED_* */
+    int loaded;
+    /* Root entry read on its own by comp_doc_get_root_storage */
+    comp_doc_directory_t root_entry;
+    /* NULL unless comp_doc_options_t.cache_size was given */
+    comp_doc_sector_cache_t *cache;
+    /* Built on the first comp_doc_find */
+    comp_doc_name_index_t *name_index;
+    /* Serializes the parsing of the tables on demand */
+    pthread_mutex_t lock;
+#ifdef COMP_DOC_STATS
+    comp_doc_stats_t stats;
+#endif
 } comp_doc_file_t;
 
+#define COMP_DOC_CORRUPT            (-18)
+#define COMP_DOC_NO_CACHE           (-17)
+#define COMP_DOC_SAME_FILE          (-16)
+#define COMP_DOC_INVALID_NAME       (-15)
+#define COMP_DOC_ENTRY_EXISTS       (-14)
+#define COMP_DOC_WRITE_ERR          (-13)
+#define COMP_DOC_READ_ONLY          (-12)
+#define COMP_DOC_NO_STATS           (-11)
+#define COMP_DOC_DIR_TOO_DEEP       (-10)
 #define COMP_DOC_INVALID_SAT        (-9)
 #define COMP_DOC_INSANE_HEADER      (-8)
 #define COMP_DOC_SEEK_ERR           (-7)
@@ -164,12 +297,45 @@ typedef struct {
 #define COMP_DOC_SUCCESS            0
 #define COMP_DOC_NO_SSAT            1
 
+/* Also walk the contents of the storages below the starting one */
+#define COMP_DOC_ITER_RECURSIVE     0x1
+
+// Pending entries of a walk. Valid trees need far less: the depth of a
+// balanced tree of siblings, plus one entry per level of nested storages.
+#define COMP_DOC_ITER_STACK_SIZE    256
 
+typedef struct {
+    comp_doc_file_t *file;
+    int flags;
+    int err;
+    /* the entry returned last */
+    uint32_t dirid;
+    uint32_t parent;
+    unsigned int depth;
+    uint32_t visited;
+    unsigned int nstack;
+    struct {
+        uint32_t dirid;
+        uint32_t parent;
+        unsigned int depth;
+    } stack[COMP_DOC_ITER_STACK_SIZE];
+} comp_doc_dir_iter_t;
+
+int comp_doc_iter_init(comp_doc_file_t *, comp_doc_directory_t *, int, comp_doc_dir_iter_t *);
+comp_doc_directory_t * comp_doc_iter_next(comp_doc_dir_iter_t *);
 comp_doc_directory_t ** comp_doc_list_dir(comp_doc_file_t *, comp_doc_directory_t *);
 comp_doc_directory_t * comp_doc_get_root_storage(comp_doc_file_t *);
 comp_doc_directory_t * comp_doc_get_directory(comp_doc_file_t *, uint32_t);
+unsigned int comp_doc_count_directories(comp_doc_file_t *);
+comp_doc_directory_t * comp_doc_find(comp_doc_file_t *, const char *);
+comp_doc_directory_t * comp_doc_get_child(comp_doc_file_t *, comp_doc_directory_t *, const char *);
 int comp_doc_open(char *, int, comp_doc_file_t **);    
+int comp_doc_open_mmap(char *, int, comp_doc_file_t **);
+int comp_doc_open_ex(char *, int, const comp_doc_options_t *, comp_doc_file_t **);
+void comp_doc_free(comp_doc_file_t *, void *);
 void comp_doc_close(comp_doc_file_t *);
+int comp_doc_get_stats(comp_doc_file_t *, comp_doc_stats_t *);
+void comp_doc_reset_stats(comp_doc_file_t *);
 
 #include "io.h"
 #endif /* _CFBF_H_ */
\ No newline at end of file
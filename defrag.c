@@ -0,0 +1,409 @@
+#include "defrag.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/*
+ * The new file is written front to back, never seeking.
+ */
+typedef struct {
+    comp_doc_file_t *file;
+    int fd;
+    unsigned char *buffer;
+    size_t used;
+} defrag_out_t;
+
+static int
+out_flush(defrag_out_t *out)
+{
+    ssize_t written;
+    size_t total;
+
+    for(total = 0; total < out->used; total += written)
+    {
+        written = write(out->fd, out->buffer + total, out->used - total);
+        STATS_ADD(out->file, syscalls, 1);
+
+        if(written < 0 && errno == EINTR)
+        {
+            written = 0;
+            continue;
+        }
+
+        if(written <= 0)
+            return COMP_DOC_WRITE_ERR;
+    }
+
+    out->used = 0;
+
+    return COMP_DOC_SUCCESS;
+}
+
+/*
+ * Appends `size' bytes of `data' to the new file, or zeros if `data' is NULL.
+ */
+static int
+out_write(defrag_out_t *out, const void *data, size_t size)
+{
+    size_t count;
+    int err;
+
+    while(size > 0)
+    {
+        if(out->used == COMP_DOC_DEFRAG_BUFFER && (err = out_flush(out)) != COMP_DOC_SUCCESS)
+            return err;
+
+        count = COMP_DOC_DEFRAG_BUFFER - out->used;
+
+        if(count > size)
+            count = size;
+
+        if(data != NULL)
+        {
+            memcpy(out->buffer + out->used, data, count);
+            data = (const uint8_t *)data + count;
+        }
+        else
+        {
+            memset(out->buffer + out->used, 0, count);
+        }
+
+        out->used += count;
+        size -= count;
+    }
+
+    return COMP_DOC_SUCCESS;
+}
+
+/*
+ * Appends a stream to the new file, padded to a whole number of sectors of
+ * `sector_size' bytes. The data is read straight into the output buffer.
+ */
+static int
+out_stream(defrag_out_t *out, comp_doc_directory_t *dir, uint32_t sector_size)
+{
+    comp_doc_stream_t *stream;
+    size_t remaining, count;
+    ssize_t got;
+    int err;
+
+    if((err = comp_doc_stream_open(out->file, dir, 0, &stream)) != COMP_DOC_SUCCESS)
+        return err;
+
+    for(remaining = dir->size; remaining > 0; remaining -= got)
+    {
+        if(out->used == COMP_DOC_DEFRAG_BUFFER && (err = out_flush(out)) != COMP_DOC_SUCCESS)
+            goto _error;
+
+        count = COMP_DOC_DEFRAG_BUFFER - out->used;
+
+        if(count > remaining)
+            count = remaining;
+
+        if((got = comp_doc_stream_read(stream, out->buffer + out->used, count)) <= 0)
+        {
+            err = got < 0 ? (int)got : COMP_DOC_READ_ERR;
+            goto _error;
+        }
+
+        out->used += got;
+    }
+
+    err = out_write(out, NULL, (sector_size - dir->size % sector_size) % sector_size);
+
+_error:
+    comp_doc_stream_close(stream);
+
+    return err;
+}
+
+/*
+ * Chains `n' consecutive sectors starting at `first'.
+ */
+static void
+link_run(uint32_t *table, uint32_t first, uint32_t n)
+{
+    uint32_t i;
+
+    for(i = 0; i < n; i++)
+        table[first + i] = i + 1 < n ? first + i + 1 : SECID_END_OF_CHAIN;
+}
+
+int
+comp_doc_defrag(comp_doc_file_t *file, char *path)
+{
+    comp_doc_header_t *hdr;
+    comp_doc_directory_t *dirs, *dir, empty;
+    comp_doc_dir_iter_t it;
+    defrag_out_t out;
+    struct stat st, out_st;
+    uint32_t *order, *sat, *ssat, *slots;
+    uint8_t *reached;
+    uint32_t sector_size, short_size, per, per_dir, n, norder, i, j;
+    uint32_t nsat, nmsat, ndir, nssat, ncontainer, nshort, nbig, base, prev;
+    uint32_t next, short_next, first_dir, first_ssat, first_container;
+    size_t header_size;
+    int err;
+
+    if((err = load_tables(file, COMP_DOC_LOADED_ALL)) != COMP_DOC_SUCCESS)
+        return err;
+
+    memset(&out, 0, sizeof(defrag_out_t));
+    out.file = file;
+    out.fd = -1;
+    dirs = NULL;
+    order = sat = ssat = NULL;
+    reached = NULL;
+
+    hdr = file->hdr;
+    sector_size = CALC_SECTOR_SIZE(hdr->ssz);
+    short_size = CALC_SHORT_SECTOR_SIZE(hdr->sssz);
+    per = sector_size / 4;
+    per_dir = sector_size / COMP_DOC_DIRECTORY_SZ;
+    // the header always takes 512 bytes, padded to a whole sector
+    header_size = sector_size > COMP_DOC_HEADER_SIZE ? sector_size : COMP_DOC_HEADER_SIZE;
+
+    // the entries are kept where they are, so the trees are unchanged
+    dirs = doc_malloc(file, file->ndirs * sizeof(comp_doc_directory_t));
+    order = doc_malloc(file, file->ndirs * sizeof(uint32_t));
+    reached = doc_calloc(file, file->ndirs, 1);
+
+    if(dirs == NULL || order == NULL || reached == NULL)
+    {
+        err = COMP_DOC_NO_MEM;
+        goto _error;
+    }
+
+    memcpy(dirs, file->dirs, file->ndirs * sizeof(comp_doc_directory_t));
+
+    if((err = comp_doc_iter_init(file, comp_doc_get_root_storage(file), COMP_DOC_ITER_RECURSIVE, &it)) != COMP_DOC_SUCCESS)
+        goto _error;
+
+    norder = 0;
+    reached[0] = 1;
+
+    while((dir = comp_doc_iter_next(&it)) != NULL)
+    {
+        reached[it.dirid] = 1;
+
+        if(IS_DIR_STREAM(dir))
+            order[norder++] = it.dirid;
+    }
+
+    if((err = it.err) != COMP_DOC_SUCCESS)
+        goto _error;
+
+    memset(&empty, 0, sizeof(comp_doc_directory_t));
+    empty.left_child_dirid = empty.right_child_dirid = empty.root_dirid = COMP_DOC_DIRECTORY_NO_NODE;
+    ndir = 1;
+
+    for(i = 1; i < file->ndirs; i++)
+    {
+        if(!reached[i])
+            dirs[i] = empty;
+        else
+            ndir = i + 1;
+    }
+
+    ndir = (ndir + per_dir - 1) / per_dir;
+    nshort = nbig = 0;
+
+    for(i = 0; i < norder; i++)
+    {
+        dir = &dirs[order[i]];
+
+        if(dir->size < hdr->stream_min_size)
+            nshort += (dir->size + short_size - 1) / short_size;
+        else
+            nbig += (dir->size + sector_size - 1) / sector_size;
+    }
+
+    ncontainer = ((uint64_t)nshort * short_size + sector_size - 1) / sector_size;
+    nssat = (nshort + per - 1) / per;
+    base = ndir + nssat + ncontainer + nbig;
+
+    // the SAT describes its own sectors and those of the MSAT
+    nsat = nmsat = 0;
+
+    do
+    {
+        prev = nsat;
+        nsat = ((uint64_t)base + nsat + nmsat + per - 1) / per;
+        nmsat = nsat > COMP_DOC_HEADER_MSAT_SLOTS ? (nsat - COMP_DOC_HEADER_MSAT_SLOTS + per - 2) / (per - 1) : 0;
+    }
+    while(nsat != prev);
+
+    first_dir = nsat + nmsat;
+    first_ssat = first_dir + ndir;
+    first_container = first_ssat + nssat;
+    next = first_container + ncontainer;
+
+    sat = doc_malloc(file, (size_t)nsat * sector_size);
+    ssat = doc_malloc(file, (size_t)nssat * sector_size + 1);
+
+    if(sat == NULL || ssat == NULL)
+    {
+        err = COMP_DOC_NO_MEM;
+        goto _error;
+    }
+
+    memset(sat, 0xFF, (size_t)nsat * sector_size);
+    memset(ssat, 0xFF, (size_t)nssat * sector_size);
+
+    for(i = 0; i < nsat; i++)
+        sat[i] = SECID_SAT;
+
+    for(i = nsat; i < first_dir; i++)
+        sat[i] = SECID_MSAT;
+
+    link_run(sat, first_dir, ndir);
+    link_run(sat, first_ssat, nssat);
+    link_run(sat, first_container, ncontainer);
+    short_next = 0;
+
+    for(i = 0; i < norder; i++)
+    {
+        dir = &dirs[order[i]];
+
+        if(dir->size == 0)
+        {
+            dir->first_sector = SECID_END_OF_CHAIN;
+        }
+        else if(dir->size < hdr->stream_min_size)
+        {
+            n = (dir->size + short_size - 1) / short_size;
+            link_run(ssat, short_next, n);
+            dir->first_sector = short_next;
+            short_next += n;
+        }
+        else
+        {
+            n = (dir->size + sector_size - 1) / sector_size;
+            link_run(sat, next, n);
+            dir->first_sector = next;
+            next += n;
+        }
+    }
+
+    dirs[0].first_sector = ncontainer ? first_container : SECID_END_OF_CHAIN;
+    dirs[0].size = nshort * short_size;
+
+    STATS_ADD(file, syscalls, 2);
+
+    if(stat(path, &out_st) == 0 && fstat(file->fd, &st) == 0
+        && st.st_dev == out_st.st_dev && st.st_ino == out_st.st_ino)
+    {
+        err = COMP_DOC_SAME_FILE;
+        goto _error;
+    }
+
+    out.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    STATS_ADD(file, syscalls, 1);
+
+    if(out.fd == -1)
+    {
+        err = COMP_DOC_NO_SUCH_FILE;
+        goto _error;
+    }
+
+    if((out.buffer = doc_malloc(file, COMP_DOC_DEFRAG_BUFFER)) == NULL)
+    {
+        err = COMP_DOC_NO_MEM;
+        goto _error;
+    }
+
+    // header, with the first part of the MSAT
+    memcpy(out.buffer, hdr, sizeof(comp_doc_header_t));
+    hdr = (comp_doc_header_t *)out.buffer;
+    hdr->nsat_sectors = nsat;
+    hdr->first_dir_sector = first_dir;
+    hdr->first_ssat_sector = nssat ? first_ssat : SECID_END_OF_CHAIN;
+    hdr->nssat_sectors = nssat;
+    hdr->msat_first_sector = nmsat ? nsat : SECID_END_OF_CHAIN;
+    hdr->nmsat_sectors = nmsat;
+
+    // version 4 headers count the sectors of the directory
+    if(hdr->version >= 4)
+        hdr->ndir_sectors = ndir;
+
+    slots = (uint32_t *)(out.buffer + sizeof(comp_doc_header_t));
+
+    for(i = 0; i < COMP_DOC_HEADER_MSAT_SLOTS; i++)
+        slots[i] = i < nsat ? i : SECID_FREE;
+
+    out.used = sizeof(comp_doc_header_t) + COMP_DOC_HEADER_MSAT_SLOTS * sizeof(uint32_t);
+
+    if((err = out_write(&out, NULL, header_size - out.used)) != COMP_DOC_SUCCESS
+        || (err = out_write(&out, sat, (size_t)nsat * sector_size)) != COMP_DOC_SUCCESS)
+        goto _error;
+
+    for(i = 0; i < nmsat; i++)
+    {
+        for(j = 0; j < per - 1; j++)
+        {
+            n = COMP_DOC_HEADER_MSAT_SLOTS + i * (per - 1) + j;
+            n = n < nsat ? n : SECID_FREE;
+
+            if((err = out_write(&out, &n, sizeof(n))) != COMP_DOC_SUCCESS)
+                goto _error;
+        }
+
+        n = i + 1 < nmsat ? nsat + i + 1 : SECID_END_OF_CHAIN;
+
+        if((err = out_write(&out, &n, sizeof(n))) != COMP_DOC_SUCCESS)
+            goto _error;
+    }
+
+    for(i = 0; i < ndir * per_dir; i++)
+    {
+        if((err = out_write(&out, i < file->ndirs ? &dirs[i] : &empty, sizeof(comp_doc_directory_t))) != COMP_DOC_SUCCESS)
+            goto _error;
+    }
+
+    if((err = out_write(&out, ssat, (size_t)nssat * sector_size)) != COMP_DOC_SUCCESS)
+        goto _error;
+
+    // the short streams, then the long ones, read from the original entries
+    for(i = 0; i < norder; i++)
+    {
+        dir = &file->dirs[order[i]];
+
+        if(dir->size > 0 && dir->size < file->hdr->stream_min_size
+            && (err = out_stream(&out, dir, short_size)) != COMP_DOC_SUCCESS)
+            goto _error;
+    }
+
+    if((err = out_write(&out, NULL, ((uint64_t)ncontainer * sector_size - (uint64_t)nshort * short_size))) != COMP_DOC_SUCCESS)
+        goto _error;
+
+    for(i = 0; i < norder; i++)
+    {
+        dir = &file->dirs[order[i]];
+
+        if(dir->size >= file->hdr->stream_min_size && (err = out_stream(&out, dir, sector_size)) != COMP_DOC_SUCCESS)
+            goto _error;
+    }
+
+    err = out_flush(&out);
+
+_error:
+    if(out.fd != -1)
+    {
+        if(close(out.fd) == -1 && err == COMP_DOC_SUCCESS)
+            err = COMP_DOC_WRITE_ERR;
+
+        STATS_ADD(file, syscalls, 1);
+    }
+
+    doc_free(file, out.buffer);
+    doc_free(file, dirs);
+    doc_free(file, order);
+    doc_free(file, reached);
+    doc_free(file, sat);
+    doc_free(file, ssat);
+
+    return err;
+}
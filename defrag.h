@@ -0,0 +1,17 @@
+#ifndef _COMP_DOC_DEFRAG_H_
+#define _COMP_DOC_DEFRAG_H_
+#include "compdoc.h"
+#include "io.h"
+
+/* the new file is written through a buffer of this size */
+#define COMP_DOC_DEFRAG_BUFFER (1 << 20)
+
+/*
+ * Writes a compacted copy of a file to `path'. The tables come first, then
+ * the directory, the SSAT and the short-stream container, then the streams,
+ * each one contiguous and in the order of a walk of the directory. Free
+ * sectors and entries that cannot be reached from the root are dropped.
+ * `path' must not be the file itself.
+ */
+int comp_doc_defrag(comp_doc_file_t *, char *);
+#endif /* _COMP_DOC_DEFRAG_H_ */
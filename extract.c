@@ -0,0 +1,303 @@
+#include "extract.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+/*
+ * A range of a stream, read by one worker in one go.
+ */
+typedef struct {
+    comp_doc_directory_t *dir;
+    comp_doc_sat_t *sat;
+    uint32_t sector_size;
+    /* sector that holds the byte at `offset' */
+    uint32_t secid;
+    uint64_t offset;
+    size_t length;
+} comp_doc_extract_task_t;
+
+struct comp_doc_extract_job;
+
+/*
+ * Each worker owns the tasks [head, tail) of the job. It takes them from
+ * the head, while idle workers steal from the tail.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    size_t head;
+    size_t tail;
+    pthread_t thread;
+    int started;
+    unsigned int id;
+    /* range of `chunk_size' bytes the tasks are read into */
+    unsigned char *buffer;
+    struct comp_doc_extract_job *job;
+} comp_doc_extract_worker_t;
+
+typedef struct comp_doc_extract_job {
+    comp_doc_file_t *file;
+    comp_doc_extract_task_t *tasks;
+    size_t ntasks;
+    size_t chunk_size;
+    comp_doc_extract_worker_t *workers;
+    unsigned int nworkers;
+    comp_doc_sink_cb sink;
+    void *ctx;
+    /* first error, it stops every worker */
+    int err;
+} comp_doc_extract_job_t;
+
+/*
+ * Splits every stream of the file into tasks of at most `chunk_size' bytes,
+ * whole sectors each. The chain is walked once here, so a worker starts
+ * reading its range right away. Empty streams get one empty task, so the
+ * sink hears of them as well.
+ */
+static int
+collect_tasks(comp_doc_extract_job_t *job)
+{
+    comp_doc_file_t *file = job->file;
+    comp_doc_extract_task_t *task;
+    comp_doc_directory_t *dir;
+    comp_doc_sat_t *sat;
+    uint32_t i, k, sector_size, secid, span;
+    uint64_t offset;
+    size_t capacity;
+
+    capacity = 0;
+
+    for(i = 0; i < file->ndirs; i++)
+    {
+        dir = &file->dirs[i];
+
+        if(!IS_DIR_STREAM(dir))
+            continue;
+
+        sat = stream_table(file, dir, &sector_size);
+        span = job->chunk_size - job->chunk_size % sector_size;
+        secid = dir->first_sector;
+        offset = 0;
+
+        do
+        {
+            if(job->ntasks == capacity)
+            {
+                capacity = capacity ? 2 * capacity : 64;
+                task = doc_realloc(file, job->tasks, capacity * sizeof(comp_doc_extract_task_t));
+
+                if(task == NULL)
+                    return COMP_DOC_NO_MEM;
+
+                job->tasks = task;
+            }
+
+            task = &job->tasks[job->ntasks++];
+            task->dir = dir;
+            task->sat = sat;
+            task->sector_size = sector_size;
+            task->secid = secid;
+            task->offset = offset;
+            task->length = dir->size - offset < span ? dir->size - offset : span;
+
+            offset += task->length;
+
+            // skip to the sector that starts the next range
+            for(k = 0; offset < dir->size && k < span / sector_size; k++)
+            {
+                if(sat == NULL || secid >= sat->slots)
+                    return COMP_DOC_INVALID_SAT;
+
+                secid = sat->secids[secid];
+            }
+        } while(offset < dir->size);
+    }
+
+    return COMP_DOC_SUCCESS;
+}
+
+/*
+ * Takes the next task of the worker, or steals one from the others once
+ * its own are done. Returns 0 when no task is left anywhere.
+ */
+static int
+take_task(comp_doc_extract_worker_t *worker, comp_doc_extract_task_t **task)
+{
+    comp_doc_extract_job_t *job = worker->job;
+    comp_doc_extract_worker_t *victim;
+    unsigned int i;
+
+    pthread_mutex_lock(&worker->lock);
+
+    if(worker->head < worker->tail)
+    {
+        *task = &job->tasks[worker->head++];
+        pthread_mutex_unlock(&worker->lock);
+        return 1;
+    }
+
+    pthread_mutex_unlock(&worker->lock);
+
+    for(i = 1; i < job->nworkers; i++)
+    {
+        victim = &job->workers[(worker->id + i) % job->nworkers];
+
+        pthread_mutex_lock(&victim->lock);
+
+        if(victim->head < victim->tail)
+        {
+            *task = &job->tasks[--victim->tail];
+            pthread_mutex_unlock(&victim->lock);
+            return 1;
+        }
+
+        pthread_mutex_unlock(&victim->lock);
+    }
+
+    return 0;
+}
+
+static void
+job_fail(comp_doc_extract_job_t *job, int err)
+{
+    int expected = COMP_DOC_SUCCESS;
+
+    __atomic_compare_exchange_n(&job->err, &expected, err, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+static void *
+extract_worker(void *arg)
+{
+    comp_doc_extract_worker_t *worker = arg;
+    comp_doc_extract_job_t *job = worker->job;
+    comp_doc_extract_task_t *task;
+    uint32_t secid;
+    int err;
+
+    while(__atomic_load_n(&job->err, __ATOMIC_RELAXED) == COMP_DOC_SUCCESS && take_task(worker, &task))
+    {
+        secid = task->secid;
+
+        err = read_chain(job->file, task->sat, task->sector_size, &secid,
+            task->offset % task->sector_size, worker->buffer, task->length);
+
+        if(err == COMP_DOC_SUCCESS)
+            err = job->sink(job->ctx, task->dir, task->offset, worker->buffer, task->length);
+
+        if(err != COMP_DOC_SUCCESS)
+            job_fail(job, err);
+    }
+
+    return NULL;
+}
+
+/*
+ * Reads every stream of the file on `nthreads' threads, the calling one
+ * included, or one per online CPU when `nthreads' is 0. Streams are split
+ * into ranges of `chunk_size' bytes (COMP_DOC_EXTRACT_CHUNK when 0), so a
+ * single large stream keeps all the threads busy.
+ *
+ * Each range is handed to `sink', from whichever thread read it. Ranges
+ * of a stream may arrive in any order, and the sink must cope with being
+ * called concurrently. Returns the first error met, either reading or
+ * from the sink.
+ */
+int
+comp_doc_extract_all(comp_doc_file_t *file, unsigned int nthreads, size_t chunk_size, comp_doc_sink_cb sink, void *ctx)
+{
+    comp_doc_extract_job_t job;
+    uint64_t total, share;
+    size_t t;
+    unsigned int w;
+    long ncpus;
+    int err;
+
+    if((err = load_tables(file, COMP_DOC_LOADED_ALL)) != COMP_DOC_SUCCESS)
+        return err;
+
+    memset(&job, 0, sizeof(job));
+    job.file = file;
+    job.sink = sink;
+    job.ctx = ctx;
+    job.chunk_size = chunk_size ? chunk_size : COMP_DOC_EXTRACT_CHUNK;
+
+    // every range has to hold at least one sector
+    if(job.chunk_size < (size_t)CALC_SECTOR_SIZE(file->hdr->ssz))
+        job.chunk_size = CALC_SECTOR_SIZE(file->hdr->ssz);
+
+    if((err = collect_tasks(&job)) != COMP_DOC_SUCCESS || job.ntasks == 0)
+        goto _error;
+
+    if(nthreads == 0)
+    {
+        ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = ncpus > 0 ? ncpus : 1;
+    }
+
+    if(nthreads > job.ntasks)
+        nthreads = job.ntasks;
+
+    job.workers = doc_calloc(file, nthreads, sizeof(comp_doc_extract_worker_t));
+
+    if(job.workers == NULL)
+    {
+        err = COMP_DOC_NO_MEM;
+        goto _error;
+    }
+
+    job.nworkers = nthreads;
+
+    // the workers only read, through read_chain and the sector cache, which allocate nothing,
+    // so the hooks of the file are only called from this thread
+    for(w = 0; w < job.nworkers; w++)
+    {
+        if((job.workers[w].buffer = doc_malloc(file, job.chunk_size)) == NULL)
+        {
+            err = COMP_DOC_NO_MEM;
+            goto _error;
+        }
+    }
+
+    for(t = 0, total = 0; t < job.ntasks; t++)
+        total += job.tasks[t].length + 1;
+
+    // deal consecutive tasks of about the same number of bytes to each worker
+    for(w = 0, t = 0, share = 0; w < job.nworkers; w++)
+    {
+        pthread_mutex_init(&job.workers[w].lock, NULL);
+        job.workers[w].id = w;
+        job.workers[w].job = &job;
+        job.workers[w].head = t;
+
+        while(t < job.ntasks && (w == job.nworkers - 1 || share < total * (w + 1) / job.nworkers))
+            share += job.tasks[t++].length + 1;
+
+        job.workers[w].tail = t;
+    }
+
+    // the tasks of a worker that could not be started are stolen by the rest
+    for(w = 1; w < job.nworkers; w++)
+        job.workers[w].started = pthread_create(&job.workers[w].thread, NULL, extract_worker, &job.workers[w]) == 0;
+
+    extract_worker(&job.workers[0]);
+
+    for(w = 1; w < job.nworkers; w++)
+    {
+        if(job.workers[w].started)
+            pthread_join(job.workers[w].thread, NULL);
+    }
+
+    for(w = 0; w < job.nworkers; w++)
+        pthread_mutex_destroy(&job.workers[w].lock);
+
+    err = job.err;
+
+_error:
+    for(w = 0; job.workers != NULL && w < job.nworkers; w++)
+        doc_free(file, job.workers[w].buffer);
+
+    doc_free(file, job.workers);
+    doc_free(file, job.tasks);
+
+    return err;
+}
@@ -0,0 +1,17 @@
+#ifndef _COMP_DOC_EXTRACT_H_
+#define _COMP_DOC_EXTRACT_H_
+#include "compdoc.h"
+#include "io.h"
+
+/* bytes of a stream handed to the sink at once */
+#define COMP_DOC_EXTRACT_CHUNK (1 << 20)
+
+/*
+ * Receives `length' bytes found at `offset' of the stream of `dir'. The
+ * data is only valid during the call. Anything but COMP_DOC_SUCCESS stops
+ * the extraction, and is returned by comp_doc_extract_all.
+ */
+typedef int (*comp_doc_sink_cb)(void *ctx, comp_doc_directory_t *dir, uint64_t offset, const unsigned char *data, size_t length);
+
+int comp_doc_extract_all(comp_doc_file_t *, unsigned int, size_t, comp_doc_sink_cb, void *);
+#endif /* _COMP_DOC_EXTRACT_H_ */
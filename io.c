@@ -1,13 +1,201 @@
 #include "io.h"
+#include "cache.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 
+/*
+ * Returns the allocation table that holds the chain of the stream and
+ * the size of its sectors. Streams smaller than the cutoff of the header
+ * live in short sectors.
+ */
+comp_doc_sat_t *
+stream_table(comp_doc_file_t *file, comp_doc_directory_t *dir, uint32_t *sector_size)
+{
+    if(dir->size >= file->hdr->stream_min_size)
+    {
+        *sector_size = CALC_SECTOR_SIZE(file->hdr->ssz);
+        return file->sat;
+    }
+
+    *sector_size = CALC_SHORT_SECTOR_SIZE(file->hdr->sssz);
+    return file->ssat;
+}
+
+/*
+ * Returns the absolute offset of the sector `secid' of a stream whose
+ * chain is kept in `sat'.
+ */
+off_t
+chain_position(comp_doc_file_t *file, comp_doc_sat_t *sat, uint32_t secid)
+{
+    STATS_ADD(file, sectors, 1);
+
+    if(sat == file->sat)
+        return sector_position(file->hdr, secid);
+
+    return short_sector_position(file, secid);
+}
+
+/*
+ * Reads a run of a chain, through the sector cache when the file has one.
+ */
+static ssize_t
+read_run(comp_doc_file_t *file, off_t offset, unsigned char *buffer, size_t size)
+{
+    if(file->cache != NULL)
+        return cache_read(file, offset, buffer, size);
+
+    return read_position(file, offset, buffer, size);
+}
+
+/*
+ * Same as read_chain, for the short sectors of a file whose container is
+ * held in memory: the sectors are copied out of the container.
+ */
+static int
+copy_short_chain(comp_doc_file_t *file, comp_doc_sat_t *sat, uint32_t sector_size,
+    uint32_t *secid, uint32_t offset, unsigned char *buffer, size_t size)
+{
+    size_t total, count, position;
+    uint32_t current;
+
+    current = *secid;
+
+    for(total = 0; total < size; total += count)
+    {
+        if(current >= sat->slots)
+            return COMP_DOC_INVALID_SAT;
+
+        position = (size_t)current * sector_size + offset;
+
+        if(sector_size - offset > size - total)
+            count = size - total;
+        else
+            count = sector_size - offset;
+
+        if(position + count > file->mini_container_size)
+            return COMP_DOC_READ_ERR;
+
+        memcpy(buffer + total, file->mini_container + position, count);
+        offset += count;
+
+        if(offset == sector_size)
+        {
+            current = sat->secids[current];
+            offset = 0;
+        }
+    }
+
+    *secid = current;
+
+    return COMP_DOC_SUCCESS;
+}
+
+/*
+ * Reads `size' bytes of a chain into buffer, starting `offset' bytes into
+ * the sector `*secid'. Sectors that follow each other in the file are
+ * fetched with a single read, so a sequential chain costs one read however
+ * long it is. On return `*secid' is the sector that holds the byte that
+ * follows the last one read.
+ */
+int
+read_chain(comp_doc_file_t *file, comp_doc_sat_t *sat, uint32_t sector_size, 
+    uint32_t *secid, uint32_t offset, unsigned char *buffer, size_t size)
+{
+    size_t total, count, run_length;
+    off_t position, run_start;
+    unsigned char *run_buffer;
+    ssize_t bytes_read;
+    uint32_t current;
+    int err;
+    STATS_CLOCK(start);
+
+    if(sat != NULL && sat == file->ssat && file->mini_container != NULL)
+    {
+        err = copy_short_chain(file, sat, sector_size, secid, offset, buffer, size);
+        goto _error;
+    }
+
+    err = COMP_DOC_SUCCESS;
+    total = 0;
+    run_length = 0;
+    run_start = 0;
+    run_buffer = buffer;
+    current = *secid;
+
+    while(total < size)
+    {
+        // the chain ends before the stream does
+        if(sat == NULL || current >= sat->slots)
+        {
+            err = COMP_DOC_INVALID_SAT;
+            goto _error;
+        }
+
+        if((position = chain_position(file, sat, current)) < 0)
+        {
+            err = COMP_DOC_READ_ERR;
+            goto _error;
+        }
+
+        position += offset;
+
+        if(sector_size - offset > size - total)
+            count = size - total;
+        else
+            count = sector_size - offset;
+
+        if(run_length > 0 && position == run_start + (off_t)run_length)
+        {
+            run_length += count;
+        }
+        else
+        {
+            if(run_length > 0 && (bytes_read = read_run(file, run_start, run_buffer, run_length)) < 0)
+            {
+                err = bytes_read;
+                goto _error;
+            }
+
+            run_start = position;
+            run_buffer = buffer + total;
+            run_length = count;
+        }
+
+        total += count;
+        offset += count;
+
+        // move on only once the whole sector has been consumed
+        if(offset == sector_size)
+        {
+            current = sat->secids[current];
+            offset = 0;
+        }
+    }
+
+    if(run_length > 0 && (bytes_read = read_run(file, run_start, run_buffer, run_length)) < 0)
+    {
+        err = bytes_read;
+        goto _error;
+    }
+
+    *secid = current;
+
+_error:
+    STATS_PHASE(file, COMP_DOC_PHASE_READ, start);
+
+    return err;
+}
+
 /*
  * Reads from the compound document the stream that corresponds to the given directory
- * entry. It allocates and returns the data of the stream in the `buffer'.
+ * entry. It allocates and returns the data of the stream in the `buffer', which
+ * must be released with comp_doc_free.
  */
 int
 comp_doc_read_stream(comp_doc_file_t *file, comp_doc_directory_t *dir, unsigned char **buffer)
@@ -15,132 +203,613 @@ comp_doc_read_stream(comp_doc_file_t *file, comp_doc_directory_t *dir, unsigned
     if(!IS_DIR_STREAM(dir))
         return COMP_DOC_NO_STREAM;
 
-    unsigned char *buf, *pos;
-    uint32_t total, count;
+    unsigned char *buf;
     ssize_t bytes_read;
-    int err;
 
-    err = COMP_DOC_SUCCESS;
-    total = 0;
+    // streams of version 4 files may not fit in memory
+    if(dir->size > SIZE_MAX / 2)
+        return COMP_DOC_NO_MEM;
 
-    buf = malloc(dir->size);
+    // an empty stream has no sectors at all
+    buf = doc_malloc(file, dir->size ? dir->size : 1);
 
     if(buf == NULL)
+        return COMP_DOC_NO_MEM;
+
+    if((bytes_read = comp_doc_read_stream_into(file, dir, buf, dir->size)) < 0)
     {
-        err = COMP_DOC_NO_MEM;
-        goto _error;
+        doc_free(file, buf);
+        return bytes_read;
     }
 
-    pos = buf;
+    *buffer = buf;
 
-    if(dir->size >= file->hdr->stream_min_size)
+    return COMP_DOC_SUCCESS;
+}
+
+/*
+ * Reads the stream that corresponds to the given directory entry into the
+ * caller's buffer, which holds `size' bytes. Streams that do not fit are
+ * cut short. Returns the number of bytes read or a negative error code.
+ */
+ssize_t
+comp_doc_read_stream_into(comp_doc_file_t *file, comp_doc_directory_t *dir, unsigned char *buffer, size_t size)
+{
+    comp_doc_sat_t *sat;
+    uint32_t sector_size, secid;
+    int err;
+
+    if(!IS_DIR_STREAM(dir))
+        return COMP_DOC_NO_STREAM;
+
+    if((err = load_tables(file, COMP_DOC_LOADED_ALL)) != COMP_DOC_SUCCESS)
+        return err;
+
+    if(size > dir->size)
+        size = dir->size;
+
+    sat = stream_table(file, dir, &sector_size);
+    secid = dir->first_sector;
+
+    if((err = read_chain(file, sat, sector_size, &secid, 0, buffer, size)) != COMP_DOC_SUCCESS)
+        return err;
+
+    return size;
+}
+
+/*
+ * Returns in `data' the contents of the stream that corresponds to the given
+ * directory entry. When the file is mapped and the sectors of the stream are
+ * consecutive in the file, `data' points straight into the mapping. Likewise
+ * for a short stream whose short sectors are consecutive, when the container
+ * is held in memory (COMP_DOC_OPEN_CACHE_MINISTREAM). Otherwise the stream
+ * is copied as comp_doc_read_stream does. Either way `data' must be
+ * released with comp_doc_unmap_stream.
+ */
+int
+comp_doc_map_stream(comp_doc_file_t *file, comp_doc_directory_t *dir, const unsigned char **data)
+{
+    comp_doc_sat_t *sat;
+    uint32_t secid, sector_size, nsectors;
+    off_t start, position, next;
+    const void *p;
+    int err;
+
+    if(!IS_DIR_STREAM(dir))
+        return COMP_DOC_NO_STREAM;
+
+    if((err = load_tables(file, COMP_DOC_LOADED_ALL)) != COMP_DOC_SUCCESS)
+        return err;
+
+    if(IS_SHORT_CACHED(file, dir) && dir->size > 0)
     {
-        //then the stream is divided in regular sectors
-        //use SAT to construct it
-        comp_doc_sector_id_t *sector = &file->sat->secids[dir->first_sector];
+        sat = stream_table(file, dir, &sector_size);
+
+        if(dir->first_sector >= sat->slots)
+            return COMP_DOC_INVALID_SAT;
+
+        // the n-th short sector is at n * sector_size in the container
+        secid = dir->first_sector;
+        nsectors = (dir->size + sector_size - 1) / sector_size;
+        start = (off_t)secid * sector_size;
+
+        while(--nsectors > 0 && sat->secids[secid] == secid + 1)
+            secid++;
 
-        if(lseek(file->fd, sector_position(file->hdr, dir->first_sector), SEEK_SET) == ((off_t)-1))
+        if(nsectors == 0 && (size_t)start + dir->size <= file->mini_container_size)
         {
-            err = COMP_DOC_SEEK_ERR;
-            goto _error;
+            *data = file->mini_container + start;
+            return COMP_DOC_SUCCESS;
         }
+    }
+    else if(file->map != NULL && dir->size > 0)
+    {
+        sat = stream_table(file, dir, &sector_size);
 
-        if(CALC_SECTOR_SIZE(file->hdr->ssz) > dir->size)
-            count = dir->size;
-        else
-            count = CALC_SECTOR_SIZE(file->hdr->ssz);
+        if(sat == NULL || dir->first_sector >= sat->slots)
+            return COMP_DOC_INVALID_SAT;
+
+        secid = dir->first_sector;
+        nsectors = (dir->size + sector_size - 1) / sector_size;
+        start = position = chain_position(file, sat, secid);
 
-        if((bytes_read = read_exactly(file->fd, buf, count)) < 0)
+        // walk the chain as long as each sector follows the previous one in the file
+        while(--nsectors > 0)
         {
-            err = COMP_DOC_READ_ERR;
-            goto _error;
+            if(sat->secids[secid] >= SECID_MSAT)
+                break;
+
+            // each sector is located once, so the statistics count it once
+            if((next = chain_position(file, sat, sat->secids[secid])) != position + sector_size)
+                break;
+
+            secid = sat->secids[secid];
+            position = next;
         }
 
-        total += bytes_read;
-        pos += bytes_read;
+        if(nsectors == 0 && start >= 0 && (p = map_position(file, start, dir->size)) != NULL)
+        {
+            *data = p;
+            return COMP_DOC_SUCCESS;
+        }
+    }
+
+    // the stream is fragmented, hand back a copy
+    return comp_doc_read_stream(file, dir, (unsigned char **)data);
+}
+
+/*
+ * Releases the data returned by comp_doc_map_stream.
+ */
+void
+comp_doc_unmap_stream(comp_doc_file_t *file, const unsigned char *data)
+{
+    if(data == NULL || IS_MAPPED(file, data))
+        return;
+
+    // a view into the container of short streams
+    if(file->mini_container != NULL && data >= file->mini_container
+        && data < file->mini_container + file->mini_container_size)
+        return;
+
+    doc_free(file, (void *)data);
+}
 
-        while(sector->next != NULL)
+/*
+ * Opens the stream that corresponds to the given directory entry for
+ * incremental reading. The chain is walked lazily, as the stream is read.
+ * Reads smaller than `window' bytes are served from a buffer of that size,
+ * which is the only memory kept by the handle. A zero `window' disables
+ * buffering and every read goes straight into the caller's buffer.
+ */
+int
+comp_doc_stream_open(comp_doc_file_t *file, comp_doc_directory_t *dir, size_t window, comp_doc_stream_t **ret_stream)
+{
+    comp_doc_stream_t *stream;
+    int err;
+
+    *ret_stream = NULL;
+
+    if(!IS_DIR_STREAM(dir))
+        return COMP_DOC_NO_STREAM;
+
+    if((err = load_tables(file, COMP_DOC_LOADED_ALL)) != COMP_DOC_SUCCESS)
+        return err;
+
+    stream = doc_calloc(file, 1, sizeof(comp_doc_stream_t));
+
+    if(stream == NULL)
+        return COMP_DOC_NO_MEM;
+
+    if(window > 0)
+    {
+        stream->window = doc_malloc(file, window);
+
+        if(stream->window == NULL)
         {
-            if(lseek(file->fd, sector_position(file->hdr, sector->value), SEEK_SET) == (off_t)-1)
-            {
-                err = COMP_DOC_SEEK_ERR;
-                goto _error;
-            }
+            doc_free(file, stream);
+            return COMP_DOC_NO_MEM;
+        }
+    }
 
-            if(CALC_SECTOR_SIZE(file->hdr->ssz) > dir->size - total)
-                count = dir->size - total;
-            else
-                count = CALC_SECTOR_SIZE(file->hdr->ssz);
+    stream->file = file;
+    stream->dir = dir;
+    stream->sat = stream_table(file, dir, &stream->sector_size);
+    stream->secid = dir->first_sector;
+    stream->window_size = window;
 
-            //printf("Copying: %x\n", count);
+    *ret_stream = stream;
 
-            if((bytes_read = read_exactly(file->fd, pos, count)) < 0)
-            {
-                err = COMP_DOC_READ_ERR;
-                goto _error;
-            }
+    return COMP_DOC_SUCCESS;
+}
+
+/*
+ * Reads `size' bytes that follow the already fetched part of the stream.
+ */
+static int
+stream_fetch(comp_doc_stream_t *stream, unsigned char *buffer, size_t size)
+{
+    int err;
+
+    err = read_chain(stream->file, stream->sat, stream->sector_size, &stream->secid, 
+        stream->fetched % stream->sector_size, buffer, size);
 
-            total += bytes_read;
-            pos += bytes_read;
-            sector = sector->next;
-        }       
+    if(err == COMP_DOC_SUCCESS)
+        stream->fetched += size;
+
+    return err;
+}
+
+/*
+ * Reads up to `size' bytes from the current position of the stream into
+ * buffer. Returns the number of bytes read, 0 at the end of the stream or
+ * a negative error code.
+ */
+ssize_t
+comp_doc_stream_read(comp_doc_stream_t *stream, unsigned char *buffer, size_t size)
+{
+    size_t total, count;
+    uint64_t left;
+    int err;
+
+    left = stream->dir->size - stream->position;
+
+    if(size > left)
+        size = left;
+
+    total = 0;
+
+    while(total < size)
+    {
+        // serve whatever is left in the window first
+        if(stream->position < stream->window_start + stream->window_length)
+        {
+            count = stream->window_start + stream->window_length - stream->position;
+            if(count > size - total)
+                count = size - total;
+
+            memcpy(buffer + total, stream->window + (stream->position - stream->window_start), count);
+        }
+        else if(size - total >= stream->window_size)
+        {
+            // big reads bypass the window
+            count = size - total;
+
+            if((err = stream_fetch(stream, buffer + total, count)) != COMP_DOC_SUCCESS)
+                return err;
+        }
+        else
+        {
+            left = stream->dir->size - stream->fetched;
+            count = left < stream->window_size ? left : stream->window_size;
+
+            if((err = stream_fetch(stream, stream->window, count)) != COMP_DOC_SUCCESS)
+                return err;
+
+            stream->window_start = stream->position;
+            stream->window_length = count;
+            continue;
+        }
+
+        stream->position += count;
+        total += count;
     }
+
+    return total;
+}
+
+/*
+ * Builds the index of the stream: the n-th element is the SecID of the
+ * n-th sector of the stream. It is built once, the first time the handle
+ * is used for random access.
+ */
+static int
+stream_build_index(comp_doc_stream_t *stream)
+{
+    uint64_t nsectors;
+    uint32_t i, secid;
+    comp_doc_sat_t *sat = stream->sat;
+
+    if(stream->index != NULL)
+        return COMP_DOC_SUCCESS;
+
+    nsectors = (stream->dir->size + stream->sector_size - 1) / stream->sector_size;
+
+    // a chain cannot be longer than its table
+    if(sat == NULL || nsectors > sat->slots)
+        return COMP_DOC_INVALID_SAT;
+
+    // keep a valid pointer for empty streams, so the index is built only once
+    stream->index = doc_malloc(stream->file, (nsectors ? nsectors : 1) * sizeof(uint32_t));
+
+    if(stream->index == NULL)
+        return COMP_DOC_NO_MEM;
+
+    secid = stream->dir->first_sector;
+
+    for(i = 0; i < nsectors; i++)
+    {
+        if(sat == NULL || secid >= sat->slots)
+        {
+            doc_free(stream->file, stream->index);
+            stream->index = NULL;
+            return COMP_DOC_INVALID_SAT;
+        }
+
+        stream->index[i] = secid;
+        secid = sat->secids[secid];
+    }
+
+    stream->nindex = nsectors;
+
+    return COMP_DOC_SUCCESS;
+}
+
+/*
+ * Moves the position of the stream, as lseek does. The chain is looked
+ * up in the index of the stream, so seeking costs the same anywhere in
+ * the stream. Returns the new position or a negative error code.
+ */
+int64_t
+comp_doc_stream_seek(comp_doc_stream_t *stream, int64_t offset, int whence)
+{
+    int64_t position;
+    int err;
+
+    if(whence == SEEK_SET)
+        position = offset;
+    else if(whence == SEEK_CUR)
+        position = stream->position + offset;
+    else if(whence == SEEK_END)
+        position = stream->dir->size + offset;
     else
+        return COMP_DOC_SEEK_ERR;
+
+    if(position < 0 || (uint64_t)position > stream->dir->size)
+        return COMP_DOC_SEEK_ERR;
+
+    // the window still holds the new position
+    if((uint64_t)position >= stream->window_start 
+        && (uint64_t)position < stream->window_start + stream->window_length)
+    {
+        stream->position = position;
+        return position;
+    }
+
+    if((err = stream_build_index(stream)) != COMP_DOC_SUCCESS)
+        return err;
+
+    stream->position = position;
+    stream->fetched = position;
+    stream->window_start = position;
+    stream->window_length = 0;
+
+    if(position / stream->sector_size < stream->nindex)
+        stream->secid = stream->index[position / stream->sector_size];
+
+    return position;
+}
+
+/*
+ * Reads up to `size' bytes found at `offset' of the stream into buffer,
+ * without moving the position of the stream. Only the sectors that hold
+ * the requested bytes are read. Returns the number of bytes read, 0 past
+ * the end of the stream or a negative error code.
+ */
+ssize_t
+comp_doc_stream_pread(comp_doc_stream_t *stream, unsigned char *buffer, size_t size, uint64_t offset)
+{
+    uint32_t secid;
+    int err;
+
+    if(offset >= stream->dir->size)
+        return 0;
+
+    if(size > stream->dir->size - offset)
+        size = stream->dir->size - offset;
+
+    if((err = stream_build_index(stream)) != COMP_DOC_SUCCESS)
+        return err;
+
+    if(offset / stream->sector_size >= stream->nindex)
+        return COMP_DOC_INVALID_SAT;
+
+    secid = stream->index[offset / stream->sector_size];
+
+    err = read_chain(stream->file, stream->sat, stream->sector_size, &secid, 
+        offset % stream->sector_size, buffer, size);
+
+    if(err != COMP_DOC_SUCCESS)
+        return err;
+
+    return size;
+}
+
+void
+comp_doc_stream_close(comp_doc_stream_t *stream)
+{
+    if(stream)
     {
-        // the stream consists of short sectors
-        comp_doc_sector_id_t *sector = &file->ssat->secids[dir->first_sector];
+        doc_free(stream->file, stream->window);
+        doc_free(stream->file, stream->index);
+        doc_free(stream->file, stream);
+    }
+}
+
+// buffers per vectored read, IOV_MAX on Linux
+#define BATCH_IOV_MAX 1024
+
+static int
+compare_segments(const void *a, const void *b)
+{
+    const comp_doc_run_t *x = a, *y = b;
+
+    if(x->offset != y->offset)
+        return x->offset < y->offset ? -1 : 1;
+
+    return 0;
+}
 
-        if(lseek(file->fd, short_sector_position(file, dir->first_sector), SEEK_SET) < 0)
+/*
+ * Appends the runs of the stream of `dir' to the array `segments', which
+ * holds `nsegments' runs and has room for `capacity'. The array grows as
+ * needed. Sectors that follow each other in the file are merged, and each
+ * run points at its place in `buffer', which is to receive the stream.
+ */
+int
+collect_stream_runs(comp_doc_file_t *file, comp_doc_directory_t *dir, unsigned char *buffer,
+    comp_doc_run_t **segments, size_t *nsegments, size_t *capacity)
+{
+    comp_doc_sat_t *sat;
+    comp_doc_run_t *seg;
+    uint32_t sector_size, secid;
+    uint64_t count, total;
+    off_t position;
+
+    sat = stream_table(file, dir, &sector_size);
+    secid = dir->first_sector;
+    seg = NULL;
+
+    for(total = 0; total < dir->size; total += count)
+    {
+        if(sat == NULL || secid >= sat->slots)
+            return COMP_DOC_INVALID_SAT;
+
+        if((position = chain_position(file, sat, secid)) < 0)
+            return COMP_DOC_READ_ERR;
+
+        count = dir->size - total < sector_size ? dir->size - total : sector_size;
+
+        if(seg != NULL && seg->offset + (off_t)seg->length == position)
         {
-            err = COMP_DOC_SEEK_ERR;
-            goto _error;
+            seg->length += count;
         }
-
-        if(CALC_SHORT_SECTOR_SIZE(file->hdr->sssz) > dir->size)
-            count = dir->size;
         else
-            count = CALC_SHORT_SECTOR_SIZE(file->hdr->sssz);
+        {
+            if(*nsegments == *capacity)
+            {
+                *capacity = *capacity ? 2 * *capacity : 64;
+                seg = doc_realloc(file, *segments, *capacity * sizeof(comp_doc_run_t));
+
+                if(seg == NULL)
+                    return COMP_DOC_NO_MEM;
+
+                *segments = seg;
+            }
+
+            seg = &(*segments)[(*nsegments)++];
+            seg->offset = position;
+            seg->length = count;
+            seg->buffer = buffer + total;
+        }
+
+        secid = sat->secids[secid];
+    }
 
-        if((bytes_read = read_exactly(file->fd, buf, count)) < 0)
+    return COMP_DOC_SUCCESS;
+}
+
+/*
+ * Reads the streams of `nentries' directory entries in a single pass over
+ * the file. The runs of sectors of all the streams are sorted by their
+ * offset in the file, and runs that are adjacent in the file are fetched
+ * with one vectored read, whichever streams they belong to.
+ *
+ * Each entry is filled into its `buffer', which must hold the whole stream,
+ * or into a buffer allocated for it when `buffer' is NULL, to be released
+ * with comp_doc_free. The outcome for each stream is left in `err': when a
+ * vectored read fails, its runs are read again one by one, so that only the
+ * streams whose own runs cannot be read fail. Returns COMP_DOC_NO_MEM when
+ * the batch could not be read at all, which every stream not read yet is
+ * failed with, or else the first error met reading the file.
+ */
+int
+comp_doc_read_streams(comp_doc_file_t *file, comp_doc_batch_entry_t *entries, unsigned int nentries)
+{
+    comp_doc_run_t *segments;
+    struct iovec iov[BATCH_IOV_MAX];
+    size_t nsegments, capacity, i, j, k, first;
+    off_t end;
+    ssize_t bytes_read;
+    unsigned int e, stop;
+    int err, iovcnt;
+
+    if((err = load_tables(file, COMP_DOC_LOADED_ALL)) != COMP_DOC_SUCCESS)
+        return err;
+
+    STATS_CLOCK(start);
+
+    segments = NULL;
+    nsegments = capacity = 0;
+
+    for(e = 0; e < nentries; e++)
+    {
+        entries[e].err = COMP_DOC_SUCCESS;
+
+        if(!IS_DIR_STREAM(entries[e].dir))
         {
-            err = COMP_DOC_READ_ERR;
-            goto _error;
+            entries[e].err = COMP_DOC_NO_STREAM;
+            continue;
         }
-        total += bytes_read;
-        pos += bytes_read;
 
-        while(sector->next != NULL)
+        if(entries[e].buffer == NULL)
         {
-            if(lseek(file->fd, short_sector_position(file, sector->value), SEEK_SET) < 0)
+            entries[e].buffer = doc_malloc(file, entries[e].dir->size ? entries[e].dir->size : 1);
+
+            if(entries[e].buffer == NULL)
             {
-                err = COMP_DOC_SEEK_ERR;
+                err = COMP_DOC_NO_MEM;
                 goto _error;
             }
+        }
+
+        // short streams held in memory are copied straight away
+        if(IS_SHORT_CACHED(file, entries[e].dir))
+        {
+            if((bytes_read = comp_doc_read_stream_into(file, entries[e].dir, entries[e].buffer, entries[e].dir->size)) < 0)
+                entries[e].err = bytes_read;
+            continue;
+        }
 
-            if(CALC_SHORT_SECTOR_SIZE(file->hdr->sssz) > dir->size - total)
-                count = dir->size - total;
-            else
-                count = CALC_SHORT_SECTOR_SIZE(file->hdr->sssz);
+        first = nsegments;
 
-            if((bytes_read = read_exactly(file->fd, pos, count)) < 0)
+        // a broken chain only fails its own stream
+        if((entries[e].err = collect_stream_runs(file, entries[e].dir, entries[e].buffer, &segments, &nsegments, &capacity)) != COMP_DOC_SUCCESS)
+        {
+            if(entries[e].err == COMP_DOC_NO_MEM)
             {
-                err = COMP_DOC_READ_ERR;
+                err = COMP_DOC_NO_MEM;
                 goto _error;
             }
 
-            total += bytes_read;
-            pos += bytes_read;
-            sector = sector->next;       
+            nsegments = first;
+        }
+
+        for(k = first; k < nsegments; k++)
+            segments[k].owner = e;
+    }
+
+    qsort(segments, nsegments, sizeof(comp_doc_run_t), compare_segments);
+
+    for(i = 0; i < nsegments; i = j)
+    {
+        end = segments[i].offset;
+        iovcnt = 0;
+
+        for(j = i; j < nsegments && segments[j].offset == end && iovcnt < BATCH_IOV_MAX; j++)
+        {
+            iov[iovcnt].iov_base = segments[j].buffer;
+            iov[iovcnt].iov_len = segments[j].length;
+            iovcnt++;
+            end += segments[j].length;
+        }
+
+        if(readv_position(file, segments[i].offset, iov, iovcnt) >= 0)
+            continue;
+
+        // tell the streams cut short, or sitting on a bad block, from the others
+        for(k = i; k < j; k++)
+        {
+            if((bytes_read = read_position(file, segments[k].offset, segments[k].buffer, segments[k].length)) < 0)
+            {
+                entries[segments[k].owner].err = bytes_read;
+
+                if(err == COMP_DOC_SUCCESS)
+                    err = bytes_read;
+            }
         }
     }
 
-    *buffer = buf;
 _error:
-    if(err != COMP_DOC_SUCCESS)
+    // nothing has been read from the file yet, only short streams held in memory
+    for(stop = e, e = 0; err == COMP_DOC_NO_MEM && e < nentries; e++)
     {
-        if(buf)
-            free(buf);
+        if(e >= stop || (entries[e].err == COMP_DOC_SUCCESS && !IS_SHORT_CACHED(file, entries[e].dir)))
+            entries[e].err = COMP_DOC_NO_MEM;
     }
 
+    doc_free(file, segments);
+    STATS_PHASE(file, COMP_DOC_PHASE_READ, start);
+
     return err;
-}
\ No newline at end of file
+}
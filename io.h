@@ -3,5 +3,68 @@
 #include "compdoc.h"
 #include "parse.h"
 #define COMP_DOC_NO_STREAM (-8)
+
+/*
+ * Handle for reading a stream incrementally, see comp_doc_stream_open.
+ * A handle must not be shared by threads, but any number of handles
+ * may read from the same file concurrently.
+ */
+typedef struct {
+    comp_doc_file_t *file;
+    comp_doc_directory_t *dir;
+    comp_doc_sat_t *sat;
+    uint32_t sector_size;
+    /* sector that holds the first byte not fetched yet */
+    uint32_t secid;
+    /* offset of the first byte not fetched from the file yet */
+    uint64_t fetched;
+    /* offset of the next byte returned to the caller */
+    uint64_t position;
+    /* read-ahead buffer, holding `window_length' bytes from `window_start' */
+    unsigned char *window;
+    size_t window_size;
+    uint64_t window_start;
+    size_t window_length;
+    /* SecID of every sector of the stream, built on the first seek */
+    uint32_t *index;
+    uint32_t nindex;
+} comp_doc_stream_t;
+
+/*
+ * A stream to be read by comp_doc_read_streams.
+ */
+typedef struct {
+    comp_doc_directory_t *dir;
+    /* must hold the whole stream, NULL to have it allocated */
+    unsigned char *buffer;
+    int err;
+} comp_doc_batch_entry_t;
+
+/*
+ * A run of contiguous bytes of a stream: `length' bytes found at `offset'
+ * in the file, that go to `buffer'. Used by the readers that schedule the
+ * reads of whole streams.
+ */
+typedef struct {
+    off_t offset;
+    size_t length;
+    unsigned char *buffer;
+    /* index of the stream in a batch, see comp_doc_read_streams */
+    unsigned int owner;
+} comp_doc_run_t;
+
+comp_doc_sat_t *stream_table(comp_doc_file_t *, comp_doc_directory_t *, uint32_t *);
+off_t chain_position(comp_doc_file_t *, comp_doc_sat_t *, uint32_t);
+int read_chain(comp_doc_file_t *, comp_doc_sat_t *, uint32_t, uint32_t *, uint32_t, unsigned char *, size_t);
+int collect_stream_runs(comp_doc_file_t *, comp_doc_directory_t *, unsigned char *, comp_doc_run_t **, size_t *, size_t *);
 int comp_doc_read_stream(comp_doc_file_t *, comp_doc_directory_t *, unsigned char **);
+ssize_t comp_doc_read_stream_into(comp_doc_file_t *, comp_doc_directory_t *, unsigned char *, size_t);
+int comp_doc_map_stream(comp_doc_file_t *, comp_doc_directory_t *, const unsigned char **);
+void comp_doc_unmap_stream(comp_doc_file_t *, const unsigned char *);
+int comp_doc_stream_open(comp_doc_file_t *, comp_doc_directory_t *, size_t, comp_doc_stream_t **);
+ssize_t comp_doc_stream_read(comp_doc_stream_t *, unsigned char *, size_t);
+int64_t comp_doc_stream_seek(comp_doc_stream_t *, int64_t, int);
+ssize_t comp_doc_stream_pread(comp_doc_stream_t *, unsigned char *, size_t, uint64_t);
+void comp_doc_stream_close(comp_doc_stream_t *);
+int comp_doc_read_streams(comp_doc_file_t *, comp_doc_batch_entry_t *, unsigned int);
 #endif /* _COMP_DOC_READ_H_*/
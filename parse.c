@@ -1,32 +1,33 @@
 #include "parse.h"
+#include "secid.h"
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 
+/*
+ * Returns the absolute offset, from the beginning of the file, of the
+ * short sector `ssecid'. The sector of the short-stream container that
+ * holds it is looked up in the map built by parse_ministream.
+ * Returns -1 if the short sector lies outside the container.
+ */
 off_t
 short_sector_position(comp_doc_file_t *file, uint32_t ssecid)
 {
-    // XXX: assertion first directory entry _MUST_ be the root storage
-    uint32_t shortsec_container_id = file->dirs[0].first_sector;
     uint32_t max_shortsec = CALC_SECTOR_SIZE(file->hdr->ssz) / CALC_SHORT_SECTOR_SIZE(file->hdr->sssz);
-    uint32_t secid = shortsec_container_id;
-    uint32_t offset;
+    uint32_t index = ssecid / max_shortsec;
+    off_t offset;
 
-    offset = 0;
-    // XXX: sanity check: short container 
-    comp_doc_sector_id_t *sector = &file->sat->secids[shortsec_container_id];
+    STATS_ADD(file, short_lookups, 1);
 
-    while(ssecid >= max_shortsec)
-    {
-        //if(sector->next == NULL) { critical error }
-        secid = sector->value;
-        sector = sector->next;
-        //max_shortsec += CALC_SECTOR_SIZE(file->hdr->ssz) / CALC_SHORT_SECTOR_SIZE(file->hdr->sssz);
-        ssecid -= max_shortsec;
-    }
+    if(index >= file->nministream)
+        return (off_t)-1;
 
-    offset = sector_position(file->hdr, secid);
-    offset += ssecid * CALC_SHORT_SECTOR_SIZE(file->hdr->sssz);
+    offset = sector_position(file->hdr, file->ministream[index]);
+    offset += (ssecid % max_shortsec) * CALC_SHORT_SECTOR_SIZE(file->hdr->sssz);
 
     return offset;
 }
@@ -39,78 +40,309 @@ short_sector_position(comp_doc_file_t *file, uint32_t ssecid)
 off_t
 sector_position(comp_doc_header_t *header, uint32_t secid)
 {
-    return COMP_DOC_HEADER_SIZE + (secid * CALC_SECTOR_SIZE(header->ssz));
+    off_t sector_size = CALC_SECTOR_SIZE(header->ssz);
+
+    // the header fills the first sector, which is bigger than the header with 4096-byte sectors
+    return ((off_t)secid + 1) * sector_size;
+}
+
+#ifdef COMP_DOC_STATS
+
+uint64_t
+stats_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
 /*
- *  Reads exactly `size' bytes from the file descriptor into buffer.
- *  Otherwise, the file is closed and returns error.
+ * Adds the time elapsed since `start' to the phase.
+ */
+void
+stats_phase(comp_doc_file_t *file, int phase, uint64_t start)
+{
+    STATS_ADD(file, phase_ns[phase], stats_clock() - start);
+    STATS_ADD(file, phase_count[phase], 1);
+}
+
+#endif /* COMP_DOC_STATS */
+
+/*
+ * Memory of a file is always obtained through the allocator it was
+ * opened with.
+ */
+void *
+doc_malloc(comp_doc_file_t *file, size_t size)
+{
+    STATS_ADD(file, allocations, 1);
+    return file->allocator.malloc(file->allocator.ctx, size);
+}
+
+void *
+doc_calloc(comp_doc_file_t *file, size_t nmemb, size_t size)
+{
+    void *p;
+
+    if(size && nmemb > SIZE_MAX / size)
+        return NULL;
+
+    if((p = doc_malloc(file, nmemb * size)) != NULL)
+        memset(p, 0, nmemb * size);
+
+    return p;
+}
+
+void *
+doc_realloc(comp_doc_file_t *file, void *ptr, size_t size)
+{
+    STATS_ADD(file, allocations, 1);
+    return file->allocator.realloc(file->allocator.ctx, ptr, size);
+}
+
+void
+doc_free(comp_doc_file_t *file, void *ptr)
+{
+    if(ptr)
+        file->allocator.free(file->allocator.ctx, ptr);
+}
+
+/*
+ * Returns a pointer to `size' bytes at `offset' inside the mapping of the
+ * file. NULL is returned when the file is not mapped or the requested range
+ * does not lie entirely inside the mapping.
+ */
+const void *
+map_position(comp_doc_file_t *file, off_t offset, size_t size)
+{
+    if(file->map == NULL || offset < 0)
+        return NULL;
+
+    if((size_t)offset > file->map_size || size > file->map_size - offset)
+        return NULL;
+
+    return (const uint8_t *)file->map + offset;
+}
+
+/*
+ * Copies `size' bytes found at `offset' into buffer. Mapped files are
+ * served from the mapping, otherwise the bytes are read from the descriptor.
+ * The file offset of the descriptor is never used, so concurrent callers
+ * do not interfere with each other.
  */
 ssize_t
-read_exactly(int fd, void *buffer, ssize_t size)
+read_position(comp_doc_file_t *file, off_t offset, void *buffer, size_t size)
 {
+    const void *p;
     ssize_t bytes_read;
 
-    bytes_read = read(fd, buffer, size);
-    if(bytes_read < size)
+    if(file->map != NULL)
     {
-        close(fd);
-        return COMP_DOC_READ_ERR;
+        if((p = map_position(file, offset, size)) == NULL)
+            return COMP_DOC_READ_ERR;
+
+        memcpy(buffer, p, size);
+        STATS_ADD(file, bytes_read, size);
+        return size;
     }
 
+    bytes_read = read_exactly(file->fd, buffer, size, offset);
+
+    // short reads retried by read_exactly are not told apart
+    STATS_ADD(file, syscalls, 1);
+
+    if(bytes_read > 0)
+        STATS_ADD(file, bytes_read, bytes_read);
+
     return bytes_read;
 }
 
+/*
+ * Scatters the bytes found at `offset' into the buffers of `iov', the same
+ * way read_position does for a single buffer. The vector is consumed as
+ * the bytes are read.
+ */
+ssize_t
+readv_position(comp_doc_file_t *file, off_t offset, struct iovec *iov, int iovcnt)
+{
+    ssize_t bytes_read, total;
+    int i;
+
+    total = 0;
+
+    if(file->map != NULL)
+    {
+        for(i = 0; i < iovcnt; i++)
+        {
+            if((bytes_read = read_position(file, offset + total, iov[i].iov_base, iov[i].iov_len)) < 0)
+                return bytes_read;
+            total += bytes_read;
+        }
+
+        return total;
+    }
+
+    while(iovcnt > 0)
+    {
+        bytes_read = preadv(file->fd, iov, iovcnt, offset + total);
+        STATS_ADD(file, syscalls, 1);
+
+        if(bytes_read < 0 && errno == EINTR)
+            continue;
+
+        if(bytes_read <= 0)
+            return COMP_DOC_READ_ERR;
+
+        total += bytes_read;
+        STATS_ADD(file, bytes_read, bytes_read);
+
+        // skip the buffers that have been filled, resume inside a partial one
+        while(iovcnt > 0 && (size_t)bytes_read >= iov->iov_len)
+        {
+            bytes_read -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+
+        if(iovcnt > 0)
+        {
+            iov->iov_base = (uint8_t *)iov->iov_base + bytes_read;
+            iov->iov_len -= bytes_read;
+        }
+    }
+
+    return total;
+}
+
+/*
+ * Returns the contents of the sector `secid'. Mapped files hand back a
+ * pointer into the mapping, otherwise the sector is read into `buffer',
+ * which must be big enough to hold a whole sector. Returns NULL on error.
+ */
+const uint8_t *
+read_sector(comp_doc_file_t *file, uint32_t secid, uint8_t *buffer)
+{
+    off_t offset = sector_position(file->hdr, secid);
+
+    if(file->map != NULL)
+        return map_position(file, offset, CALC_SECTOR_SIZE(file->hdr->ssz));
+
+    if(read_position(file, offset, buffer, CALC_SECTOR_SIZE(file->hdr->ssz)) < 0)
+        return NULL;
+
+    return buffer;
+}
+
+/*
+ *  Reads exactly `size' bytes at `offset' from the file descriptor into buffer.
+ *  Short reads are retried, hitting the end of file is an error.
+ */
+ssize_t
+read_exactly(int fd, void *buffer, ssize_t size, off_t offset)
+{
+    ssize_t bytes_read, total;
+
+    total = 0;
+
+    while(total < size)
+    {
+        bytes_read = pread(fd, (uint8_t *)buffer + total, size - total, offset + total);
+
+        if(bytes_read < 0 && errno == EINTR)
+            continue;
+
+        if(bytes_read <= 0)
+            return COMP_DOC_READ_ERR;
+
+        total += bytes_read;
+    }
+
+    return total;
+}
+
+/*
+ * Writes `size' bytes from buffer at `offset' of the file. Short writes are
+ * retried, and the file grows as needed.
+ */
+ssize_t
+write_position(comp_doc_file_t *file, off_t offset, const void *buffer, size_t size)
+{
+    ssize_t written;
+    size_t total;
+
+    total = 0;
+
+    while(total < size)
+    {
+        written = pwrite(file->fd, (const uint8_t *)buffer + total, size - total, offset + total);
+        STATS_ADD(file, syscalls, 1);
+
+        if(written < 0 && errno == EINTR)
+            continue;
+
+        if(written <= 0)
+            return COMP_DOC_WRITE_ERR;
+
+        total += written;
+    }
+
+    return total;
+}
+
 inline void
-free_header(comp_doc_header_t *hdr)
+free_header(comp_doc_file_t *file, comp_doc_header_t *hdr)
 {
-    if(hdr)
-        free(hdr);
+    if(hdr && !IS_MAPPED(file, hdr))
+        doc_free(file, hdr);
 }
 
 inline void
-free_msat(comp_doc_msat_t *msat)
+free_msat(comp_doc_file_t *file, comp_doc_msat_t *msat)
 {
     if(msat)
     {
-        if(msat->secids)
-            free(msat->secids);
-        free(msat);
+        if(msat->secids && !IS_MAPPED(file, msat->secids))
+            doc_free(file, msat->secids);
+        doc_free(file, msat);
     }
 }
 
 inline void
-free_sat(comp_doc_sat_t *sat)
+free_sat(comp_doc_file_t *file, comp_doc_sat_t *sat)
 {
     if(sat)
     {
-        if(sat->secids)
-            free(sat->secids);
-        free(sat);
+        if(sat->secids && !IS_MAPPED(file, sat->secids))
+            doc_free(file, sat->secids);
+        doc_free(file, sat);
     }
 }
 
 inline void
-free_directory(comp_doc_directory_t *dirs)
+free_directory(comp_doc_file_t *file, comp_doc_directory_t *dirs)
 {
-    if(dirs)
-        free(dirs);
+    if(dirs && !IS_MAPPED(file, dirs))
+        doc_free(file, dirs);
 }
 
 static int
-parse_msat_from_sectors(int fd, comp_doc_header_t *hdr, comp_doc_msat_t *msat)
+parse_msat_from_sectors(comp_doc_file_t *file, comp_doc_msat_t *msat)
 {
 
     int err;
     uint8_t *buffer;
-    ssize_t bytes_read;
-    uint32_t *p, msat_sector;
-    uint32_t msat_per_sector;
+    const uint8_t *sector;
+    const uint32_t *p;
+    uint32_t *secids, msat_sector;
+    uint32_t msat_per_sector, nsectors;
+    comp_doc_header_t *hdr = file->hdr;
 
     err = COMP_DOC_SUCCESS;
     buffer = NULL;
 
-    buffer = malloc(CALC_SECTOR_SIZE(hdr->ssz) * sizeof(uint8_t));
+    buffer = doc_malloc(file, CALC_SECTOR_SIZE(hdr->ssz) * sizeof(uint8_t));
     if(buffer == NULL)
     {
         err = COMP_DOC_NO_MEM;
@@ -121,15 +353,24 @@ parse_msat_from_sectors(int fd, comp_doc_header_t *hdr, comp_doc_msat_t *msat)
     // with MSAT IDs. Each MSAT SecID is an integer, meaning it is four bytes.
     msat_per_sector = (CALC_SECTOR_SIZE(hdr->ssz) - 4) / 4;
     
-    msat->secids = realloc(msat->secids, (COMP_DOC_HEADER_MSAT_SLOTS + msat_per_sector * hdr->nmsat_sectors) * sizeof(uint32_t));
+    // the header part may still alias the mapping, so it is copied
+    // into a buffer that can hold the extension sectors as well
+    secids = doc_malloc(file, (COMP_DOC_HEADER_MSAT_SLOTS + msat_per_sector * hdr->nmsat_sectors) * sizeof(uint32_t));
 
-    if(msat->secids == NULL)
+    if(secids == NULL)
     {
         err = COMP_DOC_NO_MEM;
         goto _error;
     }
 
+    if(msat->slots)
+        memcpy(secids, msat->secids, msat->slots * sizeof(uint32_t));
+    if(msat->secids && !IS_MAPPED(file, msat->secids))
+        doc_free(file, msat->secids);
+    msat->secids = secids;
+
     msat_sector = hdr->msat_first_sector;
+    nsectors = 0;
 
     /* 
      * According to OO-specification, the indication of a sector that it is the last
@@ -139,23 +380,32 @@ parse_msat_from_sectors(int fd, comp_doc_header_t *hdr, comp_doc_msat_t *msat)
      */
     while(msat_sector != SECID_END_OF_CHAIN && msat_sector != SECID_FREE)
     {
-        //write the whole sector into the buffer
+        // a loop through sectors that only hold free slots adds no SecID
+        if(nsectors++ == hdr->nmsat_sectors)
+        {
+            err = COMP_DOC_INVALID_MSAT;
+            goto _error;
+        }
 
-        lseek(fd, sector_position(hdr, msat_sector), SEEK_SET);
-        //printf("POSITION: %x\n", sector_position(hdr, hdr->msat_first_sector));
-        if((bytes_read = read_exactly(fd, buffer, CALC_SECTOR_SIZE(hdr->ssz))) < 0)
+        if((sector = read_sector(file, msat_sector, buffer)) == NULL)
         {
             err = COMP_DOC_READ_ERR;
             goto _error;
         }
 
-        p = (uint32_t *)buffer;
+        p = (const uint32_t *)sector;
 
         // parse the whole sector except from the last slot
-        while(p < (uint32_t *)(buffer + bytes_read - 4))
+        while(p < (const uint32_t *)(sector + CALC_SECTOR_SIZE(hdr->ssz) - 4))
         {
             if(*p != SECID_FREE)
             {
+                // XXX: a looping MSAT chain must not write past the buffer
+                if(msat->slots >= COMP_DOC_HEADER_MSAT_SLOTS + msat_per_sector * hdr->nmsat_sectors)
+                {
+                    err = COMP_DOC_INVALID_MSAT;
+                    goto _error;
+                }
                 *(msat->secids + msat->slots) = *p;
                 msat->slots++;
             }
@@ -170,20 +420,23 @@ parse_msat_from_sectors(int fd, comp_doc_header_t *hdr, comp_doc_msat_t *msat)
 
 _error:
     if(buffer)
-        free(buffer);
+        doc_free(file, buffer);
 
     return err;
 }
 
 
 int
-parse_msat(int fd, comp_doc_header_t *header, comp_doc_msat_t **ret_msat)
+parse_msat(comp_doc_file_t *file, comp_doc_msat_t **ret_msat)
 {
     uint8_t *buffer;
-    uint32_t *p, err;
+    const uint8_t *slots;
+    const uint32_t *p;
+    uint32_t err;
     ssize_t bytes_read;
     unsigned int msat_slots;
     comp_doc_msat_t *msat;
+    comp_doc_header_t *header = file->hdr;
     
     *ret_msat = NULL;
     msat = NULL;
@@ -192,7 +445,7 @@ parse_msat(int fd, comp_doc_header_t *header, comp_doc_msat_t **ret_msat)
 
     err = COMP_DOC_SUCCESS;
 
-    msat = malloc(sizeof(comp_doc_msat_t));
+    msat = doc_malloc(file, sizeof(comp_doc_msat_t));
 
     if(msat == NULL)
     {
@@ -203,28 +456,41 @@ parse_msat(int fd, comp_doc_header_t *header, comp_doc_msat_t **ret_msat)
     msat->slots = 0;
     msat->secids = NULL;
 
+    bytes_read = COMP_DOC_HEADER_SIZE - sizeof(comp_doc_header_t);
 
-    // although the sector size may be small, the buffer should be
-    // big enough to hold the MSAT that have not been read yet 
-    if(CALC_SECTOR_SIZE(header->ssz) > (COMP_DOC_HEADER_SIZE - sizeof(comp_doc_header_t)))
-        buffer = malloc(CALC_SECTOR_SIZE(header->ssz) * sizeof(int8_t));
-    else
-        buffer = malloc((COMP_DOC_HEADER_SIZE - sizeof(comp_doc_header_t)) * sizeof(int8_t));
-
-    if(buffer == NULL)
+    // the first part of the MSAT follows the header
+    if(file->map != NULL)
     {
-        err = COMP_DOC_NO_MEM;
-        goto _error;
+        slots = map_position(file, sizeof(comp_doc_header_t), bytes_read);
+        if(slots == NULL)
+        {
+            err = COMP_DOC_READ_ERR;
+            goto _error;
+        }
     }
+    else
+    {
+        buffer = doc_malloc(file, bytes_read * sizeof(int8_t));
 
-    if((bytes_read = read_exactly(fd, buffer, 
-        (COMP_DOC_HEADER_SIZE - sizeof(comp_doc_header_t)))) < 0)
-            return COMP_DOC_READ_ERR;
+        if(buffer == NULL)
+        {
+            err = COMP_DOC_NO_MEM;
+            goto _error;
+        }
 
-    p = (uint32_t *)buffer;
+        if(read_position(file, sizeof(comp_doc_header_t), buffer, bytes_read) < 0)
+        {
+            err = COMP_DOC_READ_ERR;
+            goto _error;
+        }
+
+        slots = buffer;
+    }
+
+    p = (const uint32_t *)slots;
 
     //TODO: for security purposes we should apply strict parsing.
-    while(p < (uint32_t *)(buffer + bytes_read))
+    while(p < (const uint32_t *)(slots + bytes_read))
     {
         if(*p != SECID_FREE)
         {
@@ -236,8 +502,22 @@ parse_msat(int fd, comp_doc_header_t *header, comp_doc_msat_t **ret_msat)
     if(msat_slots > 0)
     {
         msat->slots = msat_slots;
-        msat->secids = malloc(msat_slots * sizeof(uint32_t));
-        memcpy(msat->secids, buffer, msat->slots * sizeof(uint32_t));
+
+        if(file->map != NULL)
+        {
+            // the used slots come first, so they can be used in place
+            msat->secids = (uint32_t *)slots;
+        }
+        else
+        {
+            msat->secids = doc_malloc(file, msat_slots * sizeof(uint32_t));
+            if(msat->secids == NULL)
+            {
+                err = COMP_DOC_NO_MEM;
+                goto _error;
+            }
+            memcpy(msat->secids, slots, msat->slots * sizeof(uint32_t));
+        }
     }
     else
     {
@@ -255,9 +535,9 @@ parse_msat(int fd, comp_doc_header_t *header, comp_doc_msat_t **ret_msat)
             err = COMP_DOC_INVALID_MSAT;
             goto _error;
         }
-        else
+        else if((err = parse_msat_from_sectors(file, msat)) != COMP_DOC_SUCCESS)
         {
-            parse_msat_from_sectors(fd, header, msat);
+            goto _error;
         }
     }
 
@@ -265,11 +545,11 @@ parse_msat(int fd, comp_doc_header_t *header, comp_doc_msat_t **ret_msat)
 
 _error:
     if(buffer)
-        free(buffer);
+        doc_free(file, buffer);
 
     if(err != COMP_DOC_SUCCESS)
     {
-        free_msat(msat);
+        free_msat(file, msat);
         *ret_msat = NULL;
     }
 
@@ -277,31 +557,60 @@ _error:
 }
 
 
+/*
+ * Checks that every SecID of the table either is one of the special values
+ * or refers to a sector that exists. Chains can be followed by index after that.
+ * The free entries are counted along, for the sector allocator.
+ */
+static int
+check_sat_entries(comp_doc_sat_t *sat)
+{
+    comp_doc_secid_counts_t counts;
+
+    if(scan_secids(sat->secids, sat->slots, sat->slots, &counts) != sat->slots)
+        return COMP_DOC_INVALID_SAT;
+
+    sat->nfree = counts.free;
+
+    return COMP_DOC_SUCCESS;
+}
+
+/*
+ * Returns non zero when the chain that starts at `secid' is made of
+ * consecutive sectors, so that it can be used straight from the mapping.
+ */
+static int
+is_contiguous_chain(comp_doc_sat_t *sat, uint32_t secid, unsigned int nsectors)
+{
+    for(; nsectors > 1; nsectors--)
+    {
+        if(sat->secids[secid] != secid + 1)
+            return 0;
+        secid++;
+    }
+
+    return 1;
+}
+
 int
-parse_ssat(int fd, comp_doc_header_t *hdr, comp_doc_sat_t *sat, comp_doc_ssat_t **ret_ssat)
+parse_ssat(comp_doc_file_t *file, comp_doc_ssat_t **ret_ssat)
 {
     comp_doc_ssat_t *ssat;
     int err;    
-    unsigned int slots_per_sector;
-    uint32_t current_sector, tmp, *p;
-    uint8_t *buffer;
-    ssize_t bytes_read;
+    unsigned int slots_per_sector, max_slots;
+    uint32_t current_sector;
+    comp_doc_header_t *hdr = file->hdr;
+    comp_doc_sat_t *sat = file->sat;
 
     *ret_ssat = NULL;
     err = COMP_DOC_SUCCESS;
+    ssat = NULL;
 
     // TODO: sanity check here
     if(hdr->first_ssat_sector == SECID_END_OF_CHAIN && hdr->nssat_sectors == 0)
         return COMP_DOC_NO_SSAT;
 
-    buffer = malloc(CALC_SECTOR_SIZE(hdr->ssz));
-    if(buffer == NULL)
-    {
-        err = COMP_DOC_NO_MEM;
-        goto _error;
-    }
-    
-    ssat = malloc(sizeof(comp_doc_ssat_t));
+    ssat = doc_malloc(file, sizeof(comp_doc_ssat_t));
     if(ssat == NULL)
     {
         err = COMP_DOC_NO_MEM;
@@ -309,65 +618,71 @@ parse_ssat(int fd, comp_doc_header_t *hdr, comp_doc_sat_t *sat, comp_doc_ssat_t
     }
 
     slots_per_sector = CALC_SECTOR_SIZE(hdr->ssz) / 4;
-    ssat->secids = calloc(slots_per_sector * hdr->nssat_sectors, sizeof(comp_doc_ssat_t));
+    max_slots = slots_per_sector * hdr->nssat_sectors;
+    ssat->slots = max_slots;
+    ssat->secids = NULL;
 
-    if(ssat->secids == NULL)
+    if(hdr->first_ssat_sector >= sat->slots)
     {
-        err = COMP_DOC_NO_MEM;
+        err = COMP_DOC_INVALID_SAT;
         goto _error;
     }
 
-    ssat->slots = 0;
-
-    current_sector = hdr->first_ssat_sector;
-    
-    while(current_sector != SECID_END_OF_CHAIN)
+    if(file->map != NULL && is_contiguous_chain(sat, hdr->first_ssat_sector, hdr->nssat_sectors))
     {
-        if(lseek(fd, sector_position(hdr, current_sector), SEEK_SET) < 0)
+        // the SSAT is used in place
+        ssat->secids = (comp_doc_secid_value_t *)map_position(file, 
+            sector_position(hdr, hdr->first_ssat_sector), max_slots * sizeof(comp_doc_secid_value_t));
+
+        if(ssat->secids == NULL)
         {
-            err = COMP_DOC_SEEK_ERR;
+            err = COMP_DOC_READ_ERR;
             goto _error;
         }
+    }
+    else
+    {
+        ssat->secids = doc_malloc(file, max_slots * sizeof(comp_doc_secid_value_t));
 
-        if((bytes_read = read_exactly(fd, buffer, CALC_SECTOR_SIZE(hdr->ssz))) < 0)
+        if(ssat->secids == NULL)
         {
-            err = COMP_DOC_READ_ERR;
+            err = COMP_DOC_NO_MEM;
             goto _error;
         }
 
-        p = (uint32_t *)buffer;
-
-        while(p < (uint32_t *)(buffer + bytes_read))
+        ssat->slots = 0;
+        current_sector = hdr->first_ssat_sector;
+        
+        while(current_sector != SECID_END_OF_CHAIN)
         {
-            tmp = *p;
-            ssat->secids[ssat->slots].value = tmp;
-
-            if(tmp < SECID_MSAT)
+            if(current_sector >= sat->slots || ssat->slots >= max_slots)
             {
-                // XXX: if tmp is not checked, this can lead to a serious vulnerability
-                ssat->secids[ssat->slots].next = &ssat->secids[tmp];
+                err = COMP_DOC_INVALID_SAT;
+                goto _error;
             }
-            else
+
+            // the sector is read straight into the table
+            if(read_position(file, sector_position(hdr, current_sector), 
+                ssat->secids + ssat->slots, CALC_SECTOR_SIZE(hdr->ssz)) < 0)
             {
-                ssat->secids[ssat->slots].next = NULL;
+                err = COMP_DOC_READ_ERR;
+                goto _error;
             }
 
-            p++;
-            ssat->slots++;
+            ssat->slots += slots_per_sector;
+            current_sector = sat->secids[current_sector];
         }
-
-        current_sector = sat->secids[current_sector].value;
     }
 
+    if((err = check_sat_entries(ssat)) != COMP_DOC_SUCCESS)
+        goto _error;
+
     *ret_ssat = ssat;
 
 _error:
-    if(buffer)
-        free(buffer);
-
     if(err != COMP_DOC_SUCCESS)
     {
-        free_ssat(ssat);
+        free_ssat(file, ssat);
         *ret_ssat = NULL;
     }
 
@@ -375,21 +690,18 @@ _error:
 }
 
 int 
-parse_sat(int fd, comp_doc_header_t *hdr, comp_doc_msat_t *msat, comp_doc_sat_t **ret_sat)
+parse_sat(comp_doc_file_t *file, comp_doc_sat_t **ret_sat)
 {
-    int i, err;
-    uint8_t *buffer;
-    ssize_t bytes_read;
-    comp_doc_secid_value_t *p, tmp;
-    comp_doc_secid_value_t sector_index;
+    unsigned int i, run, slots_per_sector, nsat_sectors;
+    int err;
     comp_doc_sat_t *sat;
+    comp_doc_header_t *hdr = file->hdr;
+    comp_doc_msat_t *msat = file->msat;
 
     *ret_sat = NULL;
     err = COMP_DOC_SUCCESS;
-    sector_index = 0;
-    buffer = NULL;
 
-    sat = malloc(sizeof(comp_doc_sat_t));
+    sat = doc_malloc(file, sizeof(comp_doc_sat_t));
 
     if(sat == NULL)
     {
@@ -397,156 +709,189 @@ parse_sat(int fd, comp_doc_header_t *hdr, comp_doc_msat_t *msat, comp_doc_sat_t
         goto _error;
     }
 
-    // The whole sector is used as SAT.
-    sat->slots = (CALC_SECTOR_SIZE(hdr->ssz) * hdr->nsat_sectors) / 4;
-    // XXX: may overflow here
-    sat->secids = malloc(sat->slots * sizeof(comp_doc_sector_id_t));
+    sat->secids = NULL;
 
-    if(sat->secids == NULL)
+    if(msat->slots > hdr->nsat_sectors)
     {
-        err = COMP_DOC_NO_MEM;
+        err = COMP_DOC_INVALID_SAT;
         goto _error;
     }
 
-    buffer = malloc(CALC_SECTOR_SIZE(hdr->ssz));
+    // The whole sector is used as SAT.
+    slots_per_sector = CALC_SECTOR_SIZE(hdr->ssz) / 4;
+    nsat_sectors = msat->slots;
+    sat->slots = slots_per_sector * nsat_sectors;
 
-    if(buffer == NULL)
+    // SAT sectors that follow each other in the file are fetched with
+    // a single read, or used in place when the file is mapped
+    for(run = 1; run < nsat_sectors; run++)
     {
-        err = COMP_DOC_NO_MEM;
-        goto _error;
+        if(msat->secids[run] != msat->secids[run - 1] + 1)
+            break;
     }
-    
-    for(i = 0; i < msat->slots; i++)
+
+    if(file->map != NULL && run == nsat_sectors && nsat_sectors > 0)
     {
+        sat->secids = (comp_doc_secid_value_t *)map_position(file, 
+            sector_position(hdr, msat->secids[0]), sat->slots * sizeof(comp_doc_secid_value_t));
 
-        lseek(fd, sector_position(hdr, msat->secids[i]), SEEK_SET);
-        /* Read the sector that is indicated by MSAT */
-        bytes_read = read_exactly(fd, buffer, CALC_SECTOR_SIZE(hdr->ssz));
-        
-        if(bytes_read < 0)
+        if(sat->secids == NULL)
         {
             err = COMP_DOC_READ_ERR;
             goto _error;
         }
+    }
+    else
+    {
+        // XXX: may overflow here
+        sat->secids = doc_malloc(file, sat->slots * sizeof(comp_doc_secid_value_t));
 
-        p = (uint32_t *)buffer;
+        if(sat->secids == NULL)
+        {
+            err = COMP_DOC_NO_MEM;
+            goto _error;
+        }
 
-        while(p < (uint32_t *)(buffer + bytes_read))
+        for(i = 0; i < nsat_sectors; i += run)
         {
-            tmp = *p;
-            sat->secids[sector_index].value = tmp;
-            sat->secids[sector_index].offset = sector_position(hdr, msat->secids[i]);
-            
-            if(tmp < SECID_MSAT)
+            for(run = 1; i + run < nsat_sectors; run++)
             {
-                // if tmp is a just regular sector
-
-                // XXX: if tmp is not checked, this can lead to a serious vulnerability
-                if(tmp >= sat->slots)
-                {
-                    err = COMP_DOC_INVALID_SAT;
-                    goto _error;
-                }
-                sat->secids[sector_index].next = &sat->secids[tmp];
+                if(msat->secids[i + run] != msat->secids[i] + run)
+                    break;
             }
-            else
+
+            /* Read the sectors that are indicated by MSAT */
+            if(read_position(file, sector_position(hdr, msat->secids[i]), 
+                sat->secids + i * slots_per_sector, run * CALC_SECTOR_SIZE(hdr->ssz)) < 0)
             {
-                sat->secids[sector_index].next = NULL;
+                err = COMP_DOC_READ_ERR;
+                goto _error;
             }
-
-            p++;
-            sector_index++;
         }
     }
 
+    if((err = check_sat_entries(sat)) != COMP_DOC_SUCCESS)
+        goto _error;
+
     *ret_sat = sat;
 
 _error:    
-    if(buffer)
-        free(buffer);
-
     if (err != COMP_DOC_SUCCESS)
     {
-        free_sat(sat);
+        free_sat(file, sat);
     }
 
     return err;
 }
 
+/*
+ * Version 3 entries only use the low 32 bits of the size, and some writers
+ * leave garbage in the high ones. Returns how many of the `n' entries have
+ * some, after clearing it if `clear' is set.
+ */
+unsigned int
+clean_sizes(comp_doc_directory_t *dirs, unsigned int n, int clear)
+{
+    unsigned int i, found;
+
+    for(i = found = 0; i < n; i++)
+    {
+        if(dirs[i].size > UINT32_MAX)
+        {
+            found++;
+
+            if(clear)
+                dirs[i].size &= UINT32_MAX;
+        }
+    }
+
+    return found;
+}
+
 int
-parse_directories(int fd, comp_doc_header_t *hdr, comp_doc_sat_t *sat, comp_doc_directory_t **ret_dirs, unsigned int *ndirs)
+parse_directories(comp_doc_file_t *file, comp_doc_directory_t **ret_dirs, unsigned int *ndirs)
 {
     int err;
     unsigned int ndir_sectors, dirs_per_sector, i;
-    comp_doc_sector_id_t *root_secid, *cur_secid;
+    uint32_t secid;
     comp_doc_directory_t *dirs;
+    comp_doc_header_t *hdr = file->hdr;
+    comp_doc_sat_t *sat = file->sat;
 
     err = COMP_DOC_SUCCESS;
     dirs = NULL;
     *ret_dirs = NULL;
     *ndirs = 0;
-    cur_secid = root_secid = &sat->secids[hdr->first_dir_sector];
 
+    if(hdr->first_dir_sector >= sat->slots)
+    {
+        err = COMP_DOC_NO_DIRS;
+        goto _error;
+    }
+
+    secid = hdr->first_dir_sector;
     ndir_sectors = 1;
 
     /* count the sectors in which are contained the directories */
-    while(cur_secid->value != SECID_END_OF_CHAIN)
+    while(sat->secids[secid] != SECID_END_OF_CHAIN)
     {
+        // a chain cannot be longer than the SAT, unless it loops
+        if(sat->secids[secid] >= SECID_MSAT || ndir_sectors > sat->slots)
+        {
+            err = COMP_DOC_INVALID_SAT;
+            goto _error;
+        }
         ndir_sectors++;
-        cur_secid = cur_secid->next;
+        secid = sat->secids[secid];
     }
 
-    /* there should be at least one directory entry */
-    if(!ndir_sectors)
+    dirs_per_sector = CALC_SECTOR_SIZE(hdr->ssz) / COMP_DOC_DIRECTORY_SZ;
+
+    if(file->map != NULL && is_contiguous_chain(sat, hdr->first_dir_sector, ndir_sectors))
     {
-        err = COMP_DOC_NO_DIRS;
-        goto _error;
-    }
+        // the directory sectors are used in place, unless sizes have to be cleaned
+        dirs = (comp_doc_directory_t *)map_position(file, 
+            sector_position(hdr, hdr->first_dir_sector), CALC_SECTOR_SIZE(hdr->ssz) * ndir_sectors);
 
-    dirs_per_sector = CALC_SECTOR_SIZE(hdr->ssz) / COMP_DOC_DIRECTORY_SZ;
+        if(dirs == NULL)
+        {
+            err = COMP_DOC_READ_ERR;
+            goto _error;
+        }
 
-    dirs = malloc(sizeof(comp_doc_directory_t) * dirs_per_sector * ndir_sectors);
+        if(hdr->version < 4 && clean_sizes(dirs, dirs_per_sector * ndir_sectors, 0) > 0)
+            dirs = NULL;
+    }
 
     if(dirs == NULL)
     {
-        err = COMP_DOC_NO_MEM;
-        goto _error;
-    }
-
-    cur_secid = root_secid;
+        dirs = doc_malloc(file, sizeof(comp_doc_directory_t) * dirs_per_sector * ndir_sectors);
 
-    // parse all (ndir_sectors) sectors that contain directories
-    for(i = 0; i < ndir_sectors; i++)
-    {
-        if(i == 0)
+        if(dirs == NULL)
         {
-            //printf("%x\n", sector_position(hdr, hdr->first_dir_sector));
-            if(lseek(fd, sector_position(hdr, hdr->first_dir_sector), SEEK_SET) < 0)
-            {
-                err = COMP_DOC_SEEK_ERR;
-                goto _error;
-            }
+            err = COMP_DOC_NO_MEM;
+            goto _error;
         }
-        else
+
+        secid = hdr->first_dir_sector;
+
+        // parse all (ndir_sectors) sectors that contain directories
+        for(i = 0; i < ndir_sectors; i++)
         {
-            if(lseek(fd, sector_position(hdr, cur_secid->value), SEEK_SET) < 0)
+            if(read_position(file, sector_position(hdr, secid), 
+                (dirs + (i * dirs_per_sector)), CALC_SECTOR_SIZE(hdr->ssz)) < 0)
             {
-                err = COMP_DOC_SEEK_ERR;
+                err = COMP_DOC_READ_ERR;
                 goto _error;
             }
-        }
 
-        if(read_exactly(fd, (dirs + (i * dirs_per_sector)), CALC_SECTOR_SIZE(hdr->ssz)) < 0)
-        {
-            err = COMP_DOC_READ_ERR;
-            goto _error;
+            secid = sat->secids[secid];
         }
 
-        if(i != 0)
-            cur_secid = cur_secid->next;
+        if(hdr->version < 4)
+            clean_sizes(dirs, dirs_per_sector * ndir_sectors, 1);
     }
 
-
     *ret_dirs = dirs;
     *ndirs = dirs_per_sector * ndir_sectors;
 
@@ -554,12 +899,121 @@ _error:
     if(err != COMP_DOC_SUCCESS)
     {
         *ndirs = 0;
-        free_directory(dirs);
+        free_directory(file, dirs);
+    }
+
+    return err;
+}
+
+
+/*
+ * Builds the map of the short-stream container: the n-th element of
+ * `ret_secids' is the SecID of the n-th sector of the container, whose
+ * chain starts at the root entry. Files without short streams get an
+ * empty map.
+ */
+int
+parse_ministream(comp_doc_file_t *file, uint32_t **ret_secids, unsigned int *nsecids)
+{
+    int err;
+    unsigned int n;
+    uint32_t secid, *secids;
+    comp_doc_sat_t *sat = file->sat;
+
+    err = COMP_DOC_SUCCESS;
+    secids = NULL;
+    *ret_secids = NULL;
+    *nsecids = 0;
+
+    // XXX: assertion first directory entry _MUST_ be the root storage
+    if(file->ssat == NULL || file->ndirs == 0 || !IS_DIR_ROOT_ENTRY(file->dirs))
+        return COMP_DOC_SUCCESS;
+
+    if(file->dirs[0].first_sector == SECID_END_OF_CHAIN)
+        return COMP_DOC_SUCCESS;
+
+    if(file->dirs[0].first_sector >= sat->slots)
+        return COMP_DOC_INVALID_SAT;
+
+    // count the sectors of the container first
+    n = 1;
+    secid = file->dirs[0].first_sector;
+
+    while(sat->secids[secid] < SECID_MSAT)
+    {
+        // a chain cannot be longer than the SAT, unless it loops
+        if(n >= sat->slots)
+            return COMP_DOC_INVALID_SAT;
+
+        secid = sat->secids[secid];
+        n++;
+    }
+
+    secids = doc_malloc(file, n * sizeof(uint32_t));
+
+    if(secids == NULL)
+    {
+        err = COMP_DOC_NO_MEM;
+        goto _error;
+    }
+
+    secid = file->dirs[0].first_sector;
+
+    for(n = 0; secid < SECID_MSAT; n++)
+    {
+        secids[n] = secid;
+        secid = sat->secids[secid];
     }
 
+    *ret_secids = secids;
+    *nsecids = n;
+
+_error:
     return err;
 }
 
+/*
+ * Reads the whole short-stream container into one buffer, following the
+ * map built by parse_ministream. Sectors that follow each other in the
+ * file are read at once. A container that cannot be read whole, such as
+ * one cut short by the end of the file, is left on disk.
+ */
+int
+read_ministream(comp_doc_file_t *file, unsigned char **ret_buffer, size_t *size)
+{
+    uint32_t sector_size, i, j;
+    unsigned char *buffer;
+
+    *ret_buffer = NULL;
+    *size = 0;
+
+    if(file->nministream == 0)
+        return COMP_DOC_SUCCESS;
+
+    sector_size = CALC_SECTOR_SIZE(file->hdr->ssz);
+    buffer = doc_malloc(file, (size_t)file->nministream * sector_size);
+
+    if(buffer == NULL)
+        return COMP_DOC_NO_MEM;
+
+    for(i = 0; i < file->nministream; i = j)
+    {
+        for(j = i + 1; j < file->nministream && file->ministream[j] == file->ministream[j - 1] + 1; j++)
+            ;
+
+        if(read_position(file, sector_position(file->hdr, file->ministream[i]), 
+            buffer + (size_t)i * sector_size, (size_t)(j - i) * sector_size) < 0)
+        {
+            doc_free(file, buffer);
+            return COMP_DOC_SUCCESS;
+        }
+    }
+
+    *ret_buffer = buffer;
+    *size = (size_t)file->nministream * sector_size;
+
+    return COMP_DOC_SUCCESS;
+}
 
 /* 
  * This function contains some basic checks to ensure that the header 
@@ -581,11 +1035,21 @@ check_header_sanity(comp_doc_header_t *hdr)
         err = COMP_DOC_INSANE_HEADER;
     #endif /* COMP_DOC_SUPPORT_ONLY_LITTLE_ENDIAN */
 
-    if(hdr->ssz < 7 || hdr->ssz > COMP_DOC_SSZ_MAX)
+    // each version has a single sector size, which the size rules of its entries rely on
+    if(hdr->version == 3)
+    {
+        if(hdr->ssz != 9)
+            err = COMP_DOC_INSANE_HEADER;
+    }
+    else if(hdr->version == 4)
+    {
+        if(hdr->ssz != 12)
+            err = COMP_DOC_INSANE_HEADER;
+    }
+    else
         err = COMP_DOC_INSANE_HEADER;
 
-    // XXX: is the second condition required ?
-    if(hdr->sssz > hdr->ssz || hdr->sssz == 0)
+    if(hdr->sssz != 6)
         err = COMP_DOC_INSANE_HEADER;
 
     if(hdr->stream_min_size < 0x1000)
@@ -601,7 +1065,7 @@ check_header_sanity(comp_doc_header_t *hdr)
 }
 
 int 
-parse_header(int fd, comp_doc_header_t **ret_hdr)
+parse_header(comp_doc_file_t *file, comp_doc_header_t **ret_hdr)
 {
     int err;
     comp_doc_header_t *hdr;
@@ -610,18 +1074,31 @@ parse_header(int fd, comp_doc_header_t **ret_hdr)
     hdr = NULL;
     err = COMP_DOC_SUCCESS;
 
-    hdr = calloc(1, sizeof(comp_doc_header_t));
-
-    if(hdr == NULL)
+    if(file->map != NULL)
     {
-        err = COMP_DOC_NO_MEM;
-        goto _error;
-    }
+        hdr = (comp_doc_header_t *)map_position(file, 0, COMP_DOC_HEADER_SIZE);
 
-    if(read_exactly(fd, hdr, sizeof(comp_doc_header_t)) < 0)
-    {
+        if(hdr == NULL)
+        {
             err = COMP_DOC_READ_ERR;
             goto _error;
+        }
+    }
+    else
+    {
+        hdr = doc_calloc(file, 1, sizeof(comp_doc_header_t));
+
+        if(hdr == NULL)
+        {
+            err = COMP_DOC_NO_MEM;
+            goto _error;
+        }
+
+        if(read_position(file, 0, hdr, sizeof(comp_doc_header_t)) < 0)
+        {
+                err = COMP_DOC_READ_ERR;
+                goto _error;
+        }
     }
 
     *ret_hdr = hdr;
@@ -632,8 +1109,8 @@ _error:
     if(err != COMP_DOC_SUCCESS)
     {
         *ret_hdr = NULL;
-        free_header(hdr);
+        free_header(file, hdr);
     }
 
     return err;
-}
\ No newline at end of file
+}
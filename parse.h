@@ -2,20 +2,58 @@
 #define _COMP_DOC_PARSE_H_
 #include <stdint.h>
 #include <unistd.h>
+#include <sys/uio.h>
 #include "compdoc.h"
 
+// true when `p' points inside the mapping of a file opened with comp_doc_open_mmap
+#define IS_MAPPED(file, p) ((file)->map != NULL && (const uint8_t *)(p) >= (const uint8_t *)(file)->map \
+    && (const uint8_t *)(p) < (const uint8_t *)(file)->map + (file)->map_size)
+
+// true when the stream of `dir' is short and its container is held in memory
+#define IS_SHORT_CACHED(file, dir) ((file)->mini_container != NULL \
+    && (dir)->size < (file)->hdr->stream_min_size)
+
+#ifdef COMP_DOC_STATS
+// counters are updated by concurrent readers, without ordering
+#define STATS_ADD(file, field, n) __atomic_add_fetch(&(file)->stats.field, (n), __ATOMIC_RELAXED)
+#define STATS_CLOCK(start) uint64_t start = stats_clock()
+#define STATS_PHASE(file, phase, start) stats_phase((file), (phase), (start))
+uint64_t stats_clock(void);
+void stats_phase(comp_doc_file_t *, int, uint64_t);
+#else
+#define STATS_ADD(file, field, n) ((void)0)
+#define STATS_CLOCK(start)
+#define STATS_PHASE(file, phase, start) ((void)0)
+#endif
+
+void * doc_malloc(comp_doc_file_t *, size_t);
+void * doc_calloc(comp_doc_file_t *, size_t, size_t);
+void * doc_realloc(comp_doc_file_t *, void *, size_t);
+void doc_free(comp_doc_file_t *, void *);
 off_t short_sector_position(comp_doc_file_t *, uint32_t);
 off_t sector_position(comp_doc_header_t *, uint32_t);
-ssize_t read_exactly(int, void *, ssize_t);
-inline void free_header(comp_doc_header_t *);
-inline void free_msat(comp_doc_msat_t *);
-inline void free_sat(comp_doc_sat_t *);
-inline void free_directory(comp_doc_directory_t *);
-int parse_msat(int, comp_doc_header_t *, comp_doc_msat_t **);
-int parse_sat(int, comp_doc_header_t *, comp_doc_msat_t *, comp_doc_sat_t **);
-int parse_ssat(int, comp_doc_header_t *, comp_doc_sat_t *, comp_doc_ssat_t **); 
-int parse_directories(int, comp_doc_header_t *, comp_doc_sat_t *, comp_doc_directory_t **, unsigned int *);
-int parse_header(int, comp_doc_header_t **);
+const void * map_position(comp_doc_file_t *, off_t, size_t);
+ssize_t read_position(comp_doc_file_t *, off_t, void *, size_t);
+ssize_t readv_position(comp_doc_file_t *, off_t, struct iovec *, int);
+const uint8_t * read_sector(comp_doc_file_t *, uint32_t, uint8_t *);
+ssize_t read_exactly(int, void *, ssize_t, off_t);
+ssize_t write_position(comp_doc_file_t *, off_t, const void *, size_t);
+void free_header(comp_doc_file_t *, comp_doc_header_t *);
+void free_msat(comp_doc_file_t *, comp_doc_msat_t *);
+void free_sat(comp_doc_file_t *, comp_doc_sat_t *);
+void free_directory(comp_doc_file_t *, comp_doc_directory_t *);
+int parse_msat(comp_doc_file_t *, comp_doc_msat_t **);
+int parse_sat(comp_doc_file_t *, comp_doc_sat_t **);
+int parse_ssat(comp_doc_file_t *, comp_doc_ssat_t **); 
+unsigned int clean_sizes(comp_doc_directory_t *, unsigned int, int);
+int parse_directories(comp_doc_file_t *, comp_doc_directory_t **, unsigned int *);
+int parse_header(comp_doc_file_t *, comp_doc_header_t **);
+int parse_ministream(comp_doc_file_t *, uint32_t **, unsigned int *);
+int read_ministream(comp_doc_file_t *, unsigned char **, size_t *);
+int load_tables(comp_doc_file_t *, int);
+int name_from_utf8(const char *, size_t, uint16_t *);
+int compare_entries(comp_doc_directory_t *, comp_doc_directory_t *);
+void free_name_index(comp_doc_file_t *, comp_doc_name_index_t *);
 
 #define free_ssat free_sat
 
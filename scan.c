@@ -0,0 +1,680 @@
+/*
+ * Bulk scanner: lists the entries of many compound documents on a pool of
+ * threads, optionally hashing or extracting their streams, and writes one
+ * JSON or CSV line per entry.
+ *
+ *   scan [-j threads] [-f json|csv] [-m] [-V] [-H] [-x dir] [-l list] [path...]
+ *
+ * Paths may be files or directories, which are walked recursively. `-l'
+ * reads more paths from a file, one per line, or from stdin when it is `-'.
+ * `-V' checks every chain of a file on open and fails the corrupt ones.
+ */
+#define _XOPEN_SOURCE 700
+#include "compdoc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define SCAN_FORMAT_JSON 0
+#define SCAN_FORMAT_CSV 1
+
+#define SCAN_CHUNK (64 * 1024)
+/* longest name of an entry once converted to UTF-8, and its separator */
+#define SCAN_NAME_MAX (COMP_DOC_DIRECTORY_NAME_SIZE / 2 * 3 + 1)
+
+typedef struct {
+    char *data;
+    size_t length;
+    size_t capacity;
+} scan_buffer_t;
+
+typedef struct {
+    unsigned int nthreads;
+    int format;
+    int hash;
+    int mmap;
+    int verify;
+    const char *extract_dir;
+
+    char **paths;
+    size_t npaths;
+    size_t capacity;
+
+    /* next path to be taken by a worker */
+    size_t next;
+    pthread_mutex_t output_lock;
+
+    uint64_t files;
+    uint64_t failed;
+    uint64_t entries;
+    uint64_t file_bytes;
+    uint64_t stream_bytes;
+} scan_t;
+
+typedef struct {
+    scan_t *scan;
+    scan_buffer_t out;
+    unsigned char *chunk;
+    /* path of the current entry, and where it ends at each depth */
+    char path[COMP_DOC_ITER_STACK_SIZE * SCAN_NAME_MAX + 1];
+    size_t path_length[COMP_DOC_ITER_STACK_SIZE + 1];
+} scan_worker_t;
+
+/* nftw takes no context */
+static scan_t *walk_scan;
+
+static int
+add_path(scan_t *scan, const char *path)
+{
+    char **paths;
+
+    if(scan->npaths == scan->capacity)
+    {
+        scan->capacity = scan->capacity ? 2 * scan->capacity : 256;
+        paths = realloc(scan->paths, scan->capacity * sizeof(char *));
+
+        if(paths == NULL)
+            return -1;
+
+        scan->paths = paths;
+    }
+
+    if((scan->paths[scan->npaths] = strdup(path)) == NULL)
+        return -1;
+
+    scan->npaths++;
+
+    return 0;
+}
+
+static int
+walk_entry(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+    (void)ftw;
+
+    if(type == FTW_F && S_ISREG(st->st_mode))
+        return add_path(walk_scan, path);
+
+    return 0;
+}
+
+static int
+add_tree(scan_t *scan, const char *path)
+{
+    struct stat st;
+
+    if(stat(path, &st) == 0 && S_ISDIR(st.st_mode))
+    {
+        walk_scan = scan;
+        return nftw(path, walk_entry, 64, FTW_PHYS);
+    }
+
+    return add_path(scan, path);
+}
+
+static int
+add_list(scan_t *scan, const char *list)
+{
+    char line[4096];
+    size_t length;
+    FILE *fp;
+    int err = 0;
+
+    fp = strcmp(list, "-") == 0 ? stdin : fopen(list, "r");
+
+    if(fp == NULL)
+        return -1;
+
+    while(err == 0 && fgets(line, sizeof(line), fp) != NULL)
+    {
+        length = strcspn(line, "\r\n");
+        line[length] = '\0';
+
+        if(length > 0)
+            err = add_tree(scan, line);
+    }
+
+    if(fp != stdin)
+        fclose(fp);
+
+    return err;
+}
+
+static void
+buffer_reserve(scan_buffer_t *buf, size_t length)
+{
+    if(buf->length + length + 1 <= buf->capacity)
+        return;
+
+    while(buf->length + length + 1 > buf->capacity)
+        buf->capacity = buf->capacity ? 2 * buf->capacity : 4096;
+
+    if((buf->data = realloc(buf->data, buf->capacity)) == NULL)
+    {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+}
+
+static void
+buffer_printf(scan_buffer_t *buf, const char *fmt, ...)
+{
+    va_list ap;
+    int length;
+
+    va_start(ap, fmt);
+    length = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+
+    buffer_reserve(buf, length);
+
+    va_start(ap, fmt);
+    vsnprintf(buf->data + buf->length, length + 1, fmt, ap);
+    va_end(ap);
+
+    buf->length += length;
+}
+
+/*
+ * Appends a string as a JSON string or as a CSV field.
+ */
+static void
+buffer_quote(scan_buffer_t *buf, int format, const char *s)
+{
+    unsigned char c;
+
+    buffer_reserve(buf, 6 * strlen(s) + 2);
+    buf->data[buf->length++] = '"';
+
+    for(; (c = *s) != '\0'; s++)
+    {
+        if(format == SCAN_FORMAT_CSV)
+        {
+            if(c == '"')
+                buf->data[buf->length++] = '"';
+            buf->data[buf->length++] = c;
+        }
+        else if(c == '"' || c == '\\')
+        {
+            buf->data[buf->length++] = '\\';
+            buf->data[buf->length++] = c;
+        }
+        else if(c < 0x20)
+        {
+            buf->length += sprintf(buf->data + buf->length, "\\u%04x", c);
+        }
+        else
+        {
+            buf->data[buf->length++] = c;
+        }
+    }
+
+    buf->data[buf->length++] = '"';
+    buf->data[buf->length] = '\0';
+}
+
+/*
+ * Converts the UTF-16 name of an entry to UTF-8. Returns the length
+ * written, at most SCAN_NAME_MAX - 1 bytes.
+ */
+static size_t
+entry_name(comp_doc_directory_t *dir, char *out)
+{
+    uint32_t c, low;
+    size_t i, n, length;
+
+    length = 0;
+    n = dir->name_length / 2;
+
+    if(n > COMP_DOC_DIRECTORY_NAME_SIZE / 2)
+        n = COMP_DOC_DIRECTORY_NAME_SIZE / 2;
+
+    for(i = 0; i < n; i++)
+    {
+        c = dir->name[2 * i] | (dir->name[2 * i + 1] << 8);
+
+        if(c == 0)
+            break;
+
+        if(c >= 0xD800 && c < 0xDC00 && i + 1 < n)
+        {
+            low = dir->name[2 * i + 2] | (dir->name[2 * i + 3] << 8);
+
+            if(low >= 0xDC00 && low < 0xE000)
+            {
+                c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+                i++;
+            }
+        }
+
+        // names are meant to be printable, control characters are escaped later
+        if(c < 0x80)
+        {
+            out[length++] = c;
+        }
+        else if(c < 0x800)
+        {
+            out[length++] = 0xC0 | (c >> 6);
+            out[length++] = 0x80 | (c & 0x3F);
+        }
+        else if(c < 0x10000)
+        {
+            out[length++] = 0xE0 | (c >> 12);
+            out[length++] = 0x80 | ((c >> 6) & 0x3F);
+            out[length++] = 0x80 | (c & 0x3F);
+        }
+        else
+        {
+            out[length++] = 0xF0 | (c >> 18);
+            out[length++] = 0x80 | ((c >> 12) & 0x3F);
+            out[length++] = 0x80 | ((c >> 6) & 0x3F);
+            out[length++] = 0x80 | (c & 0x3F);
+        }
+    }
+
+    out[length] = '\0';
+
+    return length;
+}
+
+static const char *
+entry_type(comp_doc_directory_t *dir)
+{
+    if(IS_DIR_ROOT_ENTRY(dir))
+        return "root";
+    if(IS_DIR_STORAGE(dir))
+        return "storage";
+    if(IS_DIR_STREAM(dir))
+        return "stream";
+    return "unknown";
+}
+
+/*
+ * Reads the stream a chunk at a time, hashing it with 64-bit FNV-1a and
+ * writing it to `fd' as requested.
+ */
+static int
+scan_stream(scan_worker_t *worker, comp_doc_file_t *file, comp_doc_directory_t *dir, uint64_t *hash, int fd)
+{
+    comp_doc_stream_t *stream;
+    ssize_t bytes_read, i;
+    uint64_t h;
+    int err;
+
+    if((err = comp_doc_stream_open(file, dir, 0, &stream)) != COMP_DOC_SUCCESS)
+        return err;
+
+    h = 0xcbf29ce484222325ULL;
+
+    while((bytes_read = comp_doc_stream_read(stream, worker->chunk, SCAN_CHUNK)) > 0)
+    {
+        for(i = 0; i < bytes_read; i++)
+            h = (h ^ worker->chunk[i]) * 0x100000001b3ULL;
+
+        if(fd != -1 && write(fd, worker->chunk, bytes_read) != bytes_read)
+        {
+            bytes_read = COMP_DOC_READ_ERR;
+            break;
+        }
+
+        __atomic_add_fetch(&worker->scan->stream_bytes, bytes_read, __ATOMIC_RELAXED);
+    }
+
+    comp_doc_stream_close(stream);
+
+    *hash = h;
+
+    return bytes_read < 0 ? bytes_read : COMP_DOC_SUCCESS;
+}
+
+static void
+scan_entry(scan_worker_t *worker, comp_doc_file_t *file, size_t index, uint32_t dirid, comp_doc_directory_t *dir)
+{
+    scan_t *scan = worker->scan;
+    scan_buffer_t *out = &worker->out;
+    char extracted[4096];
+    uint64_t hash;
+    int fd, err;
+
+    fd = -1;
+    hash = 0;
+    err = COMP_DOC_SUCCESS;
+    extracted[0] = '\0';
+
+    if(IS_DIR_STREAM(dir) && (scan->hash || scan->extract_dir != NULL))
+    {
+        if(scan->extract_dir != NULL)
+        {
+            snprintf(extracted, sizeof(extracted), "%s/%zu_%u.bin", scan->extract_dir, index, dirid);
+
+            if((fd = open(extracted, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
+                err = COMP_DOC_NO_SUCH_FILE;
+        }
+
+        if(err == COMP_DOC_SUCCESS)
+            err = scan_stream(worker, file, dir, &hash, fd);
+
+        if(fd != -1)
+            close(fd);
+    }
+
+    if(scan->format == SCAN_FORMAT_JSON)
+    {
+        buffer_printf(out, "{\"file\":");
+        buffer_quote(out, scan->format, scan->paths[index]);
+        buffer_printf(out, ",\"dirid\":%u,\"type\":\"%s\",\"path\":", dirid, entry_type(dir));
+        buffer_quote(out, scan->format, worker->path);
+        buffer_printf(out, ",\"size\":%llu", (unsigned long long)dir->size);
+
+        if(IS_DIR_STREAM(dir) && scan->hash && err == COMP_DOC_SUCCESS)
+            buffer_printf(out, ",\"fnv1a64\":\"%016llx\"", (unsigned long long)hash);
+
+        if(extracted[0] != '\0' && err == COMP_DOC_SUCCESS)
+        {
+            buffer_printf(out, ",\"extracted\":");
+            buffer_quote(out, scan->format, extracted);
+        }
+
+        if(err != COMP_DOC_SUCCESS)
+            buffer_printf(out, ",\"error\":%d", err);
+
+        buffer_printf(out, "}\n");
+    }
+    else
+    {
+        buffer_quote(out, scan->format, scan->paths[index]);
+        buffer_printf(out, ",%u,%s,", dirid, entry_type(dir));
+        buffer_quote(out, scan->format, worker->path);
+        buffer_printf(out, ",%llu,", (unsigned long long)dir->size);
+
+        if(IS_DIR_STREAM(dir) && scan->hash && err == COMP_DOC_SUCCESS)
+            buffer_printf(out, "%016llx", (unsigned long long)hash);
+
+        buffer_printf(out, ",");
+
+        if(extracted[0] != '\0' && err == COMP_DOC_SUCCESS)
+            buffer_quote(out, scan->format, extracted);
+
+        buffer_printf(out, ",%d\n", err);
+    }
+}
+
+static void
+scan_error(scan_worker_t *worker, size_t index, int err)
+{
+    scan_buffer_t *out = &worker->out;
+
+    if(worker->scan->format == SCAN_FORMAT_JSON)
+    {
+        buffer_printf(out, "{\"file\":");
+        buffer_quote(out, SCAN_FORMAT_JSON, worker->scan->paths[index]);
+        buffer_printf(out, ",\"error\":%d}\n", err);
+    }
+    else
+    {
+        buffer_quote(out, SCAN_FORMAT_CSV, worker->scan->paths[index]);
+        buffer_printf(out, ",,,,,,,%d\n", err);
+    }
+}
+
+/*
+ * Lists every entry of the file, storages before their contents, keeping
+ * the path of the current entry up to date as the walk goes down.
+ */
+static void
+scan_file(scan_worker_t *worker, size_t index)
+{
+    scan_t *scan = worker->scan;
+    comp_doc_options_t options;
+    comp_doc_file_t *file;
+    comp_doc_directory_t *root, *dir;
+    comp_doc_dir_iter_t it;
+    uint64_t entries;
+    size_t length;
+    struct stat st;
+    int err;
+
+    memset(&options, 0, sizeof(options));
+    options.flags = scan->mmap ? COMP_DOC_OPEN_MMAP : 0;
+
+    if(scan->verify)
+        options.flags |= COMP_DOC_OPEN_VERIFY;
+
+    if((err = comp_doc_open_ex(scan->paths[index], COMP_DOC_PERM_READ, &options, &file)) != COMP_DOC_SUCCESS)
+    {
+        scan_error(worker, index, err);
+        __atomic_add_fetch(&scan->failed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    if(stat(scan->paths[index], &st) == 0)
+        __atomic_add_fetch(&scan->file_bytes, st.st_size, __ATOMIC_RELAXED);
+
+    entries = 0;
+    root = comp_doc_get_root_storage(file);
+    strcpy(worker->path, "/");
+    worker->path_length[0] = 0;
+
+    if(root == NULL || (err = comp_doc_iter_init(file, root, COMP_DOC_ITER_RECURSIVE, &it)) != COMP_DOC_SUCCESS)
+    {
+        scan_error(worker, index, root == NULL ? COMP_DOC_NO_DIRS : err);
+        __atomic_add_fetch(&scan->failed, 1, __ATOMIC_RELAXED);
+        comp_doc_close(file);
+        return;
+    }
+
+    scan_entry(worker, file, index, 0, root);
+    entries++;
+
+    while((dir = comp_doc_iter_next(&it)) != NULL)
+    {
+        if(it.depth >= COMP_DOC_ITER_STACK_SIZE)
+        {
+            it.err = COMP_DOC_DIR_TOO_DEEP;
+            break;
+        }
+
+        length = worker->path_length[it.depth];
+        worker->path[length++] = '/';
+        length += entry_name(dir, worker->path + length);
+        worker->path_length[it.depth + 1] = length;
+
+        scan_entry(worker, file, index, it.dirid, dir);
+        entries++;
+    }
+
+    if(it.err != COMP_DOC_SUCCESS)
+    {
+        scan_error(worker, index, it.err);
+        __atomic_add_fetch(&scan->failed, 1, __ATOMIC_RELAXED);
+    }
+
+    __atomic_add_fetch(&scan->entries, entries, __ATOMIC_RELAXED);
+
+    comp_doc_close(file);
+}
+
+static void *
+scan_worker(void *arg)
+{
+    scan_worker_t *worker = arg;
+    scan_t *scan = worker->scan;
+    size_t index;
+
+    while((index = __atomic_fetch_add(&scan->next, 1, __ATOMIC_RELAXED)) < scan->npaths)
+    {
+        worker->out.length = 0;
+
+        scan_file(worker, index);
+
+        // one file at a time, so that lines of different files never mix
+        pthread_mutex_lock(&scan->output_lock);
+        fwrite(worker->out.data, 1, worker->out.length, stdout);
+        pthread_mutex_unlock(&scan->output_lock);
+
+        __atomic_add_fetch(&scan->files, 1, __ATOMIC_RELAXED);
+    }
+
+    return NULL;
+}
+
+static void
+usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-j threads] [-f json|csv] [-m] [-V] [-H] [-x dir] [-l list] [path...]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    scan_t scan;
+    scan_worker_t *workers;
+    pthread_t *threads;
+    struct timespec start, end;
+    double seconds;
+    unsigned int i;
+    long ncpus;
+    int opt;
+
+    memset(&scan, 0, sizeof(scan));
+    pthread_mutex_init(&scan.output_lock, NULL);
+
+    while((opt = getopt(argc, argv, "j:f:mVHx:l:h")) != -1)
+    {
+        switch(opt)
+        {
+            case 'j':
+                scan.nthreads = atoi(optarg);
+                break;
+            case 'f':
+                if(strcmp(optarg, "csv") == 0)
+                    scan.format = SCAN_FORMAT_CSV;
+                else if(strcmp(optarg, "json") == 0)
+                    scan.format = SCAN_FORMAT_JSON;
+                else
+                {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'm':
+                scan.mmap = 1;
+                break;
+            case 'V':
+                scan.verify = 1;
+                break;
+            case 'H':
+                scan.hash = 1;
+                break;
+            case 'x':
+                scan.extract_dir = optarg;
+                break;
+            case 'l':
+                if(add_list(&scan, optarg) != 0)
+                {
+                    fprintf(stderr, "failed to read list %s\n", optarg);
+                    return -1;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return -1;
+        }
+    }
+
+    for(; optind < argc; optind++)
+    {
+        if(add_tree(&scan, argv[optind]) != 0)
+        {
+            fprintf(stderr, "failed to walk %s\n", argv[optind]);
+            return -1;
+        }
+    }
+
+    if(scan.npaths == 0)
+    {
+        usage(argv[0]);
+        return -1;
+    }
+
+    if(scan.nthreads == 0)
+    {
+        ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        scan.nthreads = ncpus > 0 ? ncpus : 1;
+    }
+
+    if(scan.nthreads > scan.npaths)
+        scan.nthreads = scan.npaths;
+
+    workers = calloc(scan.nthreads, sizeof(scan_worker_t));
+    threads = calloc(scan.nthreads, sizeof(pthread_t));
+
+    if(workers == NULL || threads == NULL)
+    {
+        fprintf(stderr, "out of memory\n");
+        return -1;
+    }
+
+    if(scan.format == SCAN_FORMAT_CSV)
+        printf("file,dirid,type,path,size,fnv1a64,extracted,error\n");
+
+    fflush(stdout);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for(i = 0; i < scan.nthreads; i++)
+    {
+        workers[i].scan = &scan;
+
+        if((workers[i].chunk = malloc(SCAN_CHUNK)) == NULL)
+        {
+            fprintf(stderr, "out of memory\n");
+            return -1;
+        }
+
+        if(i > 0 && pthread_create(&threads[i], NULL, scan_worker, &workers[i]) != 0)
+        {
+            fprintf(stderr, "failed to start thread %u\n", i);
+            return -1;
+        }
+    }
+
+    scan_worker(&workers[0]);
+
+    for(i = 1; i < scan.nthreads; i++)
+        pthread_join(threads[i], NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    fflush(stdout);
+
+    seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    if(seconds <= 0)
+        seconds = 1e-9;
+
+    fprintf(stderr, "%llu files (%llu failed), %llu entries in %.3f s: %.1f files/s, %.1f MB/s read, %.1f MB/s of streams\n",
+        (unsigned long long)scan.files, (unsigned long long)scan.failed, (unsigned long long)scan.entries, seconds,
+        scan.files / seconds, scan.file_bytes / seconds / 1e6, scan.stream_bytes / seconds / 1e6);
+
+    for(i = 0; i < scan.nthreads; i++)
+    {
+        free(workers[i].out.data);
+        free(workers[i].chunk);
+    }
+
+    for(i = 0; i < scan.npaths; i++)
+        free(scan.paths[i]);
+
+    free(scan.paths);
+    free(workers);
+    free(threads);
+    pthread_mutex_destroy(&scan.output_lock);
+
+    return scan.failed ? 1 : 0;
+}
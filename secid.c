@@ -0,0 +1,192 @@
+#include "secid.h"
+#include <string.h>
+
+/*
+ * The SSE2 and AVX2 kernels are built with target attributes and picked
+ * when the table is scanned, so that the same build runs on any x86 CPU.
+ * Define COMP_DOC_NO_SIMD to always use the plain loop.
+ */
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && !defined(COMP_DOC_NO_SIMD)
+#define SECID_X86
+#include <immintrin.h>
+#endif
+
+// the kernels are only worth it once the intrinsics are inlined, even in debug builds
+#if defined(SECID_X86) && !defined(__clang__)
+#define SECID_KERNEL(isa) __attribute__((target(isa), optimize("O2")))
+#else
+#define SECID_KERNEL(isa) __attribute__((target(isa)))
+#endif
+
+static unsigned int
+scan_scalar(const comp_doc_secid_value_t *secids, unsigned int start, unsigned int n, uint32_t limit,
+    comp_doc_secid_counts_t *counts)
+{
+    unsigned int i;
+    uint32_t secid;
+
+    for(i = start; i < n; i++)
+    {
+        secid = secids[i];
+
+        if(secid < limit)
+            counts->next++;
+        else if(secid == SECID_FREE)
+            counts->free++;
+        else if(secid == SECID_END_OF_CHAIN)
+            counts->end_of_chain++;
+        else if(secid == SECID_SAT)
+            counts->sat++;
+        else if(secid == SECID_MSAT)
+            counts->msat++;
+        else
+            return i;
+    }
+
+    return n;
+}
+
+#ifdef SECID_X86
+/*
+ * Both kernels classify a block of entries with one comparison per kind
+ * and add the resulting masks, -1 in every matching lane, to per-lane
+ * counters. There are no unsigned comparisons, so SecIDs and the limit are
+ * compared with their sign bit flipped. A block holding an entry of no
+ * kind is left to scan_scalar, which finds where it is.
+ */
+SECID_KERNEL("sse2")
+static unsigned int
+scan_sse2(const comp_doc_secid_value_t *secids, unsigned int n, uint32_t limit, comp_doc_secid_counts_t *counts)
+{
+    __m128i bias, top, free_id, end_id, sat_id, msat_id, v, is_next, is_free, is_end, is_sat, is_msat;
+    __m128i count_next, count_free, count_end, count_sat, count_msat;
+    uint32_t lanes[5][4];
+    unsigned int i, k;
+
+    bias = _mm_set1_epi32(INT32_MIN);
+    top = _mm_set1_epi32((int32_t)(limit ^ 0x80000000U));
+    free_id = _mm_set1_epi32((int32_t)SECID_FREE);
+    end_id = _mm_set1_epi32((int32_t)SECID_END_OF_CHAIN);
+    sat_id = _mm_set1_epi32((int32_t)SECID_SAT);
+    msat_id = _mm_set1_epi32((int32_t)SECID_MSAT);
+    count_next = count_free = count_end = count_sat = count_msat = _mm_setzero_si128();
+
+    for(i = 0; i + 4 <= n; i += 4)
+    {
+        v = _mm_loadu_si128((const __m128i *)(secids + i));
+        is_next = _mm_cmplt_epi32(_mm_xor_si128(v, bias), top);
+        is_free = _mm_cmpeq_epi32(v, free_id);
+        is_end = _mm_cmpeq_epi32(v, end_id);
+        is_sat = _mm_cmpeq_epi32(v, sat_id);
+        is_msat = _mm_cmpeq_epi32(v, msat_id);
+
+        if(_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(is_next, is_free),
+            _mm_or_si128(_mm_or_si128(is_end, is_sat), is_msat))) != 0xFFFF)
+            break;
+
+        count_next = _mm_sub_epi32(count_next, is_next);
+        count_free = _mm_sub_epi32(count_free, is_free);
+        count_end = _mm_sub_epi32(count_end, is_end);
+        count_sat = _mm_sub_epi32(count_sat, is_sat);
+        count_msat = _mm_sub_epi32(count_msat, is_msat);
+    }
+
+    _mm_storeu_si128((__m128i *)lanes[0], count_next);
+    _mm_storeu_si128((__m128i *)lanes[1], count_free);
+    _mm_storeu_si128((__m128i *)lanes[2], count_end);
+    _mm_storeu_si128((__m128i *)lanes[3], count_sat);
+    _mm_storeu_si128((__m128i *)lanes[4], count_msat);
+
+    for(k = 0; k < 4; k++)
+    {
+        counts->next += lanes[0][k];
+        counts->free += lanes[1][k];
+        counts->end_of_chain += lanes[2][k];
+        counts->sat += lanes[3][k];
+        counts->msat += lanes[4][k];
+    }
+
+    return scan_scalar(secids, i, n, limit, counts);
+}
+
+SECID_KERNEL("avx2")
+static unsigned int
+scan_avx2(const comp_doc_secid_value_t *secids, unsigned int n, uint32_t limit, comp_doc_secid_counts_t *counts)
+{
+    __m256i bias, top, free_id, end_id, sat_id, msat_id, v, is_next, is_free, is_end, is_sat, is_msat;
+    __m256i count_next, count_free, count_end, count_sat, count_msat;
+    uint32_t lanes[5][8];
+    unsigned int i, k;
+
+    bias = _mm256_set1_epi32(INT32_MIN);
+    top = _mm256_set1_epi32((int32_t)(limit ^ 0x80000000U));
+    free_id = _mm256_set1_epi32((int32_t)SECID_FREE);
+    end_id = _mm256_set1_epi32((int32_t)SECID_END_OF_CHAIN);
+    sat_id = _mm256_set1_epi32((int32_t)SECID_SAT);
+    msat_id = _mm256_set1_epi32((int32_t)SECID_MSAT);
+    count_next = count_free = count_end = count_sat = count_msat = _mm256_setzero_si256();
+
+    for(i = 0; i + 8 <= n; i += 8)
+    {
+        v = _mm256_loadu_si256((const __m256i *)(secids + i));
+        is_next = _mm256_cmpgt_epi32(top, _mm256_xor_si256(v, bias));
+        is_free = _mm256_cmpeq_epi32(v, free_id);
+        is_end = _mm256_cmpeq_epi32(v, end_id);
+        is_sat = _mm256_cmpeq_epi32(v, sat_id);
+        is_msat = _mm256_cmpeq_epi32(v, msat_id);
+
+        if(_mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(is_next, is_free),
+            _mm256_or_si256(_mm256_or_si256(is_end, is_sat), is_msat))) != -1)
+            break;
+
+        count_next = _mm256_sub_epi32(count_next, is_next);
+        count_free = _mm256_sub_epi32(count_free, is_free);
+        count_end = _mm256_sub_epi32(count_end, is_end);
+        count_sat = _mm256_sub_epi32(count_sat, is_sat);
+        count_msat = _mm256_sub_epi32(count_msat, is_msat);
+    }
+
+    _mm256_storeu_si256((__m256i *)lanes[0], count_next);
+    _mm256_storeu_si256((__m256i *)lanes[1], count_free);
+    _mm256_storeu_si256((__m256i *)lanes[2], count_end);
+    _mm256_storeu_si256((__m256i *)lanes[3], count_sat);
+    _mm256_storeu_si256((__m256i *)lanes[4], count_msat);
+
+    for(k = 0; k < 8; k++)
+    {
+        counts->next += lanes[0][k];
+        counts->free += lanes[1][k];
+        counts->end_of_chain += lanes[2][k];
+        counts->sat += lanes[3][k];
+        counts->msat += lanes[4][k];
+    }
+
+    return scan_scalar(secids, i, n, limit, counts);
+}
+#endif
+
+/*
+ * Classifies the `n' entries of an allocation table into `counts'. Entries
+ * that refer to a sector must be below `limit'. Returns the index of the
+ * first entry that is neither one of those nor a special value, or `n'
+ * when there is none; the counts then only cover the entries before it.
+ */
+unsigned int
+scan_secids(const comp_doc_secid_value_t *secids, unsigned int n, uint32_t limit, comp_doc_secid_counts_t *counts)
+{
+    memset(counts, 0, sizeof(comp_doc_secid_counts_t));
+
+    // the special values are never references, whatever the size of the table
+    if(limit > SECID_MSAT)
+        limit = SECID_MSAT;
+
+#ifdef SECID_X86
+    if(__builtin_cpu_supports("avx2"))
+        return scan_avx2(secids, n, limit, counts);
+
+    if(__builtin_cpu_supports("sse2"))
+        return scan_sse2(secids, n, limit, counts);
+#endif
+
+    return scan_scalar(secids, 0, n, limit, counts);
+}
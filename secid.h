@@ -0,0 +1,19 @@
+#ifndef _COMP_DOC_SECID_H_
+#define _COMP_DOC_SECID_H_
+#include "compdoc.h"
+
+/*
+ * How the entries of an allocation table are spread among the special
+ * values, filled by scan_secids. `next' counts the entries that refer to
+ * another sector.
+ */
+typedef struct {
+    unsigned int free;
+    unsigned int end_of_chain;
+    unsigned int sat;
+    unsigned int msat;
+    unsigned int next;
+} comp_doc_secid_counts_t;
+
+unsigned int scan_secids(const comp_doc_secid_value_t *, unsigned int, uint32_t, comp_doc_secid_counts_t *);
+#endif /* _COMP_DOC_SECID_H_ */
@@ -0,0 +1,232 @@
+#include "verify.h"
+#include <string.h>
+
+typedef struct {
+    comp_doc_file_t *file;
+    comp_doc_verify_report_t *report;
+    /* sectors and short sectors reached so far, one bit each */
+    uint64_t *sectors;
+    uint64_t *short_sectors;
+} verify_t;
+
+#define BIT_WORDS(n) (((size_t)(n) + 63) / 64)
+#define TEST_BIT(bitmap, i) ((bitmap)[(i) / 64] & ((uint64_t)1 << ((i) % 64)))
+#define SET_BIT(bitmap, i) ((bitmap)[(i) / 64] |= (uint64_t)1 << ((i) % 64))
+
+/*
+ * Returns non zero when `secid' is one of the first `n' sectors of the
+ * chain that starts at `start'. Only called once a chain reaches a sector
+ * seen before, and those `n' sectors were all new, so the walks that
+ * follow problems add up to no more than the size of the table.
+ */
+static int
+in_chain(comp_doc_sat_t *table, uint32_t start, uint32_t n, uint32_t secid)
+{
+    for(; n > 0; n--)
+    {
+        if(start == secid)
+            return 1;
+
+        start = table->secids[start];
+    }
+
+    return 0;
+}
+
+/*
+ * Follows the chain that starts at `secid', marking its sectors in
+ * `bitmap'. Sectors must be below `limit'. The chain is expected to be
+ * `expected' sectors long, unless `expected' is 0. Every sector is visited
+ * once, so verifying every chain of the file is linear in its size.
+ */
+static void
+verify_chain(verify_t *v, comp_doc_sat_t *table, uint64_t *bitmap, uint32_t limit,
+    uint32_t secid, uint64_t expected)
+{
+    uint32_t start, n;
+
+    start = secid;
+
+    for(n = 0; secid < SECID_MSAT; n++)
+    {
+        if(secid >= limit)
+        {
+            v->report->broken_chains++;
+            return;
+        }
+
+        if(TEST_BIT(bitmap, secid))
+        {
+            if(in_chain(table, start, n, secid))
+                v->report->cycles++;
+            else
+                v->report->cross_links++;
+
+            return;
+        }
+
+        SET_BIT(bitmap, secid);
+        secid = table->secids[secid];
+    }
+
+    if(secid != SECID_END_OF_CHAIN)
+        v->report->broken_chains++;
+    else if(expected > 0 && n != expected)
+        v->report->size_mismatches++;
+}
+
+/*
+ * Marks the sectors of the MSAT, chained by their last slot, and the SAT
+ * sectors they list.
+ */
+static int
+verify_msat(verify_t *v)
+{
+    comp_doc_file_t *file = v->file;
+    comp_doc_header_t *hdr = file->hdr;
+    uint32_t sector_size, secid, i;
+
+    sector_size = CALC_SECTOR_SIZE(hdr->ssz);
+    secid = hdr->msat_first_sector;
+
+    for(i = 0; i < hdr->nmsat_sectors; i++)
+    {
+        if(secid >= file->sat->slots)
+        {
+            v->report->broken_chains++;
+            break;
+        }
+
+        // nothing else has been marked yet
+        if(TEST_BIT(v->sectors, secid))
+        {
+            v->report->cycles++;
+            break;
+        }
+
+        SET_BIT(v->sectors, secid);
+
+        if(read_position(file, sector_position(hdr, secid) + sector_size - 4, &secid, 4) < 0)
+            return COMP_DOC_READ_ERR;
+    }
+
+    for(i = 0; i < file->msat->slots; i++)
+    {
+        if(file->msat->secids[i] >= file->sat->slots)
+            v->report->broken_chains++;
+        else if(TEST_BIT(v->sectors, file->msat->secids[i]))
+            v->report->cross_links++;
+        else
+            SET_BIT(v->sectors, file->msat->secids[i]);
+    }
+
+    return COMP_DOC_SUCCESS;
+}
+
+/*
+ * Walks every chain of the file once, with a bitmap of the sectors reached
+ * so far: the MSAT and the SAT sectors, the directory, the SSAT, the
+ * short-stream container and the stream of every entry that can be reached
+ * from the root. Sectors in use that no chain reaches are counted last.
+ * Fills `report', which may be NULL, and returns COMP_DOC_CORRUPT if some
+ * chain is wrong. Orphaned sectors are only reported: they waste space but
+ * do not keep the streams from being read.
+ */
+int
+comp_doc_verify(comp_doc_file_t *file, comp_doc_verify_report_t *ret_report)
+{
+    comp_doc_verify_report_t report;
+    comp_doc_header_t *hdr;
+    comp_doc_sat_t *sat, *ssat;
+    comp_doc_directory_t *root, *dir;
+    comp_doc_dir_iter_t it;
+    uint32_t sector_size, short_size, container, i;
+    verify_t v;
+    int err;
+
+    memset(&report, 0, sizeof(report));
+    memset(&v, 0, sizeof(v));
+
+    if((err = load_tables(file, COMP_DOC_LOADED_ALL)) != COMP_DOC_SUCCESS)
+        goto _error;
+
+    hdr = file->hdr;
+    sat = file->sat;
+    ssat = file->ssat;
+    root = file->ndirs > 0 ? file->dirs : NULL;
+    sector_size = CALC_SECTOR_SIZE(hdr->ssz);
+    short_size = CALC_SHORT_SECTOR_SIZE(hdr->sssz);
+
+    v.file = file;
+    v.report = &report;
+    v.sectors = doc_calloc(file, BIT_WORDS(sat->slots), sizeof(uint64_t));
+    v.short_sectors = doc_calloc(file, BIT_WORDS(ssat != NULL ? ssat->slots : 0) + 1, sizeof(uint64_t));
+
+    if(v.sectors == NULL || v.short_sectors == NULL)
+    {
+        err = COMP_DOC_NO_MEM;
+        goto _error;
+    }
+
+    if((err = verify_msat(&v)) != COMP_DOC_SUCCESS)
+        goto _error;
+
+    // only version 4 headers hold the length of the directory
+    verify_chain(&v, sat, v.sectors, sat->slots, hdr->first_dir_sector, hdr->version >= 4 ? hdr->ndir_sectors : 0);
+
+    if(ssat != NULL)
+        verify_chain(&v, sat, v.sectors, sat->slots, hdr->first_ssat_sector, hdr->nssat_sectors);
+
+    container = 0;
+
+    if(root != NULL && root->size > 0)
+    {
+        verify_chain(&v, sat, v.sectors, sat->slots, root->first_sector, (root->size + sector_size - 1) / sector_size);
+        container = file->nministream * (sector_size / short_size);
+    }
+
+    if(root != NULL && (err = comp_doc_iter_init(file, root, COMP_DOC_ITER_RECURSIVE, &it)) != COMP_DOC_SUCCESS)
+        goto _error;
+
+    while(root != NULL && (dir = comp_doc_iter_next(&it)) != NULL)
+    {
+        // empty streams may hold anything as their first sector
+        if(!IS_DIR_STREAM(dir) || dir->size == 0)
+            continue;
+
+        if(dir->size >= hdr->stream_min_size)
+            verify_chain(&v, sat, v.sectors, sat->slots, dir->first_sector, (dir->size + sector_size - 1) / sector_size);
+        else if(ssat != NULL)
+            verify_chain(&v, ssat, v.short_sectors, container < ssat->slots ? container : ssat->slots,
+                dir->first_sector, (dir->size + short_size - 1) / short_size);
+        else
+            report.broken_chains++;
+    }
+
+    if(root != NULL && (err = it.err) != COMP_DOC_SUCCESS)
+        goto _error;
+
+    for(i = 0; i < sat->slots; i++)
+    {
+        if(sat->secids[i] != SECID_FREE && !TEST_BIT(v.sectors, i))
+            report.orphans++;
+    }
+
+    for(i = 0; ssat != NULL && i < ssat->slots; i++)
+    {
+        if(ssat->secids[i] != SECID_FREE && !TEST_BIT(v.short_sectors, i))
+            report.short_orphans++;
+    }
+
+    if(report.cycles || report.cross_links || report.broken_chains || report.size_mismatches)
+        err = COMP_DOC_CORRUPT;
+
+_error:
+    doc_free(file, v.sectors);
+    doc_free(file, v.short_sectors);
+
+    if(ret_report != NULL)
+        *ret_report = report;
+
+    return err;
+}
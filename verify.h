@@ -0,0 +1,25 @@
+#ifndef _COMP_DOC_VERIFY_H_
+#define _COMP_DOC_VERIFY_H_
+#include "compdoc.h"
+#include "parse.h"
+
+/*
+ * Problems found by comp_doc_verify. A chain is counted once, under the
+ * first problem found while following it.
+ */
+typedef struct {
+    /* chains that come back to one of their own sectors */
+    unsigned int cycles;
+    /* chains that run into a sector of another chain */
+    unsigned int cross_links;
+    /* chains that reach a free sector, a special value or a sector that does not exist */
+    unsigned int broken_chains;
+    /* chains whose length does not match the size of their stream or table */
+    unsigned int size_mismatches;
+    /* sectors in use that no chain reaches, and the same for short sectors */
+    unsigned int orphans;
+    unsigned int short_orphans;
+} comp_doc_verify_report_t;
+
+int comp_doc_verify(comp_doc_file_t *, comp_doc_verify_report_t *);
+#endif /* _COMP_DOC_VERIFY_H_ */
@@ -0,0 +1,1409 @@
+#include "write.h"
+#include "cache.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/*
+ * Changes made by one call. The tables and the directory are changed in
+ * memory as the call goes, and only the sectors that hold changed entries
+ * are written back once it is done.
+ */
+typedef struct {
+    comp_doc_file_t *file;
+    uint32_t sector_size;
+    /* one flag per sector of the SAT, of the SSAT and of the directory */
+    uint8_t *sat_dirty;
+    unsigned int nsat_dirty;
+    uint8_t *ssat_dirty;
+    unsigned int nssat_dirty;
+    uint8_t *dir_dirty;
+    unsigned int ndir_dirty;
+    /* first MSAT sector to be written, -1 for none */
+    int msat_dirty;
+    int header_dirty;
+    /* SecIDs of the MSAT sectors in chain order, read the first time they are needed */
+    uint32_t *msat_sectors;
+    int msat_loaded;
+    /* every slot below these is known to be in use */
+    uint32_t sat_hint;
+    uint32_t ssat_hint;
+    /* end of the last sector allocated */
+    off_t end;
+} write_txn_t;
+
+static int alloc_sector(write_txn_t *, uint32_t *);
+
+static int
+check_writable(comp_doc_file_t *file)
+{
+    // the tables of a mapped file are used in place, and cannot change
+    if(file->perm == COMP_DOC_PERM_READ || file->map != NULL)
+        return COMP_DOC_READ_ONLY;
+
+    return load_tables(file, COMP_DOC_LOADED_ALL);
+}
+
+static void
+txn_init(write_txn_t *txn, comp_doc_file_t *file)
+{
+    memset(txn, 0, sizeof(write_txn_t));
+    txn->file = file;
+    txn->sector_size = CALC_SECTOR_SIZE(file->hdr->ssz);
+    txn->msat_dirty = -1;
+}
+
+static void
+txn_free(write_txn_t *txn)
+{
+    // whatever was written, the cached sectors may be stale
+    cache_clear(txn->file);
+    doc_free(txn->file, txn->sat_dirty);
+    doc_free(txn->file, txn->ssat_dirty);
+    doc_free(txn->file, txn->dir_dirty);
+    doc_free(txn->file, txn->msat_sectors);
+}
+
+static int
+mark_dirty(write_txn_t *txn, uint8_t **flags, unsigned int *nflags, unsigned int index)
+{
+    uint8_t *p;
+    unsigned int n;
+
+    if(index >= *nflags)
+    {
+        n = index + 64;
+        p = doc_realloc(txn->file, *flags, n);
+
+        if(p == NULL)
+            return COMP_DOC_NO_MEM;
+
+        memset(p + *nflags, 0, n - *nflags);
+        *flags = p;
+        *nflags = n;
+    }
+
+    (*flags)[index] = 1;
+
+    return COMP_DOC_SUCCESS;
+}
+
+static int
+mark_dir(write_txn_t *txn, uint32_t dirid)
+{
+    return mark_dirty(txn, &txn->dir_dirty, &txn->ndir_dirty, dirid / (txn->sector_size / COMP_DOC_DIRECTORY_SZ));
+}
+
+static void
+mark_msat(write_txn_t *txn, int sector)
+{
+    if(txn->msat_dirty < 0 || sector < txn->msat_dirty)
+        txn->msat_dirty = sector;
+}
+
+/*
+ * Sets the entry `secid' of the SAT, or of the SSAT when `short_table'
+ * is set, and marks the sector that holds it.
+ */
+static int
+set_secid(write_txn_t *txn, int short_table, uint32_t secid, uint32_t value)
+{
+    comp_doc_sat_t *table = short_table ? txn->file->ssat : txn->file->sat;
+    unsigned int index = secid / (txn->sector_size / 4);
+
+    if(table->secids[secid] == value)
+        return COMP_DOC_SUCCESS;
+
+    if(table->secids[secid] == SECID_FREE)
+        table->nfree--;
+    else if(value == SECID_FREE)
+        table->nfree++;
+
+    table->secids[secid] = value;
+
+    if(short_table)
+        return mark_dirty(txn, &txn->ssat_dirty, &txn->nssat_dirty, index);
+
+    return mark_dirty(txn, &txn->sat_dirty, &txn->nsat_dirty, index);
+}
+
+/*
+ * Returns in `ret' the `n'-th sector of the chain that starts at `secid'.
+ */
+static int
+chain_nth(comp_doc_sat_t *table, uint32_t secid, uint32_t n, uint32_t *ret)
+{
+    uint32_t i;
+
+    for(i = 0; i < n; i++)
+    {
+        if(table == NULL || secid >= table->slots)
+            return COMP_DOC_INVALID_SAT;
+
+        secid = table->secids[secid];
+    }
+
+    if(table == NULL || secid >= table->slots)
+        return COMP_DOC_INVALID_SAT;
+
+    *ret = secid;
+
+    return COMP_DOC_SUCCESS;
+}
+
+/*
+ * Reads the list of the MSAT sectors, which are chained by their last slot
+ * rather than by the SAT.
+ */
+static int
+load_msat_sectors(write_txn_t *txn)
+{
+    comp_doc_file_t *file = txn->file;
+    comp_doc_header_t *hdr = file->hdr;
+    uint32_t i, secid;
+
+    if(txn->msat_loaded)
+        return COMP_DOC_SUCCESS;
+
+    txn->msat_sectors = doc_malloc(file, (hdr->nmsat_sectors + 1) * sizeof(uint32_t));
+
+    if(txn->msat_sectors == NULL)
+        return COMP_DOC_NO_MEM;
+
+    secid = hdr->msat_first_sector;
+
+    for(i = 0; i < hdr->nmsat_sectors; i++)
+    {
+        if(secid >= file->sat->slots)
+            return COMP_DOC_INVALID_MSAT;
+
+        txn->msat_sectors[i] = secid;
+
+        if(read_position(file, sector_position(hdr, secid) + txn->sector_size - 4, &secid, 4) < 0)
+            return COMP_DOC_READ_ERR;
+    }
+
+    txn->msat_loaded = 1;
+
+    return COMP_DOC_SUCCESS;
+}
+
+/*
+ * Adds a sector to the MSAT chain, once the header and the MSAT sectors
+ * have no room left for the SecID of another SAT sector.
+ */
+static int
+grow_msat(write_txn_t *txn)
+{
+    comp_doc_file_t *file = txn->file;
+    comp_doc_header_t *hdr = file->hdr;
+    uint32_t *list, secid;
+    int err;
+
+    if((err = load_msat_sectors(txn)) != COMP_DOC_SUCCESS)
+        return err;
+
+    list = doc_realloc(file, txn->msat_sectors, (hdr->nmsat_sectors + 1) * sizeof(uint32_t));
+
+    if(list == NULL)
+        return COMP_DOC_NO_MEM;
+
+    txn->msat_sectors = list;
+
+    if((err = alloc_sector(txn, &secid)) != COMP_DOC_SUCCESS
+        || (err = set_secid(txn, 0, secid, SECID_MSAT)) != COMP_DOC_SUCCESS)
+        return err;
+
+    // the last sector of the chain now points at the new one
+    if(hdr->nmsat_sectors == 0)
+        hdr->msat_first_sector = secid;
+    else
+        mark_msat(txn, hdr->nmsat_sectors - 1);
+
+    list[hdr->nmsat_sectors] = secid;
+    mark_msat(txn, hdr->nmsat_sectors);
+    hdr->nmsat_sectors++;
+    txn->header_dirty = 1;
+
+    return COMP_DOC_SUCCESS;
+}
+
+/*
+ * Adds a sector to the SAT. The new sector is the first of the sectors it
+ * describes, which are free until now.
+ */
+static int
+grow_sat(write_txn_t *txn)
+{
+    comp_doc_file_t *file = txn->file;
+    comp_doc_sat_t *sat = file->sat;
+    comp_doc_msat_t *msat = file->msat;
+    uint32_t per = txn->sector_size / 4;
+    comp_doc_secid_value_t *secids;
+    uint32_t *msat_secids, secid, i;
+    int err;
+
+    secids = doc_realloc(file, sat->secids, (sat->slots + per) * sizeof(comp_doc_secid_value_t));
+
+    if(secids == NULL)
+        return COMP_DOC_NO_MEM;
+
+    for(i = 0; i < per; i++)
+        secids[sat->slots + i] = SECID_FREE;
+
+    sat->secids = secids;
+    secid = sat->slots;
+    sat->slots += per;
+    sat->nfree += per;
+
+    if((err = set_secid(txn, 0, secid, SECID_SAT)) != COMP_DOC_SUCCESS)
+        return err;
+
+    msat_secids = doc_realloc(file, msat->secids, (msat->slots + 1) * sizeof(uint32_t));
+
+    if(msat_secids == NULL)
+        return COMP_DOC_NO_MEM;
+
+    msat->secids = msat_secids;
+    msat->secids[msat->slots] = secid;
+
+    if(msat->slots < COMP_DOC_HEADER_MSAT_SLOTS)
+        txn->header_dirty = 1;
+    else
+        mark_msat(txn, (msat->slots - COMP_DOC_HEADER_MSAT_SLOTS) / (per - 1));
+
+    msat->slots++;
+    file->hdr->nsat_sectors++;
+    txn->header_dirty = 1;
+
+    if(msat->slots > COMP_DOC_HEADER_MSAT_SLOTS + (per - 1) * file->hdr->nmsat_sectors)
+        return grow_msat(txn);
+
+    return COMP_DOC_SUCCESS;
+}
+
+/*
+ * Finds a free sector, the lowest one first so that chains allocated in
+ * one go end up contiguous. The SAT grows when it has none left, so the
+ * file only grows once the sectors freed so far have been reused.
+ */
+static int
+alloc_sector(write_txn_t *txn, uint32_t *ret)
+{
+    comp_doc_sat_t *sat = txn->file->sat;
+    uint32_t i;
+    int err;
+
+    for(;;)
+    {
+        // a full table is not searched
+        for(i = sat->nfree > 0 ? txn->sat_hint : sat->slots; i < sat->slots; i++)
+        {
+            if(sat->secids[i] == SECID_FREE)
+            {
+                if(sector_position(txn->file->hdr, i) + txn->sector_size > txn->end)
+                    txn->end = sector_position(txn->file->hdr, i) + txn->sector_size;
+
+                txn->sat_hint = i + 1;
+                *ret = i;
+                return COMP_DOC_SUCCESS;
+            }
+        }
+
+        txn->sat_hint = sat->slots;
+
+        if((err = grow_sat(txn)) != COMP_DOC_SUCCESS)
+            return err;
+    }
+}
+
+/*
+ * Adds a sector to the SSAT chain, creating the SSAT of a file that had no
+ * short streams.
+ */
+static int
+grow_ssat(write_txn_t *txn)
+{
+    comp_doc_file_t *file = txn->file;
+    comp_doc_header_t *hdr = file->hdr;
+    comp_doc_ssat_t *ssat;
+    comp_doc_secid_value_t *secids;
+    uint32_t per = txn->sector_size / 4;
+    uint32_t secid, last, index, i;
+    int err;
+
+    if(file->ssat == NULL)
+    {
+        if((file->ssat = doc_calloc(file, 1, sizeof(comp_doc_ssat_t))) == NULL)
+            return COMP_DOC_NO_MEM;
+
+        // the map of the container is only built for files with an SSAT
+        doc_free(file, file->ministream);
+
+        if((err = parse_ministream(file, &file->ministream, &file->nministream)) != COMP_DOC_SUCCESS)
+            return err;
+    }
+
+    ssat = file->ssat;
+    index = ssat->slots / per;
+
+    if((err = alloc_sector(txn, &secid)) != COMP_DOC_SUCCESS
+        || (err = set_secid(txn, 0, secid, SECID_END_OF_CHAIN)) != COMP_DOC_SUCCESS)
+        return err;
+
+    if(index == 0)
+        hdr->first_ssat_sector = secid;
+    else if((err = chain_nth(file->sat, hdr->first_ssat_sector, index - 1, &last)) != COMP_DOC_SUCCESS
+        || (err = set_secid(txn, 0, last, secid)) != COMP_DOC_SUCCESS)
+        return err;
+
+    secids = doc_realloc(file, ssat->secids, (ssat->slots + per) * sizeof(comp_doc_secid_value_t));
+
+    if(secids == NULL)
+        return COMP_DOC_NO_MEM;
+
+    for(i = 0; i < per; i++)
+        secids[ssat->slots + i] = SECID_FREE;
+
+    ssat->secids = secids;
+    ssat->slots += per;
+    ssat->nfree += per;
+    hdr->nssat_sectors = index + 1;
+    txn->header_dirty = 1;
+
+    return mark_dirty(txn, &txn->ssat_dirty, &txn->nssat_dirty, index);
+}
+
+/*
+ * Adds a sector to the short-stream container, the chain of the root entry.
+ */
+static int
+grow_container(write_txn_t *txn)
+{
+    comp_doc_file_t *file = txn->file;
+    comp_doc_directory_t *root = &file->dirs[0];
+    uint32_t *ministream, secid;
+    int err;
+
+    if((err = alloc_sector(txn, &secid)) != COMP_DOC_SUCCESS
+        || (err = set_secid(txn, 0, secid, SECID_END_OF_CHAIN)) != COMP_DOC_SUCCESS)
+        return err;
+
+    if(file->nministream == 0)
+        root->first_sector = secid;
+    else if((err = set_secid(txn, 0, file->ministream[file->nministream - 1], secid)) != COMP_DOC_SUCCESS)
+        return err;
+
+    ministream = doc_realloc(file, file->ministream, (file->nministream + 1) * sizeof(uint32_t));
+
+    if(ministream == NULL)
+        return COMP_DOC_NO_MEM;
+
+    ministream[file->nministream++] = secid;
+    file->ministream = ministream;
+    root->size = file->nministream * txn->sector_size;
+
+    return mark_dir(txn, 0);
+}
+
+/*
+ * Finds a free short sector, growing the SSAT and the container as needed.
+ */
+static int
+alloc_short_sector(write_txn_t *txn, uint32_t *ret)
+{
+    comp_doc_file_t *file = txn->file;
+    uint32_t i, per_sector;
+    int err;
+
+    per_sector = txn->sector_size / CALC_SHORT_SECTOR_SIZE(file->hdr->sssz);
+
+    for(;;)
+    {
+        // a full table is not searched
+        if(file->ssat != NULL && file->ssat->nfree > 0)
+        {
+            for(i = txn->ssat_hint; i < file->ssat->slots; i++)
+            {
+                if(file->ssat->secids[i] == SECID_FREE)
+                    break;
+            }
+
+            if(i < file->ssat->slots)
+                break;
+        }
+
+        if((err = grow_ssat(txn)) != COMP_DOC_SUCCESS)
+            return err;
+    }
+
+    txn->ssat_hint = i + 1;
+
+    // the container must reach the new short sector
+    while(i >= file->nministream * per_sector)
+    {
+        if((err = grow_container(txn)) != COMP_DOC_SUCCESS)
+            return err;
+    }
+
+    *ret = i;
+
+    return COMP_DOC_SUCCESS;
+}
+
+/*
+ * Appends `n' new sectors to the chain that ends at `last', or starts a new
+ * chain when `last' is SECID_END_OF_CHAIN. `first' receives the first of them.
+ */
+static int
+extend_chain(write_txn_t *txn, int short_table, uint32_t last, uint32_t n, uint32_t *first)
+{
+    uint32_t i, secid;
+    int err;
+
+    for(i = 0; i < n; i++)
+    {
+        err = short_table ? alloc_short_sector(txn, &secid) : alloc_sector(txn, &secid);
+
+        if(err != COMP_DOC_SUCCESS
+            || (err = set_secid(txn, short_table, secid, SECID_END_OF_CHAIN)) != COMP_DOC_SUCCESS)
+            return err;
+
+        if(last != SECID_END_OF_CHAIN && (err = set_secid(txn, short_table, last, secid)) != COMP_DOC_SUCCESS)
+            return err;
+
+        if(i == 0)
+            *first = secid;
+
+        last = secid;
+    }
+
+    return COMP_DOC_SUCCESS;
+}
+
+/*
+ * Frees the sectors of the chain that starts at `secid'.
+ */
+static int
+free_chain(write_txn_t *txn, int short_table, uint32_t secid)
+{
+    comp_doc_sat_t *table = short_table ? txn->file->ssat : txn->file->sat;
+    uint32_t next, steps;
+    int err;
+
+    for(steps = 0; table != NULL && secid < table->slots && steps < table->slots; steps++)
+    {
+        next = table->secids[secid];
+
+        // never free the sectors of the tables, whatever a broken chain says
+        if(next == SECID_FREE || next == SECID_SAT || next == SECID_MSAT)
+            break;
+
+        if((err = set_secid(txn, short_table, secid, SECID_FREE)) != COMP_DOC_SUCCESS)
+            return err;
+
+        if(short_table && secid < txn->ssat_hint)
+            txn->ssat_hint = secid;
+        else if(!short_table && secid < txn->sat_hint)
+            txn->sat_hint = secid;
+
+        secid = next;
+    }
+
+    return COMP_DOC_SUCCESS;
+}
+
+/*
+ * Cuts or extends the chain that starts at `first' from `old_n' to `new_n'
+ * sectors. The sectors kept stay where they are. `ret_first' receives the
+ * first sector of the chain, SECID_END_OF_CHAIN when it is empty.
+ */
+static int
+resize_chain(write_txn_t *txn, int short_table, uint32_t first, uint32_t old_n, uint32_t new_n, uint32_t *ret_first)
+{
+    comp_doc_sat_t *table = short_table ? txn->file->ssat : txn->file->sat;
+    uint32_t last, next;
+    int err;
+
+    *ret_first = old_n ? first : SECID_END_OF_CHAIN;
+
+    if(new_n == 0)
+    {
+        *ret_first = SECID_END_OF_CHAIN;
+        return old_n ? free_chain(txn, short_table, first) : COMP_DOC_SUCCESS;
+    }
+
+    if(new_n <= old_n)
+    {
+        if((err = chain_nth(table, first, new_n - 1, &last)) != COMP_DOC_SUCCESS)
+            return err;
+
+        next = table->secids[last];
+
+        if((err = set_secid(txn, short_table, last, SECID_END_OF_CHAIN)) != COMP_DOC_SUCCESS)
+            return err;
+
+        return new_n < old_n ? free_chain(txn, short_table, next) : COMP_DOC_SUCCESS;
+    }
+
+    last = SECID_END_OF_CHAIN;
+
+    if(old_n > 0 && (err = chain_nth(table, first, old_n - 1, &last)) != COMP_DOC_SUCCESS)
+        return err;
+
+    if((err = extend_chain(txn, short_table, last, new_n - old_n, &next)) != COMP_DOC_SUCCESS)
+        return err;
+
+    if(old_n == 0)
+        *ret_first = next;
+
+    return COMP_DOC_SUCCESS;
+}
+
+/*
+ * Writes `size' bytes of `data' to a chain, starting `offset' bytes into
+ * the sector `secid'. Sectors that follow each other in the file are written
+ * at once. A NULL `data' writes zeros.
+ */
+static int
+write_chain(write_txn_t *txn, int short_table, uint32_t secid, uint32_t offset, const unsigned char *data, size_t size)
+{
+    comp_doc_file_t *file = txn->file;
+    comp_doc_sat_t *table = short_table ? file->ssat : file->sat;
+    uint32_t sector_size;
+    size_t total, count, run_length;
+    const unsigned char *run_data;
+    unsigned char *zeros;
+    off_t position, run_start;
+    int err;
+
+    sector_size = short_table ? (uint32_t)CALC_SHORT_SECTOR_SIZE(file->hdr->sssz) : txn->sector_size;
+    zeros = NULL;
+    run_data = NULL;
+    run_start = 0;
+    run_length = 0;
+    err = COMP_DOC_SUCCESS;
+
+    if(data == NULL && (zeros = doc_calloc(file, 1, sector_size)) == NULL)
+        return COMP_DOC_NO_MEM;
+
+    for(total = 0; total < size; total += count)
+    {
+        if(table == NULL || secid >= table->slots || (position = chain_position(file, table, secid)) < 0)
+        {
+            err = COMP_DOC_INVALID_SAT;
+            goto _error;
+        }
+
+        position += offset;
+        count = sector_size - offset < size - total ? sector_size - offset : size - total;
+
+        if(data != NULL && run_length > 0 && position == run_start + (off_t)run_length)
+        {
+            run_length += count;
+        }
+        else
+        {
+            if(run_length > 0 && write_position(file, run_start, run_data, run_length) < 0)
+            {
+                err = COMP_DOC_WRITE_ERR;
+                goto _error;
+            }
+
+            run_start = position;
+            run_data = data != NULL ? data + total : zeros;
+            run_length = count;
+        }
+
+        offset += count;
+
+        if(offset == sector_size)
+        {
+            secid = table->secids[secid];
+            offset = 0;
+        }
+    }
+
+    if(run_length > 0 && write_position(file, run_start, run_data, run_length) < 0)
+        err = COMP_DOC_WRITE_ERR;
+
+_error:
+    doc_free(file, zeros);
+
+    return err;
+}
+
+#define IS_RED(file, dirid) ((dirid) != COMP_DOC_DIRECTORY_NO_NODE \
+    && (file)->dirs[dirid].colour == COMP_DOC_DIRECTORY_RED)
+
+static void
+mark_entry(write_txn_t *txn, uint32_t dirid, int *err)
+{
+    if(mark_dir(txn, dirid) != COMP_DOC_SUCCESS)
+        *err = COMP_DOC_NO_MEM;
+}
+
+static void
+set_colour(write_txn_t *txn, uint32_t dirid, uint8_t colour, int *err)
+{
+    if(txn->file->dirs[dirid].colour == colour)
+        return;
+
+    txn->file->dirs[dirid].colour = colour;
+    mark_entry(txn, dirid, err);
+}
+
+/*
+ * Points the field that points at `child' at `value' instead: the root of
+ * the tree when `parent' is the storage itself, or else one of the links
+ * of `parent'.
+ */
+static void
+replace_child(comp_doc_file_t *file, uint32_t storage_id, uint32_t parent, uint32_t child, uint32_t value)
+{
+    comp_doc_directory_t *dir = &file->dirs[parent];
+
+    if(parent == storage_id)
+        dir->root_dirid = value;
+    else if(dir->left_child_dirid == child)
+        dir->left_child_dirid = value;
+    else
+        dir->right_child_dirid = value;
+}
+
+/*
+ * Rotates the subtree of `dirid', whose link is held by `parent', to the
+ * left or to the right. Returns the entry that takes its place.
+ */
+static uint32_t
+rotate(write_txn_t *txn, uint32_t storage_id, uint32_t parent, uint32_t dirid, int left, int *err)
+{
+    comp_doc_directory_t *dirs = txn->file->dirs;
+    uint32_t child;
+
+    if(left)
+    {
+        child = dirs[dirid].right_child_dirid;
+        dirs[dirid].right_child_dirid = dirs[child].left_child_dirid;
+        dirs[child].left_child_dirid = dirid;
+    }
+    else
+    {
+        child = dirs[dirid].left_child_dirid;
+        dirs[dirid].left_child_dirid = dirs[child].right_child_dirid;
+        dirs[child].right_child_dirid = dirid;
+    }
+
+    replace_child(txn->file, storage_id, parent, dirid, child);
+    mark_entry(txn, parent, err);
+    mark_entry(txn, dirid, err);
+    mark_entry(txn, child, err);
+
+    return child;
+}
+
+/*
+ * Inserts the entry `dirid' in the tree of the children of a storage and
+ * restores the red-black rules on the way back up. The path from the root
+ * is kept in `path', whose first slot is the storage, as the entries hold
+ * no link to their parent. Only O(log n) entries change, and only their
+ * directory sectors are written back.
+ */
+static int
+tree_insert(write_txn_t *txn, uint32_t storage_id, uint32_t dirid)
+{
+    comp_doc_file_t *file = txn->file;
+    comp_doc_directory_t *dirs = file->dirs;
+    uint32_t *path, id, uncle;
+    unsigned int k, p, g;
+    int left, err;
+
+    path = doc_malloc(file, (file->ndirs + 2) * sizeof(uint32_t));
+
+    if(path == NULL)
+        return COMP_DOC_NO_MEM;
+
+    err = COMP_DOC_SUCCESS;
+    path[0] = storage_id;
+    id = dirs[storage_id].root_dirid;
+
+    for(k = 1; id != COMP_DOC_DIRECTORY_NO_NODE; k++)
+    {
+        // a corrupted tree may loop, no valid path is longer than the directory
+        if(id >= file->ndirs || k >= file->ndirs)
+        {
+            err = COMP_DOC_CORRUPT;
+            goto _error;
+        }
+
+        path[k] = id;
+        id = compare_entries(&dirs[dirid], &dirs[id]) < 0 ? dirs[id].left_child_dirid : dirs[id].right_child_dirid;
+    }
+
+    if(k == 1)
+        dirs[storage_id].root_dirid = dirid;
+    else if(compare_entries(&dirs[dirid], &dirs[path[k - 1]]) < 0)
+        dirs[path[k - 1]].left_child_dirid = dirid;
+    else
+        dirs[path[k - 1]].right_child_dirid = dirid;
+
+    path[k] = dirid;
+    dirs[dirid].colour = COMP_DOC_DIRECTORY_RED;
+    mark_entry(txn, path[k - 1], &err);
+    mark_entry(txn, dirid, &err);
+
+    // path[k] is red, and so may be its parent, which is not the root
+    while(k >= 3 && IS_RED(file, path[k - 1]))
+    {
+        p = k - 1;
+        g = k - 2;
+        left = dirs[path[g]].left_child_dirid == path[p];
+        uncle = left ? dirs[path[g]].right_child_dirid : dirs[path[g]].left_child_dirid;
+
+        if(IS_RED(file, uncle))
+        {
+            set_colour(txn, path[p], COMP_DOC_DIRECTORY_BLACK, &err);
+            set_colour(txn, uncle, COMP_DOC_DIRECTORY_BLACK, &err);
+            set_colour(txn, path[g], COMP_DOC_DIRECTORY_RED, &err);
+            k = g;
+            continue;
+        }
+
+        // an inner child is turned into an outer one first
+        if(path[k] == (left ? dirs[path[p]].right_child_dirid : dirs[path[p]].left_child_dirid))
+            path[p] = rotate(txn, storage_id, path[g], path[p], left, &err);
+
+        set_colour(txn, path[p], COMP_DOC_DIRECTORY_BLACK, &err);
+        set_colour(txn, path[g], COMP_DOC_DIRECTORY_RED, &err);
+        rotate(txn, storage_id, path[g - 1], path[g], !left, &err);
+        break;
+    }
+
+    set_colour(txn, dirs[storage_id].root_dirid, COMP_DOC_DIRECTORY_BLACK, &err);
+
+_error:
+    doc_free(file, path);
+
+    return err;
+}
+
+/*
+ * Removes the entry `dirid' from the tree of the children of a storage, the
+ * counterpart of tree_insert. An entry with two children trades places with
+ * the next one in order, which has at most one.
+ */
+static int
+tree_remove(write_txn_t *txn, uint32_t storage_id, uint32_t dirid)
+{
+    comp_doc_file_t *file = txn->file;
+    comp_doc_directory_t *dirs = file->dirs;
+    uint32_t *path, id, next, child, parent, sibling;
+    unsigned int k, z;
+    uint8_t colour;
+    int left, err;
+
+    path = doc_malloc(file, (file->ndirs + 2) * sizeof(uint32_t));
+
+    if(path == NULL)
+        return COMP_DOC_NO_MEM;
+
+    err = COMP_DOC_SUCCESS;
+    path[0] = storage_id;
+    id = dirs[storage_id].root_dirid;
+
+    // the entry must be found the way lookups find it
+    for(z = 1; id != dirid; z++)
+    {
+        if(id >= file->ndirs || z >= file->ndirs)
+        {
+            err = COMP_DOC_CORRUPT;
+            goto _error;
+        }
+
+        path[z] = id;
+        id = compare_entries(&dirs[dirid], &dirs[id]) < 0 ? dirs[id].left_child_dirid : dirs[id].right_child_dirid;
+    }
+
+    path[z] = dirid;
+    k = z;
+
+    if(dirs[dirid].left_child_dirid != COMP_DOC_DIRECTORY_NO_NODE && dirs[dirid].right_child_dirid != COMP_DOC_DIRECTORY_NO_NODE)
+    {
+        for(next = dirs[dirid].right_child_dirid; next != COMP_DOC_DIRECTORY_NO_NODE; next = dirs[next].left_child_dirid)
+        {
+            if(next >= file->ndirs || ++k >= file->ndirs)
+            {
+                err = COMP_DOC_CORRUPT;
+                goto _error;
+            }
+
+            path[k] = next;
+        }
+    }
+
+    // path[k] leaves the tree, its only child takes its place
+    next = path[k];
+    child = dirs[next].left_child_dirid != COMP_DOC_DIRECTORY_NO_NODE ? dirs[next].left_child_dirid : dirs[next].right_child_dirid;
+    colour = dirs[next].colour;
+    left = dirs[path[k - 1]].left_child_dirid == next;
+    replace_child(file, storage_id, path[k - 1], next, child);
+    mark_entry(txn, path[k - 1], &err);
+
+    if(next != dirid)
+    {
+        dirs[next].left_child_dirid = dirs[dirid].left_child_dirid;
+        dirs[next].right_child_dirid = dirs[dirid].right_child_dirid;
+        dirs[next].colour = dirs[dirid].colour;
+        replace_child(file, storage_id, path[z - 1], dirid, next);
+        path[z] = next;
+        mark_entry(txn, path[z - 1], &err);
+        mark_entry(txn, next, &err);
+    }
+
+    path[k] = child;
+
+    // a black entry has gone, the side of `child' is one black short
+    while(colour == COMP_DOC_DIRECTORY_BLACK && k >= 2 && !IS_RED(file, child))
+    {
+        parent = path[k - 1];
+        sibling = left ? dirs[parent].right_child_dirid : dirs[parent].left_child_dirid;
+
+        if(IS_RED(file, sibling))
+        {
+            set_colour(txn, sibling, COMP_DOC_DIRECTORY_BLACK, &err);
+            set_colour(txn, parent, COMP_DOC_DIRECTORY_RED, &err);
+            path[k - 1] = rotate(txn, storage_id, path[k - 2], parent, left, &err);
+            path[k++] = parent;
+            path[k] = child;
+            sibling = left ? dirs[parent].right_child_dirid : dirs[parent].left_child_dirid;
+        }
+
+        // only a tree that broke the rules can lack the sibling
+        if(sibling == COMP_DOC_DIRECTORY_NO_NODE
+            || (!IS_RED(file, dirs[sibling].left_child_dirid) && !IS_RED(file, dirs[sibling].right_child_dirid)))
+        {
+            if(sibling != COMP_DOC_DIRECTORY_NO_NODE)
+                set_colour(txn, sibling, COMP_DOC_DIRECTORY_RED, &err);
+
+            child = parent;
+            k--;
+            left = dirs[path[k - 1]].left_child_dirid == child;
+            continue;
+        }
+
+        // a red inner child of the sibling is moved to the outside first
+        if(!IS_RED(file, left ? dirs[sibling].right_child_dirid : dirs[sibling].left_child_dirid))
+        {
+            set_colour(txn, left ? dirs[sibling].left_child_dirid : dirs[sibling].right_child_dirid,
+                COMP_DOC_DIRECTORY_BLACK, &err);
+            set_colour(txn, sibling, COMP_DOC_DIRECTORY_RED, &err);
+            sibling = rotate(txn, storage_id, parent, sibling, !left, &err);
+        }
+
+        set_colour(txn, sibling, dirs[parent].colour, &err);
+        set_colour(txn, parent, COMP_DOC_DIRECTORY_BLACK, &err);
+        set_colour(txn, left ? dirs[sibling].right_child_dirid : dirs[sibling].left_child_dirid,
+            COMP_DOC_DIRECTORY_BLACK, &err);
+        rotate(txn, storage_id, path[k - 2], parent, left, &err);
+        child = COMP_DOC_DIRECTORY_NO_NODE;
+        break;
+    }
+
+    if(child != COMP_DOC_DIRECTORY_NO_NODE)
+        set_colour(txn, child, COMP_DOC_DIRECTORY_BLACK, &err);
+
+_error:
+    doc_free(file, path);
+
+    return err;
+}
+
+/*
+ * Returns in `parent' the storage that holds the entry `dirid'.
+ */
+static int
+find_parent(comp_doc_file_t *file, uint32_t dirid, uint32_t *parent)
+{
+    comp_doc_dir_iter_t it;
+    int err;
+
+    if((err = comp_doc_iter_init(file, &file->dirs[0], COMP_DOC_ITER_RECURSIVE, &it)) != COMP_DOC_SUCCESS)
+        return err;
+
+    while(comp_doc_iter_next(&it) != NULL)
+    {
+        if(it.dirid == dirid)
+        {
+            *parent = it.parent;
+            return COMP_DOC_SUCCESS;
+        }
+    }
+
+    return it.err != COMP_DOC_SUCCESS ? it.err : COMP_DOC_NO_DIRS;
+}
+
+/*
+ * Returns an unused directory entry, adding a sector to the directory when
+ * every entry is taken.
+ */
+static int
+new_entry(write_txn_t *txn, uint32_t *ret)
+{
+    comp_doc_file_t *file = txn->file;
+    comp_doc_header_t *hdr = file->hdr;
+    comp_doc_directory_t *dirs;
+    uint32_t per_sector, secid, last, i;
+    int err;
+
+    for(i = 1; i < file->ndirs; i++)
+    {
+        dirs = &file->dirs[i];
+
+        if(IS_DIR_EMPTY(dirs))
+        {
+            *ret = i;
+            return COMP_DOC_SUCCESS;
+        }
+    }
+
+    per_sector = txn->sector_size / COMP_DOC_DIRECTORY_SZ;
+
+    if((err = alloc_sector(txn, &secid)) != COMP_DOC_SUCCESS
+        || (err = set_secid(txn, 0, secid, SECID_END_OF_CHAIN)) != COMP_DOC_SUCCESS
+        || (err = chain_nth(file->sat, hdr->first_dir_sector, file->ndirs / per_sector - 1, &last)) != COMP_DOC_SUCCESS
+        || (err = set_secid(txn, 0, last, secid)) != COMP_DOC_SUCCESS)
+        return err;
+
+    dirs = doc_realloc(file, file->dirs, (file->ndirs + per_sector) * sizeof(comp_doc_directory_t));
+
+    if(dirs == NULL)
+        return COMP_DOC_NO_MEM;
+
+    memset(dirs + file->ndirs, 0, per_sector * sizeof(comp_doc_directory_t));
+
+    for(i = file->ndirs; i < file->ndirs + per_sector; i++)
+        dirs[i].left_child_dirid = dirs[i].right_child_dirid = dirs[i].root_dirid = COMP_DOC_DIRECTORY_NO_NODE;
+
+    file->dirs = dirs;
+    *ret = file->ndirs;
+    file->ndirs += per_sector;
+
+    // version 4 headers count the sectors of the directory
+    if(hdr->version >= 4)
+    {
+        hdr->ndir_sectors++;
+        txn->header_dirty = 1;
+    }
+
+    return mark_dir(txn, *ret);
+}
+
+/*
+ * Writes the sectors changed by the call: the tables first, then the
+ * directory and the header that point into them.
+ */
+static int
+txn_flush(write_txn_t *txn)
+{
+    comp_doc_file_t *file = txn->file;
+    comp_doc_header_t *hdr = file->hdr;
+    uint32_t per = txn->sector_size / 4;
+    uint32_t *slots, secid, index;
+    unsigned int i, j;
+    struct stat st;
+    int err;
+
+    slots = doc_malloc(file, txn->sector_size > COMP_DOC_HEADER_SIZE ? txn->sector_size : COMP_DOC_HEADER_SIZE);
+
+    if(slots == NULL)
+        return COMP_DOC_NO_MEM;
+
+    err = COMP_DOC_WRITE_ERR;
+
+    for(i = 0; i < txn->nsat_dirty; i++)
+    {
+        if(txn->sat_dirty[i] && i < file->msat->slots && write_position(file,
+            sector_position(hdr, file->msat->secids[i]), file->sat->secids + i * per, txn->sector_size) < 0)
+            goto _error;
+    }
+
+    for(i = 0; i < txn->nssat_dirty; i++)
+    {
+        if(!txn->ssat_dirty[i])
+            continue;
+
+        if((err = chain_nth(file->sat, hdr->first_ssat_sector, i, &secid)) != COMP_DOC_SUCCESS)
+            goto _error;
+
+        err = COMP_DOC_WRITE_ERR;
+
+        if(write_position(file, sector_position(hdr, secid), file->ssat->secids + i * per, txn->sector_size) < 0)
+            goto _error;
+    }
+
+    if(txn->msat_dirty >= 0)
+    {
+        if((err = load_msat_sectors(txn)) != COMP_DOC_SUCCESS)
+            goto _error;
+
+        err = COMP_DOC_WRITE_ERR;
+
+        for(i = txn->msat_dirty; i < hdr->nmsat_sectors; i++)
+        {
+            for(j = 0; j < per - 1; j++)
+            {
+                index = COMP_DOC_HEADER_MSAT_SLOTS + i * (per - 1) + j;
+                slots[j] = index < file->msat->slots ? file->msat->secids[index] : SECID_FREE;
+            }
+
+            slots[per - 1] = i + 1 < hdr->nmsat_sectors ? txn->msat_sectors[i + 1] : SECID_END_OF_CHAIN;
+
+            if(write_position(file, sector_position(hdr, txn->msat_sectors[i]), slots, txn->sector_size) < 0)
+                goto _error;
+        }
+    }
+
+    for(i = 0; i < txn->ndir_dirty; i++)
+    {
+        if(!txn->dir_dirty[i])
+            continue;
+
+        if((err = chain_nth(file->sat, hdr->first_dir_sector, i, &secid)) != COMP_DOC_SUCCESS)
+            goto _error;
+
+        err = COMP_DOC_WRITE_ERR;
+
+        if(write_position(file, sector_position(hdr, secid),
+            file->dirs + i * (txn->sector_size / COMP_DOC_DIRECTORY_SZ), txn->sector_size) < 0)
+            goto _error;
+    }
+
+    // sectors past the end of the file are only partly written, pad it to whole sectors
+    if(txn->end > 0)
+    {
+        STATS_ADD(file, syscalls, 1);
+
+        if(fstat(file->fd, &st) < 0)
+            goto _error;
+
+        STATS_ADD(file, syscalls, st.st_size < txn->end);
+
+        if(st.st_size < txn->end && ftruncate(file->fd, txn->end) < 0)
+            goto _error;
+    }
+
+    if(txn->header_dirty)
+    {
+        // the header is followed by the first part of the MSAT
+        for(j = 0; j < COMP_DOC_HEADER_MSAT_SLOTS; j++)
+            slots[j] = j < file->msat->slots ? file->msat->secids[j] : SECID_FREE;
+
+        if(write_position(file, 0, hdr, sizeof(comp_doc_header_t)) < 0
+            || write_position(file, sizeof(comp_doc_header_t), slots, COMP_DOC_HEADER_MSAT_SLOTS * sizeof(uint32_t)) < 0)
+            goto _error;
+    }
+
+    // the container held in memory is read again with the new data
+    if(file->flags & COMP_DOC_OPEN_CACHE_MINISTREAM)
+    {
+        doc_free(file, file->mini_container);
+
+        if((err = read_ministream(file, &file->mini_container, &file->mini_container_size)) != COMP_DOC_SUCCESS)
+            goto _error;
+    }
+
+    err = COMP_DOC_SUCCESS;
+
+_error:
+    doc_free(file, slots);
+
+    return err;
+}
+
+static void
+invalidate_name_index(comp_doc_file_t *file)
+{
+    free_name_index(file, file->name_index);
+    file->name_index = NULL;
+}
+
+/*
+ * Version 3 entries hold 32-bit sizes, and no chain can have more sectors
+ * than there are SecIDs.
+ */
+static int
+valid_size(comp_doc_file_t *file, uint64_t size)
+{
+    if(file->hdr->version < 4)
+        return size <= UINT32_MAX;
+
+    return size / CALC_SECTOR_SIZE(file->hdr->ssz) < SECID_MSAT;
+}
+
+static uint32_t
+count_sectors(comp_doc_file_t *file, uint64_t size)
+{
+    uint32_t sector_size;
+
+    if(size < file->hdr->stream_min_size)
+        sector_size = CALC_SHORT_SECTOR_SIZE(file->hdr->sssz);
+    else
+        sector_size = CALC_SECTOR_SIZE(file->hdr->ssz);
+
+    return (size + sector_size - 1) / sector_size;
+}
+
+/*
+ * Creates an empty stream called `name' (UTF-8) in `storage'. The entry of
+ * the new stream is returned in `ret_dir' unless it is NULL.
+ */
+int
+comp_doc_create_stream(comp_doc_file_t *file, comp_doc_directory_t *storage, const char *name, comp_doc_directory_t **ret_dir)
+{
+    uint16_t units[COMP_DOC_DIRECTORY_NAME_SIZE / 2];
+    comp_doc_directory_t *dir;
+    write_txn_t txn;
+    uint32_t storage_id, dirid;
+    int length, i, err;
+
+    if(ret_dir != NULL)
+        *ret_dir = NULL;
+
+    if((err = check_writable(file)) != COMP_DOC_SUCCESS)
+        return err;
+
+    if(!IS_DIR_STORAGE(storage) && !IS_DIR_ROOT_ENTRY(storage))
+        return COMP_DOC_NO_DIRS;
+
+    length = name_from_utf8(name, strlen(name), units);
+
+    if(length <= 0 || strpbrk(name, "/\\:!") != NULL)
+        return COMP_DOC_INVALID_NAME;
+
+    if(comp_doc_get_child(file, storage, name) != NULL)
+        return COMP_DOC_ENTRY_EXISTS;
+
+    // the root entry read on its own stands for the first entry
+    if(storage >= file->dirs && storage < file->dirs + file->ndirs)
+        storage_id = storage - file->dirs;
+    else
+        storage_id = 0;
+
+    txn_init(&txn, file);
+
+    if((err = new_entry(&txn, &dirid)) != COMP_DOC_SUCCESS)
+        goto _error;
+
+    dir = &file->dirs[dirid];
+    memset(dir, 0, sizeof(comp_doc_directory_t));
+
+    for(i = 0; i < length; i++)
+    {
+        dir->name[2 * i] = units[i] & 0xFF;
+        dir->name[2 * i + 1] = units[i] >> 8;
+    }
+
+    dir->name_length = 2 * (length + 1);
+    dir->entry_type = COMP_DOC_DIRECTORY_TYPE_USER_STREAM;
+    dir->left_child_dirid = dir->right_child_dirid = dir->root_dirid = COMP_DOC_DIRECTORY_NO_NODE;
+    dir->first_sector = SECID_END_OF_CHAIN;
+
+    if((err = tree_insert(&txn, storage_id, dirid)) != COMP_DOC_SUCCESS)
+        goto _error;
+
+    invalidate_name_index(file);
+
+    if((err = txn_flush(&txn)) == COMP_DOC_SUCCESS && ret_dir != NULL)
+        *ret_dir = &file->dirs[dirid];
+
+_error:
+    txn_free(&txn);
+
+    return err;
+}
+
+/*
+ * Replaces the contents of a stream with `size' bytes of `data'. When the
+ * stream stays on the same side of the cutoff of short streams, its sectors
+ * are overwritten in place and only the ones it gains or loses change in the
+ * tables. Otherwise it moves to the other table.
+ */
+int
+comp_doc_write_stream(comp_doc_file_t *file, comp_doc_directory_t *dir, const unsigned char *data, size_t size)
+{
+    write_txn_t txn;
+    uint32_t first, old_n, new_n;
+    int old_short, new_short, err;
+
+    if((err = check_writable(file)) != COMP_DOC_SUCCESS)
+        return err;
+
+    if(!IS_DIR_STREAM(dir))
+        return COMP_DOC_NO_STREAM;
+
+    if(!valid_size(file, size))
+        return COMP_DOC_WRITE_ERR;
+
+    txn_init(&txn, file);
+
+    old_short = dir->size < file->hdr->stream_min_size;
+    new_short = size < file->hdr->stream_min_size;
+    old_n = count_sectors(file, dir->size);
+    new_n = count_sectors(file, size);
+    first = SECID_END_OF_CHAIN;
+    err = COMP_DOC_SUCCESS;
+
+    if(old_short == new_short)
+        err = resize_chain(&txn, new_short, dir->first_sector, old_n, new_n, &first);
+    else if(new_n > 0)
+        err = extend_chain(&txn, new_short, SECID_END_OF_CHAIN, new_n, &first);
+
+    if(err != COMP_DOC_SUCCESS)
+        goto _error;
+
+    // the data goes out before the tables that point at it
+    if((err = write_chain(&txn, new_short, first, 0, data, size)) != COMP_DOC_SUCCESS)
+        goto _error;
+
+    if(old_short != new_short && old_n > 0
+        && (err = free_chain(&txn, old_short, dir->first_sector)) != COMP_DOC_SUCCESS)
+        goto _error;
+
+    dir->first_sector = first;
+    dir->size = size;
+
+    if((err = mark_dir(&txn, dir - file->dirs)) == COMP_DOC_SUCCESS)
+        err = txn_flush(&txn);
+
+_error:
+    txn_free(&txn);
+
+    return err;
+}
+
+/*
+ * Sets the size of a stream, as ftruncate does: the bytes past `size' are
+ * dropped, and a stream that grows is padded with zeros.
+ */
+int
+comp_doc_truncate_stream(comp_doc_file_t *file, comp_doc_directory_t *dir, size_t size)
+{
+    write_txn_t txn;
+    unsigned char *kept;
+    uint32_t first, start, old_n, new_n, sector_size;
+    uint64_t keep;
+    int old_short, new_short, err;
+
+    if((err = check_writable(file)) != COMP_DOC_SUCCESS)
+        return err;
+
+    if(!IS_DIR_STREAM(dir))
+        return COMP_DOC_NO_STREAM;
+
+    if(!valid_size(file, size))
+        return COMP_DOC_WRITE_ERR;
+
+    if(size == dir->size)
+        return COMP_DOC_SUCCESS;
+
+    txn_init(&txn, file);
+    kept = NULL;
+
+    old_short = dir->size < file->hdr->stream_min_size;
+    new_short = size < file->hdr->stream_min_size;
+    old_n = count_sectors(file, dir->size);
+    new_n = count_sectors(file, size);
+    sector_size = new_short ? (uint32_t)CALC_SHORT_SECTOR_SIZE(file->hdr->sssz) : txn.sector_size;
+    keep = dir->size < size ? dir->size : size;
+
+    if(old_short == new_short)
+    {
+        if((err = resize_chain(&txn, new_short, dir->first_sector, old_n, new_n, &first)) != COMP_DOC_SUCCESS)
+            goto _error;
+    }
+    else
+    {
+        // the kept bytes move to the other table
+        if((kept = doc_malloc(file, keep ? keep : 1)) == NULL)
+        {
+            err = COMP_DOC_NO_MEM;
+            goto _error;
+        }
+
+        if((err = comp_doc_read_stream_into(file, dir, kept, keep)) < 0)
+            goto _error;
+
+        first = SECID_END_OF_CHAIN;
+
+        if((new_n > 0 && (err = extend_chain(&txn, new_short, SECID_END_OF_CHAIN, new_n, &first)) != COMP_DOC_SUCCESS)
+            || (err = write_chain(&txn, new_short, first, 0, kept, keep)) != COMP_DOC_SUCCESS)
+            goto _error;
+    }
+
+    if(size > keep)
+    {
+        if((err = chain_nth(new_short ? file->ssat : file->sat, first, keep / sector_size, &start)) != COMP_DOC_SUCCESS
+            || (err = write_chain(&txn, new_short, start, keep % sector_size, NULL, size - keep)) != COMP_DOC_SUCCESS)
+            goto _error;
+    }
+
+    if(old_short != new_short && old_n > 0
+        && (err = free_chain(&txn, old_short, dir->first_sector)) != COMP_DOC_SUCCESS)
+        goto _error;
+
+    dir->first_sector = first;
+    dir->size = size;
+
+    if((err = mark_dir(&txn, dir - file->dirs)) == COMP_DOC_SUCCESS)
+        err = txn_flush(&txn);
+
+_error:
+    doc_free(file, kept);
+    txn_free(&txn);
+
+    return err;
+}
+
+/*
+ * Deletes a stream: its sectors are freed and its entry becomes unused.
+ */
+int
+comp_doc_delete_stream(comp_doc_file_t *file, comp_doc_directory_t *dir)
+{
+    write_txn_t txn;
+    uint32_t dirid, parent;
+    int err;
+
+    if((err = check_writable(file)) != COMP_DOC_SUCCESS)
+        return err;
+
+    if(!IS_DIR_STREAM(dir) || dir < file->dirs || dir >= file->dirs + file->ndirs)
+        return COMP_DOC_NO_STREAM;
+
+    dirid = dir - file->dirs;
+
+    if((err = find_parent(file, dirid, &parent)) != COMP_DOC_SUCCESS)
+        return err;
+
+    txn_init(&txn, file);
+
+    if(dir->size > 0 && (err = free_chain(&txn, dir->size < file->hdr->stream_min_size, dir->first_sector)) != COMP_DOC_SUCCESS)
+        goto _error;
+
+    if((err = tree_remove(&txn, parent, dirid)) != COMP_DOC_SUCCESS)
+        goto _error;
+
+    memset(dir, 0, sizeof(comp_doc_directory_t));
+    dir->left_child_dirid = dir->right_child_dirid = dir->root_dirid = COMP_DOC_DIRECTORY_NO_NODE;
+
+    invalidate_name_index(file);
+
+    if((err = mark_dir(&txn, dirid)) == COMP_DOC_SUCCESS)
+        err = txn_flush(&txn);
+
+_error:
+    txn_free(&txn);
+
+    return err;
+}
@@ -0,0 +1,24 @@
+#ifndef _COMP_DOC_WRITE_H_
+#define _COMP_DOC_WRITE_H_
+#include "compdoc.h"
+#include "io.h"
+
+/*
+ * Streams of a file opened with COMP_DOC_PERM_WRITE or COMP_DOC_PERM_READ_WRITE
+ * can be created, rewritten, resized and deleted in place. Only the sectors
+ * that change are written: the data of the stream, and the sectors of the
+ * tables and of the directory that hold modified entries. Free sectors are
+ * reused before the file grows. Files opened with COMP_DOC_OPEN_MMAP cannot
+ * be written.
+ *
+ * A write must not run concurrently with any other call on the same file,
+ * and stream handles and views from comp_doc_map_stream obtained before it
+ * must be released. Creating a stream may grow the directory, which moves
+ * its entries in memory, so pointers to entries obtained before have to be
+ * looked up again. A failed write may leave the file inconsistent.
+ */
+int comp_doc_create_stream(comp_doc_file_t *, comp_doc_directory_t *, const char *, comp_doc_directory_t **);
+int comp_doc_write_stream(comp_doc_file_t *, comp_doc_directory_t *, const unsigned char *, size_t);
+int comp_doc_truncate_stream(comp_doc_file_t *, comp_doc_directory_t *, size_t);
+int comp_doc_delete_stream(comp_doc_file_t *, comp_doc_directory_t *);
+#endif /* _COMP_DOC_WRITE_H_ */